@@ -10,6 +10,18 @@
 #include "rv_emu.h"
 #include "system.h"
 
+/* Instructions to run between checks of the host side events */
+#define RUN_BUDGET (1024 * 1024)
+
+/* Average number of instructions between profiler samples */
+#define PROF_INTERVAL 10000
+#define FOLDED_STACKS_FILE "guest.folded"
+
+/* Peripheral events raised by the guest */
+#define EVENT_SERIAL_TX (1 << 0)
+#define EVENT_RTC       (1 << 1)
+#define EVENT_VSYNC     (1 << 2)
+
 static device_t dev = {0};
 
 int main(int argc, char **argv)
@@ -32,13 +44,25 @@ int main(int argc, char **argv)
 
     if (argc >= 3)
     {
-        if (!device_load_ilp_table(&dev, argv[2]))
+        /* Either an ILP table file or a slice length to slice the code at run time */
+        char *end;
+        uint32_t slice_len = strtoul(argv[2], &end, 0);
+
+        bool ok = *end ? device_load_ilp_table(&dev, argv[2]) : device_slice_ilp(&dev, slice_len);
+
+        if (!ok)
         {
             exit(-1);
         }
     }
 
-    device_pre_unpack_instructions(&dev);
+    /* Only code that actually runs gets decoded */
+    device_lazy_unpack_instructions(&dev);
+
+    /* Stop the emulation whenever the serial, RTC or display flags are set */
+    device_watch_mmio(&dev, SERIAL_TX_FLAG_ADDR, 1, EVENT_SERIAL_TX);
+    device_watch_mmio(&dev, RTC_FLAG_ADDR, 1, EVENT_RTC);
+    device_watch_mmio(&dev, DISP_VSYNC_FLAG_ADDR, 1, EVENT_VSYNC);
 
     InitWindow(640, 400, "RISC-V device");
 
@@ -63,19 +87,25 @@ int main(int argc, char **argv)
 
         while (!exit_reached)
         {
-            if (!device_run_cycle(&dev))
+            run_reason_t reason;
+            uint64_t n_cycles = device_run(&dev, RUN_BUDGET, &reason);
+
+            total_cycles += n_cycles;
+            frame_cycles += n_cycles;
+
+            if (reason == RUN_FAULT)
             {
                 printf("Error running a cycle!\n");
                 fflush(stdout);
                 exit_reached = true;
                 break;
             }
-            else
+
+            /* The program has something to say */
+            if (dev.events & EVENT_SERIAL_TX)
             {
-                total_cycles++;
-                frame_cycles++;
+                dev.events &= ~EVENT_SERIAL_TX;
 
-                /* The program has something to say */
                 if (dev.periph.data[1] && prog_output_n < (sizeof(prog_output) - 1))
                 {
                     dev.periph.data[1] = 0;
@@ -89,29 +119,37 @@ int main(int argc, char **argv)
                         prog_output_n = 0;
                     }
                 }
+            }
+
+            /* The program wants to know what time is it */
+            if (dev.events & EVENT_RTC)
+            {
+                dev.events &= ~EVENT_RTC;
+
+                if (dev.periph.data[0x0c])
+                {
+                    dev.periph.data[0x0c] = 0;
+                    *((uint32_t*)&dev.periph.data[0x04]) = (uint32_t)(GetTime() * 1000.0);
+                }
+            }
+
+            /* The program has something to show */
+            if (dev.events & EVENT_VSYNC)
+            {
+                dev.events &= ~EVENT_VSYNC;
 
-                /* The program has something to show */
                 if (dev.periph.data[0x24])
                 {
                     dev.periph.data[0x24] = 0;
                     memcpy(canvas.data, &dev.periph.data[0x28], DISP_VRAM_SIZE);
                     printf("CPU cycles per frame: %lu\n", frame_cycles);
-                    device_printout_instruction_stats(&dev);
-                    // memset(dev.inst_stats, 0, sizeof(dev.inst_stats));
                     frame_cycles = 0;
                     fflush(stdout);
                     break;
                 }
-
-                /* The program wants to know what time is it */
-                if (dev.periph.data[0x0c])
-                {
-                    dev.periph.data[0x0c] = 0;
-                    *((uint32_t*)&dev.periph.data[0x04]) = (uint32_t)(GetTime() * 1000.0);
-                }
             }
 
-            if (dev.pc == dev.exit_addr || IsKeyPressed(KEY_X))
+            if (reason == RUN_EXIT_REACHED || IsKeyPressed(KEY_X))
             {
                 printf("Program done!\n");
                 printf("Elapsed CPU cycles: %lu\n", total_cycles);
@@ -130,11 +168,57 @@ int main(int argc, char **argv)
         DrawFPS(10, 10);
         EndDrawing();
     
+        /* Instruction stats are collected between two presses of S */
+        if (IsKeyPressed(KEY_S))
+        {
+            if (dev.stats)
+            {
+                device_set_inst_stats(&dev, false);
+                device_printout_instruction_stats(&dev);
+                fflush(stdout);
+            }
+            else
+            {
+                memset(dev.inst_stats, 0, sizeof(dev.inst_stats));
+                device_set_inst_stats(&dev, true);
+            }
+        }
+
+        /* The guest is profiled between two presses of P, call chains are
+           saved for flamegraph tools */
+        if (IsKeyPressed(KEY_P))
+        {
+            if (dev.prof_interval)
+            {
+                device_printout_profile(&dev);
+                device_save_folded_stacks(&dev, FOLDED_STACKS_FILE);
+                device_start_profiler(&dev, 0);
+                device_track_calls(&dev, false);
+                fflush(stdout);
+            }
+            else
+            {
+                device_track_calls(&dev, true);
+                device_start_profiler(&dev, PROF_INTERVAL);
+            }
+        }
+
         if (exit_reached && IsKeyPressed(KEY_SPACE))
         {
             break;
         }
     }
 
+    if (dev.stats)
+    {
+        device_printout_instruction_stats(&dev);
+    }
+
+    if (dev.prof_interval)
+    {
+        device_printout_profile(&dev);
+        device_save_folded_stacks(&dev, FOLDED_STACKS_FILE);
+    }
+
     CloseWindow();
 }
@@ -33,8 +33,6 @@ typedef struct
 #define DISP_TEX_WIDTH      (NUM_DISPS_IN_ROW * DISP_WIDTH)
 #define DISP_TEX_HEIGHT     (NUM_DISPS_IN_COLUMN * DISP_HEIGHT)
 
-static uint8_t rom_img[ROM_SIZE] = {0};
-static uint8_t ram_img[RAM_SIZE] = {0};
 static cpu_t cpus[NUM_CPUS] = {0};
 static device_t dev = {0};
 
@@ -71,22 +69,20 @@ int main(void)
     device_pre_unpack_instructions(&dev);
     uint32_t num_insts = (dev.prog_end - dev.rom.origin) / 4;
 
-    memcpy(rom_img, dev.rom.data, dev.rom.size);
-    memcpy(ram_img, dev.ram.data, RAM_SIZE);
-
+    /* Buffers are uploaded straight from the device memory */
     for (int i = 0; i < NUM_CPUS; i++)
     {
         cpus[i].pc = dev.pc;
     }
 
-    unsigned int ssbo_rom = rlLoadShaderBuffer(ROM_SIZE, rom_img, RL_DYNAMIC_COPY);
-    unsigned int ssbo_ram = rlLoadShaderBuffer(sizeof(ram_img) * NUM_CPUS, NULL, RL_DYNAMIC_COPY);
+    unsigned int ssbo_rom = rlLoadShaderBuffer(ROM_SIZE, dev.rom.data, RL_DYNAMIC_COPY);
+    unsigned int ssbo_ram = rlLoadShaderBuffer(RAM_SIZE * NUM_CPUS, NULL, RL_DYNAMIC_COPY);
     unsigned int ssbo_cpus = rlLoadShaderBuffer(sizeof(cpus), cpus, RL_DYNAMIC_COPY);
-    unsigned int ssbo_uinsts = rlLoadShaderBuffer(sizeof(uinst_t) * num_insts, dev.uinsts, RL_DYNAMIC_COPY);
+    unsigned int ssbo_cinsts = rlLoadShaderBuffer(sizeof(cinst_t) * num_insts, dev.cinsts, RL_DYNAMIC_COPY);
 
     for (int i = 0; i < NUM_CPUS; i++)
     {
-        rlUpdateShaderBuffer(ssbo_ram, ram_img, sizeof(ram_img), sizeof(ram_img) * i);
+        rlUpdateShaderBuffer(ssbo_ram, dev.ram.data, RAM_SIZE, RAM_SIZE * i);
     }
 
     Image img = GenImageColor(DISP_TEX_WIDTH, DISP_TEX_HEIGHT, GRAY);
@@ -114,7 +110,7 @@ int main(void)
         rlBindShaderBuffer(ssbo_cpus, 1);
         rlBindShaderBuffer(ssbo_rom, 2);
         rlBindShaderBuffer(ssbo_ram, 3);
-        rlBindShaderBuffer(ssbo_uinsts, 4);
+        rlBindShaderBuffer(ssbo_cinsts, 4);
         rlComputeShaderDispatch(NUM_DISPS_IN_ROW, NUM_DISPS_IN_COLUMN, 1);
         rlDisableShader();
 
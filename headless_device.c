@@ -0,0 +1,693 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rv_emu.h"
+#include "system.h"
+
+/* Instructions to run between checks of the host side events */
+#define RUN_BUDGET (1024 * 1024)
+
+/* Default guest memory sizes, --rom-size and --ram-size override them */
+#define ROM_SIZE (1024 * 1024 * 16)
+#define RAM_SIZE (1024 * 1024 * 8)
+
+/* Default average number of instructions between profiler samples */
+#define PROF_INTERVAL 10000
+
+/* Peripheral events raised by the guest */
+#define EVENT_SERIAL_TX (1 << 0)
+#define EVENT_RTC       (1 << 1)
+#define EVENT_VSYNC     (1 << 2)
+#define EVENT_SERIAL_RX (1 << 3)
+
+/* Children of --fork, each one runs with its own line of --inputs */
+#define MAX_CHILDREN 1024
+
+static device_t dev = {0};
+
+/* Bytes the guest reads from the serial rx register */
+static const char *serial_input = "";
+static size_t serial_input_pos = 0;
+
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void print_usage(const char *name)
+{
+    printf("Usage: %s [--jit] [--fuse] [--flat] [--eager] [--decode-cache] [--stats] [--profile N] [--folded FILE] [--max-frames N] [--rom-size N[K|M]] [--ram-size N[K|M]] [--huge-pages] [--snapshot FILE] [--save-snapshot FILE] [--runs N] [--boot-to SYMBOL|ADDR] [--boot-insts N] [--inputs FILE] [--fork N] [--slice N] [--simd] program.elf [ilp_table]\n", name);
+}
+
+
+/* Size argument in bytes with an optional K or M suffix, 0 if malformed */
+static uint32_t parse_size(const char *arg)
+{
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+
+    if (*end == 'K' || *end == 'k')
+    {
+        size *= 1024;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        size *= 1024 * 1024;
+        end++;
+    }
+
+    return (*end || size > UINT32_MAX) ? 0 : (uint32_t)size;
+}
+
+
+/* Put the next input byte in the rx register once the guest cleared its
+   flag after reading the previous one */
+static void serial_feed(void)
+{
+    if (!dev.periph.data[3] && serial_input[serial_input_pos])
+    {
+        dev.periph.data[2] = serial_input[serial_input_pos++];
+        dev.periph.data[3] = 1;
+    }
+}
+
+
+/* Run the guest until it exits, faults, shows max_frames frames or runs
+   max_insts instructions */
+static bool run_guest(uint64_t max_frames, uint64_t max_insts)
+{
+    char prog_output[1024] = {0};
+    int prog_output_n = 0;
+    uint64_t total_cycles = 0;
+    uint64_t n_frames = 0;
+    double start_time = get_time();
+    bool ok = true;
+
+    serial_input_pos = 0;
+    serial_feed();
+
+    for (;;)
+    {
+        run_reason_t reason;
+        uint64_t budget = RUN_BUDGET;
+
+        if (max_insts && max_insts - total_cycles < budget)
+        {
+            budget = max_insts - total_cycles;
+        }
+
+        total_cycles += device_run(&dev, budget, &reason);
+
+        if (reason == RUN_FAULT)
+        {
+            printf("Error running a cycle at 0x%08X!\n", dev.pc);
+            ok = false;
+            break;
+        }
+
+        if (reason == RUN_EXIT_REACHED)
+        {
+            break;
+        }
+
+        if ((dev.events & EVENT_SERIAL_TX) && dev.periph.data[1] &&
+            prog_output_n < (sizeof(prog_output) - 1))
+        {
+            dev.periph.data[1] = 0;
+            prog_output[prog_output_n++] = dev.periph.data[0];
+
+            if (prog_output[prog_output_n - 1] == '\n')
+            {
+                printf("PROG OUTPUT: %s", prog_output);
+                memset(prog_output, 0, sizeof(prog_output));
+                prog_output_n = 0;
+            }
+        }
+
+        if ((dev.events & EVENT_RTC) && dev.periph.data[0x0c])
+        {
+            dev.periph.data[0x0c] = 0;
+            *((uint32_t*)&dev.periph.data[0x04]) = (uint32_t)((get_time() - start_time) * 1000.0);
+        }
+
+        if ((dev.events & EVENT_VSYNC) && dev.periph.data[0x24])
+        {
+            dev.periph.data[0x24] = 0;
+            n_frames++;
+        }
+
+        if (dev.events & EVENT_SERIAL_RX)
+        {
+            serial_feed();
+        }
+
+        dev.events = 0;
+
+        if ((max_frames && n_frames >= max_frames) ||
+            (max_insts && total_cycles >= max_insts))
+        {
+            break;
+        }
+    }
+
+    double elapsed = get_time() - start_time;
+
+    if (prog_output_n)
+    {
+        printf("PROG OUTPUT: %s\n", prog_output);
+    }
+
+    printf("Elapsed CPU cycles: %lu\n", total_cycles);
+    printf("Frames: %lu\n", n_frames);
+    printf("Time: %.3f s, %.1f MIPS\n", elapsed, total_cycles / elapsed / 1e6);
+
+    return ok;
+}
+
+
+/* Run the booted guest in n_children processes sharing its memory copy on
+   write, child i reading inputs[i % n_inputs] from the serial port. Their
+   output is collected and printed along with the guest exit codes */
+static bool fan_out(uint32_t n_children, char **inputs, uint32_t n_inputs,
+                    uint64_t max_frames)
+{
+    static pid_t pids[MAX_CHILDREN];
+    static struct pollfd fds[MAX_CHILDREN];
+    static char *outputs[MAX_CHILDREN];
+    static size_t output_sizes[MAX_CHILDREN];
+    double start_time = get_time();
+    bool ok = true;
+
+    fflush(stdout);
+
+    for (uint32_t i = 0; i < n_children; i++)
+    {
+        int pipe_fds[2];
+
+        if (pipe(pipe_fds) || (pids[i] = fork()) < 0)
+        {
+            printf("Error: can't start child %u\n", i);
+            n_children = i;
+            ok = false;
+            break;
+        }
+
+        if (!pids[i])
+        {
+            close(pipe_fds[0]);
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            close(pipe_fds[1]);
+
+            device_ilp_forked(&dev);
+            serial_input = n_inputs ? inputs[i % n_inputs] : "";
+            bool child_ok = run_guest(max_frames, 0);
+            fflush(stdout);
+
+            /* _exit passes the status in a0 */
+            _exit(child_ok ? dev.regs[10] & 0x7f : 255);
+        }
+
+        close(pipe_fds[1]);
+        fds[i].fd = pipe_fds[0];
+        fds[i].events = POLLIN;
+    }
+
+    for (uint32_t n_open = n_children; n_open; )
+    {
+        if (poll(fds, n_children, -1) < 0)
+        {
+            break;
+        }
+
+        for (uint32_t i = 0; i < n_children; i++)
+        {
+            if (fds[i].fd < 0 || !fds[i].revents)
+            {
+                continue;
+            }
+
+            char buf[4096];
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+
+            if (n <= 0)
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                n_open--;
+                continue;
+            }
+
+            char *output = realloc(outputs[i], output_sizes[i] + n + 1);
+
+            if (output)
+            {
+                memcpy(output + output_sizes[i], buf, n);
+                output_sizes[i] += n;
+                output[output_sizes[i]] = 0;
+                outputs[i] = output;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < n_children; i++)
+    {
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) != 255)
+        {
+            printf("Child %u: exit code %d\n", i, WEXITSTATUS(status));
+        }
+        else
+        {
+            printf("Child %u: failed\n", i);
+            ok = false;
+        }
+
+        printf("%s", outputs[i] ? outputs[i] : "");
+        free(outputs[i]);
+    }
+
+    printf("Children: %u in %.3f s\n", n_children, get_time() - start_time);
+
+    return ok;
+}
+
+
+/* Lines of a text file, NULL if it can't be read */
+static char **read_lines(const char *file_name, uint32_t *n_lines)
+{
+    FILE *file = fopen(file_name, "r");
+    char **lines = NULL;
+    char line[1024];
+
+    *n_lines = 0;
+
+    if (!file)
+    {
+        printf("Error: unable to open '%s'\n", file_name);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char **new_lines = realloc(lines, (*n_lines + 1) * sizeof(char*));
+
+        if (!new_lines)
+        {
+            break;
+        }
+
+        lines = new_lines;
+        lines[(*n_lines)++] = strdup(line);
+    }
+
+    fclose(file);
+
+    return lines;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *elf_path = NULL;
+    const char *ilp_path = NULL;
+    uint32_t slice_len = 0;
+    bool simd = false;
+    bool use_jit = false;
+    bool fuse = false;
+    bool flat = false;
+    bool eager = false;
+    bool decode_cache = false;
+    bool stats = false;
+    uint32_t prof_interval = 0;
+    const char *folded_path = NULL;
+    uint64_t max_frames = 0;
+    uint32_t rom_size = ROM_SIZE;
+    uint32_t ram_size = RAM_SIZE;
+    bool huge_pages = false;
+    const char *snapshot_path = NULL;
+    const char *save_snapshot_path = NULL;
+    uint32_t n_runs = 1;
+    const char *boot_to = NULL;
+    uint64_t boot_insts = 0;
+    const char *inputs_path = NULL;
+    uint32_t n_children = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--jit"))
+        {
+            use_jit = true;
+        }
+        else if (!strcmp(argv[i], "--fuse"))
+        {
+            fuse = true;
+        }
+        else if (!strcmp(argv[i], "--flat"))
+        {
+            flat = true;
+        }
+        else if (!strcmp(argv[i], "--eager"))
+        {
+            eager = true;
+        }
+        else if (!strcmp(argv[i], "--decode-cache"))
+        {
+            decode_cache = true;
+        }
+        else if (!strcmp(argv[i], "--stats"))
+        {
+            stats = true;
+        }
+        else if (!strcmp(argv[i], "--profile") && i + 1 < argc)
+        {
+            prof_interval = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--folded") && i + 1 < argc)
+        {
+            folded_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--max-frames") && i + 1 < argc)
+        {
+            max_frames = strtoull(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--rom-size") && i + 1 < argc)
+        {
+            rom_size = parse_size(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--ram-size") && i + 1 < argc)
+        {
+            ram_size = parse_size(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--huge-pages"))
+        {
+            huge_pages = true;
+        }
+        else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc)
+        {
+            snapshot_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--save-snapshot") && i + 1 < argc)
+        {
+            save_snapshot_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+        {
+            n_runs = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--boot-to") && i + 1 < argc)
+        {
+            boot_to = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--boot-insts") && i + 1 < argc)
+        {
+            boot_insts = strtoull(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--inputs") && i + 1 < argc)
+        {
+            inputs_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--fork") && i + 1 < argc)
+        {
+            n_children = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--slice") && i + 1 < argc)
+        {
+            slice_len = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--simd"))
+        {
+            simd = true;
+        }
+        else if (argv[i][0] == '-')
+        {
+            print_usage(argv[0]);
+            exit(-1);
+        }
+        else if (!elf_path)
+        {
+            elf_path = argv[i];
+        }
+        else
+        {
+            ilp_path = argv[i];
+        }
+    }
+
+    if (!elf_path)
+    {
+        printf("Error: a 32-bit ELF file is expected as argument\n");
+        print_usage(argv[0]);
+        exit(-1);
+    }
+
+    if (!rom_size || !ram_size)
+    {
+        printf("Error: invalid memory size\n");
+        print_usage(argv[0]);
+        exit(-1);
+    }
+
+    device_init(&dev,
+                rom_size,           0x08000000,    /* FLASH */
+                ram_size,           0x20000000,    /* RAM */
+                64 + DISP_VRAM_SIZE, 0x01000000);  /* Peripherals: serial tx/rx, RTC, screen buffer 320x200 */
+
+    if (flat && !device_use_flat_memory(&dev))
+    {
+        exit(-1);
+    }
+
+    if (huge_pages && !device_use_huge_pages(&dev))
+    {
+        exit(-1);
+    }
+
+    if (!device_load_from_elf(&dev, elf_path))
+    {
+        exit(-1);
+    }
+
+    if (ilp_path)
+    {
+        if (!device_load_ilp_table(&dev, ilp_path))
+        {
+            exit(-1);
+        }
+    }
+    else if (slice_len && !device_slice_ilp(&dev, slice_len))
+    {
+        exit(-1);
+    }
+
+    if (simd)
+    {
+        device_use_ilp_simd(&dev, true);
+    }
+
+    /* Decoding the whole program up front is only worth it for comparisons,
+       or to save it next to the ELF for the next runs of the same image */
+    char cache_path[4096];
+    snprintf(cache_path, sizeof(cache_path), "%s.rvdc", elf_path);
+
+    const char *decode_mode = eager ? "eager" : "lazy";
+    double decode_time = get_time();
+
+    if (decode_cache && device_load_decode_cache(&dev, cache_path))
+    {
+        decode_mode = "cached";
+    }
+    else if (decode_cache)
+    {
+        device_pre_unpack_instructions(&dev);
+        decode_mode = device_save_decode_cache(&dev, cache_path) ? "eager, cache saved" : "eager";
+    }
+    else if (eager)
+    {
+        device_pre_unpack_instructions(&dev);
+    }
+    else
+    {
+        device_lazy_unpack_instructions(&dev);
+    }
+
+    decode_time = get_time() - decode_time;
+    dev.jit = use_jit;
+
+    /* Dispatch reads the decoded instruction and the handler of its slot,
+       the uinst_t and cinst_t arrays are both kept either way */
+    uint32_t num_insts = (dev.prog_end - dev.rom.origin) / 4;
+#ifdef RV_WIDE_UINSTS
+    printf("Decoded instructions: %u x %lu bytes (uinst_t and handler)\n",
+           num_insts, sizeof(uinst_t) + sizeof(void*));
+#else
+    printf("Decoded instructions: %u x %lu bytes (cinst_t and handler)\n",
+           num_insts, sizeof(cinst_t) + sizeof(void*));
+#endif
+    printf("Decoded program: %lu KB\n",
+           num_insts * (sizeof(uinst_t) + sizeof(cinst_t) + sizeof(void*)) / 1024);
+    printf("Decode setup: %.3f ms (%s)\n", decode_time * 1000.0, decode_mode);
+
+    /* Start from a booted guest instead of from its entry point */
+    if (snapshot_path)
+    {
+        double snapshot_time = get_time();
+
+        if (!device_load_snapshot(&dev, snapshot_path))
+        {
+            exit(-1);
+        }
+
+        printf("Snapshot restore: %.3f ms\n", (get_time() - snapshot_time) * 1000.0);
+    }
+
+    if (fuse)
+    {
+        printf("Fused instruction pairs: %u\n", device_fuse_instructions(&dev));
+    }
+
+    if (stats && !device_set_inst_stats(&dev, true))
+    {
+        exit(-1);
+    }
+
+    /* Call chains are recorded by the profiler samples */
+    if (folded_path)
+    {
+        prof_interval = prof_interval ? prof_interval : PROF_INTERVAL;
+
+        if (!device_track_calls(&dev, true))
+        {
+            exit(-1);
+        }
+    }
+
+    if (prof_interval && !device_start_profiler(&dev, prof_interval))
+    {
+        exit(-1);
+    }
+
+    /* Stop the emulation whenever the serial, RTC or display flags are set */
+    device_watch_mmio(&dev, SERIAL_TX_FLAG_ADDR, 1, EVENT_SERIAL_TX);
+    device_watch_mmio(&dev, RTC_FLAG_ADDR, 1, EVENT_RTC);
+    device_watch_mmio(&dev, DISP_VSYNC_FLAG_ADDR, 1, EVENT_VSYNC);
+    device_watch_mmio(&dev, SERIAL_RX_FLAG_ADDR, 1, EVENT_SERIAL_RX);
+
+    /* Run up to the point the runs below start from */
+    if (boot_to || boot_insts)
+    {
+        uint32_t exit_addr = dev.exit_addr;
+        double boot_time = get_time();
+
+        if (boot_to)
+        {
+            const symbol_t *sym = device_find_symbol_by_name(&dev, boot_to);
+            char *end;
+            uint32_t addr = sym ? sym->addr : strtoul(boot_to, &end, 0);
+
+            if ((!sym && *end) || !device_set_stop_addr(&dev, addr))
+            {
+                printf("Error: invalid boot address '%s'\n", boot_to);
+                exit(-1);
+            }
+        }
+
+        if (!run_guest(0, boot_insts))
+        {
+            exit(-1);
+        }
+
+        device_set_stop_addr(&dev, exit_addr);
+        printf("Booted to 0x%08X in %.3f s\n", dev.pc, get_time() - boot_time);
+    }
+
+    char **inputs = NULL;
+    uint32_t n_inputs = 0;
+
+    if (inputs_path)
+    {
+        if (!(inputs = read_lines(inputs_path, &n_inputs)))
+        {
+            exit(-1);
+        }
+
+        n_children = n_children ? n_children : n_inputs;
+    }
+
+    if (n_children > MAX_CHILDREN)
+    {
+        printf("Error: at most %u children are supported\n", MAX_CHILDREN);
+        exit(-1);
+    }
+
+    /* Later runs start over from the state the first one started from */
+    if (!n_children && n_runs > 1 && !device_checkpoint(&dev))
+    {
+        exit(-1);
+    }
+
+    bool ok = true;
+
+    if (n_children)
+    {
+        ok = fan_out(n_children, inputs, n_inputs, max_frames);
+        n_runs = 0;
+    }
+
+    for (uint32_t run = 0; run < n_runs && ok; run++)
+    {
+        if (run)
+        {
+            uint32_t n_dirty = dev.ckpt_n_dirty;
+            double reset_time = get_time();
+
+            device_reset_to_checkpoint(&dev);
+            printf("Reset to checkpoint: %.3f ms, %u dirty pages\n",
+                   (get_time() - reset_time) * 1000.0, n_dirty);
+        }
+
+        ok = run_guest(max_frames, 0);
+    }
+
+    if (stats)
+    {
+        device_printout_instruction_stats(&dev);
+    }
+
+    if (prof_interval)
+    {
+        device_printout_profile(&dev);
+    }
+
+    if (ilp_path || slice_len)
+    {
+        device_printout_ilp_stats(&dev);
+    }
+
+    if (folded_path && !device_save_folded_stacks(&dev, folded_path))
+    {
+        ok = false;
+    }
+
+    if (ok && save_snapshot_path && !device_save_snapshot(&dev, save_snapshot_path))
+    {
+        ok = false;
+    }
+
+    device_uninit(&dev);
+
+    return ok ? 0 : -1;
+}
@@ -1,15 +1,145 @@
 
+#include <stddef.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "rv_emu.h"
 
-static bool mem_write(mem_t *mem, uint32_t addr,
-                      const uint8_t *data, uint32_t size);
-static bool mem_read(mem_t *mem, uint32_t addr,
-                     uint8_t *data, uint32_t size);
+static bool mem_mmio_write(void *ctx, uint32_t offset,
+                           const uint8_t *data, uint32_t size);
+static bool mem_mmio_read(void *ctx, uint32_t offset,
+                          uint8_t *data, uint32_t size);
 
 static void *ilp_thread_proc(void *arg);
+static void ilp_stop_workers(device_t *dev);
 static bool unpack_instruction(uint32_t inst, uinst_t *uinst);
+static void pack_instruction(const uinst_t *uinst, cinst_t *cinst);
 static bool device_run_unpacked_instruction(device_t *dev, uinst_t inst, uint32_t pc_ro);
+static run_reason_t device_run_threaded(device_t *dev, uint64_t budget, uint64_t *n_done);
 static const char *str_inst(uint32_t inst_id);
+static void prof_sample(device_t *dev);
+static void prof_sample_stack(device_t *dev);
+static void flat_unregister(device_t *dev);
+static void ckpt_release(device_t *dev);
+static void watch_hit(device_t *dev, uint32_t addr, uint32_t size);
+static void code_invalidate(device_t *dev, uint32_t addr, uint32_t size);
+static void decode_slot(device_t *dev, uint32_t idx);
+static bool fuse_slot(device_t *dev, uint32_t idx);
+static void stats_fold(device_t *dev);
+static void dispatch_build(device_t *dev);
+static void call_push(device_t *dev, uint32_t target);
+static void call_pop(device_t *dev);
+#if defined(__x86_64__)
+static void jit_flush(device_t *dev);
+#endif
+
+/* Handler addresses of the threaded interpreter, indexed by inst_id */
+static const void *const *inst_handlers = NULL;
+
+/* Same table with control transfers counting the blocks they lead to */
+static const void *const *stats_handlers = NULL;
+
+/* jal and jalr handlers following calls on the shadow stack */
+static const void *const *call_handlers = NULL;
+#define CALL_STACK_SIZE 1024
+
+/* Functions listed by device_printout_profile() */
+#define PROF_MAX_LINES 40
+
+/* Guest address space plus a guard page for accesses that wrap at 4GB */
+#define FLAT_SPACE_SIZE   (((size_t)1 << 32) + flat_page_size)
+#define FLAT_MAX_DEVICES  16
+
+static device_t *flat_devices[FLAT_MAX_DEVICES];
+static size_t flat_page_size;
+static struct sigaction flat_prev_action;
+
+/* Same operation instructions of a slice run as one vector op from this many */
+#define ILP_SIMD_MIN_LANES  3
+#define ILP_SIMD_LANES      8
+
+/* Longest slice and block device_slice_ilp() produces, and the most
+   side exits of a block */
+#define ILP_MAX_SLICE_LEN   32
+#define ILP_MAX_BLOCK       256
+#define ILP_MAX_EXITS       8
+
+/* ILP slices with fewer instructions always run serially. Worker counts
+   are timed over ILP_CALIB_SLICES slices each, every ILP_RECALIB_SLICES */
+#define ILP_MIN_ITEMS       2
+#define ILP_CALIB_SLICES    4096
+#define ILP_RECALIB_SLICES  (1u << 20)
+#define ILP_MAX_CANDIDATES  8
+#define ILP_SPINS           (1u << 14)
+
+/* Devices with write protected memory since device_checkpoint() */
+#define CKPT_MAX_DEVICES 16
+#define CKPT_REGIONS     3
+
+static device_t *ckpt_devices[CKPT_MAX_DEVICES];
+
+/* Pseudo-instruction handler placed at the _exit address */
+#define EXIT_HANDLER_ID NUM_INSTS
+
+/* Decoded instructions the threaded interpreter runs from, dispatch reads
+   the handler of each one from uhandlers as well. The packed format is
+   the default, -DRV_WIDE_UINSTS switches back to uinst_t */
+#ifdef RV_WIDE_UINSTS
+typedef uinst_t tinst_t;
+#else
+typedef cinst_t tinst_t;
+#endif
+
+#define DPAGE_INSTS (DEV_PAGE_SIZE / 4)
+
+/* Decoded page of code outside of the pre-unpacked range */
+typedef struct
+{
+    tinst_t insts[DPAGE_INSTS];
+    const void *handlers[DPAGE_INSTS];
+
+} dpage_t;
+
+/* Anonymous mapping, zero filled on demand so that guest memory a program
+   never touches costs nothing. Huge pages are only a hint to the kernel */
+static void *mem_alloc(size_t size, bool huge)
+{
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (huge)
+    {
+        madvise(data, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    return data;
+}
+
+
+static void mem_free(void *data, size_t size)
+{
+    if (data)
+    {
+        munmap(data, size);
+    }
+}
+
 
 void device_init(device_t *dev,
                  uint32_t rom_size, uint32_t rom_origin,
@@ -19,18 +149,28 @@ void device_init(device_t *dev,
     memset(dev, 0, sizeof(device_t));
     dev->rom.origin = rom_origin;
     dev->rom.size = rom_size;
-    dev->rom.data = malloc(rom_size);
-    memset(dev->rom.data, 0, rom_size);
+    dev->rom.data = mem_alloc(rom_size, false);
 
     dev->ram.origin = ram_origin;
     dev->ram.size = ram_size;
-    dev->ram.data = malloc(ram_size);
-    memset(dev->ram.data, 0, ram_size);
+    dev->ram.data = mem_alloc(ram_size, false);
 
     dev->periph.origin = periph_origin;
     dev->periph.size = periph_size;
-    dev->periph.data = malloc(periph_size);
-    memset(dev->periph.data, 0, periph_size);
+    dev->periph.data = mem_alloc(periph_size, false);
+
+    /* Earlier mappings take precedence where regions share a page */
+    dev->pages = calloc(DEV_NUM_PAGES, sizeof(page_t));
+    dev->code_pages = calloc(DEV_NUM_PAGES, 1);
+
+    if (!dev->pages || !dev->code_pages ||
+        !dev->rom.data || !dev->ram.data || !dev->periph.data ||
+        !device_map_memory(dev, ram_origin, ram_size, dev->ram.data) ||
+        !device_map_memory(dev, rom_origin, rom_size, dev->rom.data) ||
+        !device_map_memory(dev, periph_origin, periph_size, dev->periph.data))
+    {
+        printf("Error: failed to set up the memory map\n");
+    }
 
     dev->pc = dev->rom.origin;
 }
@@ -38,11 +178,77 @@ void device_init(device_t *dev,
 
 void device_uninit(device_t *dev)
 {
-    free(dev->rom.data);
-    free(dev->ram.data);
-    free(dev->periph.data);
+    ckpt_release(dev);
+
+    if (dev->flat)
+    {
+        flat_unregister(dev);
+        munmap(dev->flat, FLAT_SPACE_SIZE);
+    }
+    else
+    {
+        mem_free(dev->rom.data, dev->rom.size);
+        mem_free(dev->ram.data, dev->ram.size);
+        mem_free(dev->periph.data, dev->periph.size);
+    }
+
+    free(dev->pages);
+    free(dev->code_pages);
+
+    if (dev->dcache)
+    {
+        for (uint32_t i = 0; i < DEV_NUM_PAGES; i++)
+        {
+            free(dev->dcache[i]);
+        }
+
+        free(dev->dcache);
+    }
+
+    if (dev->decode_cache)
+    {
+        munmap(dev->decode_cache, dev->decode_cache_size);
+    }
+    else if (dev->uinsts)
+    {
+        uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+        mem_free(dev->uinsts, num_insts * sizeof(uinst_t));
+        mem_free(dev->cinsts, num_insts * sizeof(cinst_t));
+    }
+
+    if (dev->elf_image)
+    {
+        munmap(dev->elf_image, dev->elf_image_size);
+    }
+
+    free(dev->uhandlers);
+    free(dev->block_counts);
+    free(dev->symbols);
+    free(dev->sym_by_name);
+    free(dev->sym_names);
+    free(dev->prof_samples);
+    free(dev->call_stack);
+    free(dev->stack_samples);
+    free(dev->stack_frames);
+
+    if (dev->jit_code)
+    {
+        munmap(dev->jit_code, dev->jit_code_size);
+    }
+
+    free(dev->jit_blocks);
+    free(dev->jit_counts);
+    free(dev->jit_patch_heads);
+    free(dev->jit_patches);
 
-    if (dev->ilp_map || dev->ilp_table)
+    ilp_stop_workers(dev);
+
+    if (dev->ilp_file)
+    {
+        munmap(dev->ilp_file, dev->ilp_file_size);
+    }
+    else
     {
         free(dev->ilp_map);
         free(dev->ilp_table);
@@ -52,1298 +258,6745 @@ void device_uninit(device_t *dev)
 }
 
 
-bool device_load_from_elf(device_t *dev, const char *elf_file_name)
+static int symbol_cmp(const void *a, const void *b)
+{
+    uint32_t addr_a = ((const symbol_t*)a)->addr;
+    uint32_t addr_b = ((const symbol_t*)b)->addr;
+
+    return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+
+static int symbol_name_cmp(const void *a, const void *b)
 {
-    FILE *elf = fopen(elf_file_name, "rb");
+    return strcmp(((const symbol_t*)a)->name, ((const symbol_t*)b)->name);
+}
+
+
+/* Copy a block of the ELF image to the guest, zero filling it up to mem_size */
+static bool elf_load_block(device_t *dev, uint32_t addr, const uint8_t *data,
+                           uint32_t size, uint32_t mem_size)
+{
+    static const uint8_t zeros[DEV_PAGE_SIZE];
 
-    if (!elf)
+    printf("Writing block of size %u to RAM addr: 0x%08X\n", size, addr);
+
+    if (size && !device_write(dev, addr, data, size))
     {
-        printf("Error: unable to open '%s'\n", elf_file_name);
+        printf("Error writing to the device address: 0x%08X\n", addr);
         return false;
     }
 
-    elf_hdr_t elf_hdr = {0};
-    size_t rs;
+    for (uint32_t done = size; done < mem_size; )
+    {
+        uint32_t n = mem_size - done < DEV_PAGE_SIZE ? mem_size - done : DEV_PAGE_SIZE;
+
+        if (!device_write(dev, addr + done, zeros, n))
+        {
+            printf("Error writing to the device address: 0x%08X\n", addr + done);
+            return false;
+        }
+
+        done += n;
+    }
+
+    return true;
+}
+
 
-    rs = fread(&elf_hdr, 1, sizeof(elf_hdr), elf);
-    
-    if (rs != sizeof(elf_hdr))
+/* Keep the function symbols, indexed by address and by name */
+static bool elf_load_symbols(device_t *dev, const uint8_t *image, size_t image_size,
+                             const sec_hdr_t *symtab, const sec_hdr_t *strtab)
+{
+    if ((size_t)symtab->offset + symtab->size > image_size ||
+        (size_t)strtab->offset + strtab->size > image_size)
     {
-        fclose(elf);
+        printf("Error: malformed symbol table\n");
         return false;
     }
 
-    if (elf_hdr.machine != 0x00f3 || elf_hdr.e_ident.bitness != 1)
+    const sym_t *symbols = (const sym_t*)(image + symtab->offset);
+    uint32_t n_syms = symtab->size / sizeof(sym_t);
+
+    free(dev->symbols);
+    free(dev->sym_by_name);
+    free(dev->sym_names);
+    dev->symbols = malloc(n_syms * sizeof(symbol_t));
+    dev->sym_names = malloc(strtab->size + 1);
+    dev->n_symbols = 0;
+    dev->sym_by_name = NULL;
+
+    if (!dev->symbols || !dev->sym_names)
     {
-        printf("Error: this ELF file is not RISC-V 32bit\n");
-        fclose(elf);
+        printf("Error: can't load the symbol table\n");
         return false;
     }
 
-    fseek(elf, elf_hdr.shoff, SEEK_SET);
+    memcpy(dev->sym_names, image + strtab->offset, strtab->size);
+    dev->sym_names[strtab->size] = 0;
 
-    sec_hdr_t *sec_table = malloc(sizeof(sec_hdr_t) * elf_hdr.shnum);
-    rs = fread(sec_table, sizeof(sec_hdr_t), elf_hdr.shnum, elf);
-    
-    for (int i = 0; i < elf_hdr.shnum; i++)
+    for (uint32_t i = 0; i < n_syms; i++)
     {
-        if (sec_table[i].type == 1) /* SHT_PROGBITS */
+        if ((symbols[i].info & 0x0f) != 0x02 || /* STT_FUNC */
+            symbols[i].name >= strtab->size)
         {
-            fseek(elf, sec_table[i].offset, SEEK_SET);
+            continue;
+        }
 
-            printf("Writing block of size %u to RAM addr: 0x%08X\n",
-                   sec_table[i].size, sec_table[i].addr);
-            for (int j = 0; j < sec_table[i].size; j++)
-            {
-                uint8_t b;
-                rs = fread(&b, 1, 1, elf);
-                if (!device_write(dev, sec_table[i].addr + j, &b, 1))
-                {
-                    printf("Error writing to the device address: 0x%08X\n",
-                           sec_table[i].addr + j);
-                    break;
-                }
-            }
+        symbol_t *sym = &dev->symbols[dev->n_symbols++];
+        sym->addr = symbols[i].value;
+        sym->size = symbols[i].size;
+        sym->name = dev->sym_names + symbols[i].name;
+    }
 
-            if (sec_table[i].flags & 0x04)
-            {
-                uint32_t sec_end = sec_table[i].addr + sec_table[i].size;
+    qsort(dev->symbols, dev->n_symbols, sizeof(symbol_t), symbol_cmp);
 
-                if (sec_end > dev->prog_end)
-                {
-                    dev->prog_end = sec_end;
-                }
-            }
+    dev->sym_by_name = malloc((dev->n_symbols + 1) * sizeof(symbol_t));
 
-        }
+    if (!dev->sym_by_name)
+    {
+        return false;
     }
 
-    printf("Program end: 0x%08X\n", dev->prog_end);
+    memcpy(dev->sym_by_name, dev->symbols, dev->n_symbols * sizeof(symbol_t));
+    qsort(dev->sym_by_name, dev->n_symbols, sizeof(symbol_t), symbol_name_cmp);
+
+    return true;
+}
 
-    int strtab_id = -1;
-    int symtab_id = -1;
 
-    /* Find string and symbol table indices */
-    for (int i = 0; i < elf_hdr.shnum; i++)
+/* FNV-1a of the whole ELF file identifies the image for the decode cache,
+   snapshots and ILP files. Only they need it, so it's computed when first
+   asked for. 0 if no ELF file was loaded */
+static uint64_t elf_hash(device_t *dev)
+{
+    if (!dev->elf_hash && dev->elf_image)
     {
-        fseek(elf,
-              sec_table[elf_hdr.shstrndx].offset + sec_table[i].name, SEEK_SET);
-        char sname[16] = {0};
-        rs = fread(sname, 1, sizeof(".strtab"), elf);
+        uint64_t hash = 14695981039346656037ull;
 
-        if (sec_table[i].type == 0x03 && !strcmp(".strtab", sname))
-        {
-            strtab_id = i;
-        }
-        else if (sec_table[i].type == 0x02 && !strcmp(".symtab", sname))
+        for (size_t i = 0; i < dev->elf_image_size; i++)
         {
-            symtab_id = i;
+            hash = (hash ^ dev->elf_image[i]) * 1099511628211ull;
         }
-    }
-
-    /* Find the _exit symbol address */
-    fseek(elf, sec_table[symtab_id].offset, SEEK_SET);
-    sym_t *symbols = malloc(sec_table[symtab_id].size);
-    rs = fread(symbols, 1, sec_table[symtab_id].size, elf);
-
-    for (int i = 0; i < sec_table[symtab_id].size / sizeof(sym_t); i++)
-    {
-        if ((symbols[i].info & 0x0f) == 0x02) /* STT_FUNC */
-        {
-            char sname[200] = {0};
-            int ssize = 0;
-            char c = 0;
-            fseek(elf, sec_table[strtab_id].offset + symbols[i].name, SEEK_SET);
-            do
-            {
-                rs = fread(&c, 1, 1, elf);
-                sname[ssize++] = c;
-            }
-            while(c);
 
-            if (!strcmp("_exit", sname))
-            {
-                dev->exit_addr = symbols[i].value;
-                printf("_exit address: 0x%08X\n", dev->exit_addr);
-                break;
-            }
-        }
+        dev->elf_hash = hash;
     }
 
-    fclose(elf);
-    free(sec_table);
-    free(symbols);
-
-    return true;
+    return dev->elf_hash;
 }
 
 
-bool device_load_ilp_table(device_t *dev, const char *ilp_file_name)
+static bool elf_load(device_t *dev, const uint8_t *image, size_t image_size)
 {
-    FILE *ilp = fopen(ilp_file_name, "rb");
+    const elf_hdr_t *elf_hdr = (const elf_hdr_t*)image;
 
-    if (!ilp)
+    if (image_size < sizeof(elf_hdr_t) || memcmp(elf_hdr->e_ident.magic, "\x7f" "ELF", 4))
     {
-        printf("Error: unable to open '%s'\n", ilp_file_name);
+        printf("Error: not an ELF file\n");
         return false;
     }
 
-    char magic[4] = {0};
-    size_t rs;
-    rs = fread(magic, 1, sizeof(magic), ilp);
-
-    if (rs == sizeof(magic) && memcmp(magic, "ILP", sizeof(magic)))
+    if (elf_hdr->machine != 0x00f3 || elf_hdr->e_ident.bitness != 1)
     {
-        printf("Error: Invalid ILP file\n");
-        fclose(ilp);
+        printf("Error: this ELF file is not RISC-V 32bit\n");
         return false;
     }
 
-    uint32_t num_blocks = 0;
-    uint32_t num_threads = 0;
-    uint32_t table_size = 0;
-
-    rs = fread(&num_blocks, 1, sizeof(num_blocks), ilp);
-    printf("Number of ILP blocks: %d\n", num_blocks);
-
-    rs = fread(&num_threads, 1, sizeof(num_threads), ilp);
-    printf("Number of threads: %d\n", num_threads);
-    
-    dev->ilp_n_blocks = num_blocks;
-    dev->ilp_n_threads = num_threads;
-    dev->ilp_map = malloc(sizeof(ilp_entry_t) * num_blocks);
-
-    for (int i = 0; i < num_blocks; i++)
+    if ((size_t)elf_hdr->shoff + (size_t)elf_hdr->shnum * sizeof(sec_hdr_t) > image_size ||
+        (size_t)elf_hdr->phoff + (size_t)elf_hdr->phnum * elf_hdr->phentsize > image_size ||
+        (elf_hdr->phnum && elf_hdr->phentsize < sizeof(prog_hdr_t)))
     {
-        rs = fread(&dev->ilp_map[i], 1, sizeof(ilp_entry_t), ilp);
-        table_size += dev->ilp_map[i].size;
-        
-        // printf("block %05u, start: 0x%08X, offset: %u, size: %u\n",
-        //        i, dev->ilp_map[i].addr, dev->ilp_map[i].offset, dev->ilp_map[i].size);
+        printf("Error: malformed ELF file\n");
+        return false;
     }
 
-    printf("ILP table size: %u\n", table_size);
+    const sec_hdr_t *sec_table = (const sec_hdr_t*)(image + elf_hdr->shoff);
 
-    dev->ilp_table = malloc(table_size);
-    int read_table_size = fread(dev->ilp_table, 1, table_size, ilp);
-
-    if (read_table_size != table_size)
+    if (elf_hdr->phnum)
     {
-        printf("Error: Malformed ILP file\n");
-        fclose(ilp);
-        return false;
-    }
+        /* Segments go to their run addresses. An image stored elsewhere,
+           like .data kept in flash, is also placed at its load address */
+        for (int i = 0; i < elf_hdr->phnum; i++)
+        {
+            const prog_hdr_t *ph = (const prog_hdr_t*)(image + elf_hdr->phoff +
+                                                       i * elf_hdr->phentsize);
 
-    // int block_id = 6;
+            if (ph->type != 1) /* PT_LOAD */
+            {
+                continue;
+            }
 
-    // uint32_t block_size = dev->ilp_map[block_id].size;
-    // uint32_t block_iid = dev->ilp_map[block_id].offset / 4;
-    // printf("ILP block %u:\n", block_id);
+            if ((size_t)ph->offset + ph->filesz > image_size || ph->filesz > ph->memsz)
+            {
+                printf("Error: malformed ELF segment %d\n", i);
+                return false;
+            }
 
-    // while (block_size)
-    // {
-    //     uint32_t inst = dev->ilp_table[block_iid];
-    //     printf("0x%08X ", inst);
-    //     block_iid++;
-    //     if (inst == 0x0)
-    //     {
-    //         printf("\n");
-    //     }
-    //     block_size -= 4;
-    // }
+            if (!elf_load_block(dev, ph->vaddr, image + ph->offset, ph->filesz, ph->memsz))
+            {
+                return false;
+            }
 
+            if (ph->paddr != ph->vaddr && ph->filesz &&
+                !elf_load_block(dev, ph->paddr, image + ph->offset, ph->filesz, ph->filesz))
+            {
+                return false;
+            }
+        }
+    }
+    else
+    {
+        /* No program headers, load the allocated sections instead */
+        for (int i = 0; i < elf_hdr->shnum; i++)
+        {
+            if (sec_table[i].type != 1 || !(sec_table[i].flags & 0x02)) /* SHT_PROGBITS, SHF_ALLOC */
+            {
+                continue;
+            }
 
-    int res = 0;
+            if ((size_t)sec_table[i].offset + sec_table[i].size > image_size)
+            {
+                printf("Error: malformed ELF section %d\n", i);
+                return false;
+            }
 
-    res = pthread_barrier_init(&dev->ilp_barrier1, NULL, num_threads + 1);
-    res = pthread_barrier_init(&dev->ilp_barrier2, NULL, num_threads + 1);
+            if (!elf_load_block(dev, sec_table[i].addr, image + sec_table[i].offset,
+                                sec_table[i].size, sec_table[i].size))
+            {
+                return false;
+            }
+        }
+    }
 
-    if (res)
+    /* Code ends with the last executable section */
+    for (int i = 0; i < elf_hdr->shnum; i++)
     {
-        printf("Error: initializing barrier: %d\n", res);
-        return false;
+        if (sec_table[i].type == 1 && (sec_table[i].flags & 0x04)) /* SHF_EXECINSTR */
+        {
+            uint32_t sec_end = sec_table[i].addr + sec_table[i].size;
+
+            if (sec_end > dev->prog_end)
+            {
+                dev->prog_end = sec_end;
+            }
+        }
     }
 
-    dev->ilp_threads = malloc(sizeof(pthread_t) * num_threads);
-    dev->ilp_threads_data = malloc(sizeof(ilp_thread_data_t) * num_threads);
-    dev->ilp_slice = malloc(sizeof(uint32_t) * num_threads);
+    printf("Program end: 0x%08X\n", dev->prog_end);
 
-    for (int i = 0; i < dev->ilp_n_threads; i++)
+    /* The symbol table links to its string table */
+    for (int i = 0; i < elf_hdr->shnum; i++)
     {
-        dev->ilp_threads_data[i].dev = (struct device_t*)dev;
-        dev->ilp_threads_data[i].thread_id = i;
+        if (sec_table[i].type == 0x02 && sec_table[i].link < elf_hdr->shnum) /* SHT_SYMTAB */
+        {
+            if (!elf_load_symbols(dev, image, image_size,
+                                  &sec_table[i], &sec_table[sec_table[i].link]))
+            {
+                return false;
+            }
+
+            break;
+        }
+    }
 
-        res = pthread_create(&dev->ilp_threads[i], NULL,
-                             ilp_thread_proc, &dev->ilp_threads_data[i]);
+    const symbol_t *exit_sym = device_find_symbol_by_name(dev, "_exit");
+
+    if (exit_sym)
+    {
+        dev->exit_addr = exit_sym->addr;
+        printf("_exit address: 0x%08X\n", dev->exit_addr);
     }
 
-    fclose(ilp);
     return true;
 }
 
 
-bool device_pre_unpack_instructions(device_t *dev)
+/* The ELF file is mapped rather than read, segments are copied to the guest
+   straight from the mapping */
+bool device_load_from_elf(device_t *dev, const char *elf_file_name)
 {
-    if (!dev->prog_end || !(dev->prog_end > dev->rom.origin &&
-                            dev->prog_end <= (dev->rom.origin + dev->rom.size)))
+    int fd = open(elf_file_name, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) || !st.st_size)
     {
+        printf("Error: unable to open '%s'\n", elf_file_name);
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
         return false;
     }
 
-    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
-    uint32_t pc = dev->rom.origin;
-    uint32_t inst;
+    uint8_t *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    dev->uinsts = malloc(num_insts * sizeof(uinst_t));
+    if (image == MAP_FAILED)
+    {
+        printf("Error: unable to map '%s'\n", elf_file_name);
+        return false;
+    }
 
-    if (!dev->uinsts)
+    if (!elf_load(dev, image, st.st_size))
     {
+        munmap(image, st.st_size);
         return false;
     }
 
-    for (int i = 0; i < num_insts; i++)
+    /* Kept mapped for elf_hash() */
+    if (dev->elf_image)
     {
-        device_read(dev, pc, (uint8_t*)&inst, sizeof(inst));
-        unpack_instruction(inst, dev->uinsts + i);
-        pc += 4;
+        munmap(dev->elf_image, dev->elf_image_size);
     }
 
+    dev->elf_image = image;
+    dev->elf_image_size = st.st_size;
+    dev->elf_hash = 0;
+
     return true;
 }
 
 
-static bool mem_write(mem_t *mem, uint32_t addr,
-                      const uint8_t *data, uint32_t size)
+/* Start the threads running slices of up to num_threads instructions */
+static bool ilp_start_workers(device_t *dev, uint32_t num_threads)
 {
-    if (addr >= mem->origin)
+    /* A slice has at most num_threads instructions and the calling thread
+       runs a share of them, so one core less is enough */
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t n_workers = num_threads ? num_threads - 1 : 0;
+
+    if (n_cpus > 0 && n_workers > n_cpus - 1)
     {
-        uint32_t offset = addr - mem->origin;
-        if ((offset + size) <= mem->size)
-        {
-            memcpy(mem->data + offset, data, size);
-            return true;
-        }
+        n_workers = n_cpus - 1;
     }
-    return false;
-}
 
+    /* Thread data is cache line aligned so workers don't share lines */
+    void *threads_data = NULL;
 
-static bool mem_read(mem_t *mem, uint32_t addr, uint8_t *data, uint32_t size)
-{
-    if (addr >= mem->origin)
+    if (posix_memalign(&threads_data, 64, sizeof(ilp_thread_data_t) * (n_workers + 1)))
     {
-        uint32_t offset = addr - mem->origin;
-        if ((offset + size) <= mem->size)
-        {
-            memcpy(data, mem->data + offset, size);
-            return true;
-        }
+        threads_data = NULL;
     }
-    return false;
-}
 
+    dev->ilp_threads = malloc(sizeof(pthread_t) * (n_workers + 1));
+    dev->ilp_threads_data = threads_data;
+    dev->ilp_slice = malloc(sizeof(uint32_t) * (num_threads + 1));
 
-bool device_write(device_t *dev, uint32_t addr,
-                  const uint8_t *data, uint32_t size)
-{
-    return mem_write(&dev->ram, addr, data, size) ||
-           mem_write(&dev->rom, addr, data, size) ||
-           mem_write(&dev->periph, addr, data, size);
-}
+    if (!dev->ilp_threads || !dev->ilp_threads_data || !dev->ilp_slice)
+    {
+        printf("Error: can't allocate the ILP executor\n");
+        return false;
+    }
 
+    memset(dev->ilp_threads_data, 0, sizeof(ilp_thread_data_t) * (n_workers + 1));
 
-bool device_read(device_t *dev, uint32_t addr, uint8_t *data, uint32_t size)
-{
-    return mem_read(&dev->ram, addr, data, size) ||
-           mem_read(&dev->rom, addr, data, size) ||
-           mem_read(&dev->periph, addr, data, size);
-}
+    /* Entry 0 belongs to the calling thread */
+    for (uint32_t i = 0; i <= n_workers; i++)
+    {
+        ilp_thread_data_t *td = &dev->ilp_threads_data[i];
 
+        td->dev = (struct device_t*)dev;
+        td->thread_id = i;
+        td->items = malloc(sizeof(ilp_item_t) * (num_threads + 1));
 
-void device_set_reg(device_t *dev, int rd, uint32_t val)
-{
-    dev->regs[rd] = val;
+        if (!td->items || (i && pthread_create(&dev->ilp_threads[i], NULL,
+                                               ilp_thread_proc, td)))
+        {
+            printf("Error: can't start ILP worker %u\n", i);
+
+            if (!i)
+            {
+                return false;
+            }
+
+            free(td->items);
+            td->items = NULL;
+            n_workers = i - 1;
+            break;
+        }
+    }
+
+    dev->ilp_n_workers = n_workers;
+    dev->ilp_workers = 0;
+    dev->ilp_calib_candidate = 0;
+    dev->ilp_calib_left = ILP_CALIB_SLICES;
+    printf("ILP workers: %u\n", n_workers);
+
+    return true;
 }
 
 
-bool device_run_instruction(device_t *dev, uint32_t inst, uint32_t pc_ro)
+#define ILP_FILE_MAGIC   0x4C495652u    /* "RVIL" */
+#define ILP_FILE_VERSION 3
+
+/* ILP table file, written by thread_slicer.py. The index has an entry per
+   instruction word from rom_origin, the table holds the slices of every
+   block as instruction indices, each slice ended by ILP_SLICE_END, with
+   side exits as in rv_emu.h. Version 2 has no side exits */
+typedef struct
 {
-    uinst_t uinst;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hdr_size;
+    uint32_t checksum;          /* FNV-1a of the header with this set to 0 */
+    uint64_t elf_hash;
+    uint32_t rom_origin;
+    uint32_t n_blocks;
+    uint32_t max_slice_len;
+    uint32_t table_len;
+    uint32_t index_offset;
+    uint32_t table_offset;
+
+} ilp_file_hdr_t;
+
+
+static uint32_t ilp_hdr_checksum(ilp_file_hdr_t hdr)
+{
+    const uint8_t *data = (const uint8_t*)&hdr;
+    uint32_t hash = 2166136261u;
 
-    if (!unpack_instruction(inst, &uinst))
+    hdr.checksum = 0;
+
+    for (size_t i = 0; i < sizeof(hdr); i++)
     {
-        printf("Error: failed executing instruction: "
-               "0x%08X at address 0x%08X\n", inst, dev->pc);
-        
-        return false;
+        hash = (hash ^ data[i]) * 16777619u;
     }
 
-    return device_run_unpacked_instruction(dev, uinst, pc_ro);
+    return hash;
 }
 
 
-static bool unpack_instruction(uint32_t inst, uinst_t *uinst)
+/* Check that every block lies in the table and is made of slices of known
+   instructions no longer than the slice length, each with at most one
+   side exit that only restores registers saved by the block */
+static bool ilp_check_table(const ilp_entry_t *map, uint32_t n_blocks,
+                            const uint32_t *table, uint32_t table_len,
+                            uint32_t max_slice_len)
 {
-    uint32_t opcode = inst & 0b1111111;
-    bool res = true;
-    uinst->inst_id = INST_INVALID;
-
-    switch (opcode)
-    {
-    case 0b0110011:  /* Integer Register-Register ops */
+    for (uint32_t b = 0; b < n_blocks; b++)
     {
-        uint32_t funct3 = (inst >> 12) & 0b111;
-        uint32_t funct7 = (inst >> 25) & 0b1111111;
+        uint32_t offset = map[b].offset;
+        uint32_t size = map[b].size;
+        uint32_t end = offset + size;
+        uint32_t slice_len = 0;
+        uint32_t saved = 0;
+        bool side_exit = false;
+
+        if (!size)
+        {
+            continue;
+        }
 
-        uinst->rd = (inst >> 7) & 0b11111;
-        uinst->rs1 = (inst >> 15) & 0b11111;
-        uinst->rs2 = (inst >> 20) & 0b11111;
+        if (offset > table_len || size > table_len - offset ||
+            table[end - 1] != ILP_SLICE_END)
+        {
+            return false;
+        }
 
-        switch (funct3)
+        for (uint32_t i = offset; i < end; i++)
         {
-        case 0x00:
-            switch (funct7)
+            switch (table[i])
             {
-            case 0x00: /* add */
-                uinst->inst_id = INST_ADD;
+            case ILP_SLICE_END:
+                slice_len = 0;
+                side_exit = false;
                 break;
 
-            case 0x20: /* sub */
-                uinst->inst_id = INST_SUB;
-                break;
+            case ILP_BLOCK_SAVE:
+                if (i != offset || end - i < 3)
+                {
+                    return false;
+                }
 
-            case 0x01: /* mul */
-                uinst->inst_id = INST_MUL;
+                saved = table[++i];
                 break;
 
-            default:
-                res = false;
-            }
-            break;
-
-        case 0x04: 
-            switch (funct7)
-            {
-            case 0x0: /* xor */
-                uinst->inst_id = INST_XOR;
-                break;
+            case ILP_SLICE_EXIT:
+                if (slice_len || side_exit || end - i < 5 ||
+                    table[i + 1] >= n_blocks || table[i + 2] >= n_blocks ||
+                    (table[i + 3] & ~saved))
+                {
+                    return false;
+                }
 
-            case 0x01: /* div */
-                uinst->inst_id = INST_DIV;
+                side_exit = true;
+                i += 3;
                 break;
 
             default:
+                if (table[i] >= n_blocks || ++slice_len > max_slice_len)
+                {
+                    return false;
+                }
                 break;
             }
-            break;
+        }
+    }
 
+    return true;
+}
 
-        case 0x06:
-            switch (funct7)
-            {
-            case 0x0: /* or */
-                uinst->inst_id = INST_OR;
-                break;
-            
-            case 0x01: /* rem */
-                uinst->inst_id = INST_REM;
-                break;
 
-            default:
-                break;
-            }
-            break;
+bool device_load_ilp_table(device_t *dev, const char *ilp_file_name)
+{
+    if (dev->ilp_map)
+    {
+        printf("Error: an ILP table is already loaded\n");
+        return false;
+    }
 
-      
-        case 0x07: 
-            switch (funct7)
-            {
-            case 0x0: /* and */
-                uinst->inst_id = INST_AND;
-                break;                
-            
-            case 0x01: /* remu */
-                uinst->inst_id = INST_REMU;
-                break;
+    int fd = open(ilp_file_name, O_RDONLY);
+    struct stat st;
 
-            case 0x07: /* czero.nez */
-                uinst->inst_id = INST_CZERO_NEZ;
-                break;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        printf("Error: unable to open '%s'\n", ilp_file_name);
 
-            default:
-                break;
-            }
-            break;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
 
+        return false;
+    }
 
-        case 0x01:
-            switch (funct7)
-            {
-            case 0x00: /* sll */
-                uinst->inst_id = INST_SLL;
-                break;
+    size_t size = st.st_size;
+    ilp_file_hdr_t hdr;
 
-            case 0x01: /* mulh */
-                uinst->inst_id = INST_MULH;
-                break;
+    memset(&hdr, 0, sizeof(hdr));
 
-            default:
-                res = false;
-            }
-            break;
+    if (pread(fd, &hdr, sizeof(hdr), 0) < 4 ||
+        (hdr.magic != ILP_FILE_MAGIC && memcmp(&hdr.magic, "ILP", 4)))
+    {
+        printf("Error: Invalid ILP file\n");
+        close(fd);
+        return false;
+    }
 
-        case 0x05:
-            switch (funct7)
-            {
-            case 0x00: /* srl */
-                uinst->inst_id = INST_SRL;
-                break;
+    /* Files starting with "ILP" are version 1, addresses indexed by block */
+    if (hdr.magic != ILP_FILE_MAGIC)
+    {
+        hdr.version = 1;
+    }
 
-            case 0x20: /* sra */
-                uinst->inst_id = INST_SRA;
-                break;
+    /* Version 2 tables read the same, they just have no side exits */
+    if (hdr.version < 2 || hdr.version > ILP_FILE_VERSION ||
+        hdr.hdr_size != sizeof(hdr) || size < sizeof(hdr))
+    {
+        printf("Error: ILP file version %u is not supported, "
+               "slice the program again\n", hdr.version);
+        close(fd);
+        return false;
+    }
 
-            case 0x01: /* divu */
-                uinst->inst_id = INST_DIVU;
-                break;
+    if (hdr.checksum != ilp_hdr_checksum(hdr) ||
+        hdr.index_offset > size || hdr.n_blocks > (size - hdr.index_offset) / sizeof(ilp_entry_t) ||
+        hdr.table_offset > size || hdr.table_len > (size - hdr.table_offset) / sizeof(uint32_t) ||
+        hdr.index_offset % 4 || hdr.table_offset % 4 ||
+        !hdr.max_slice_len || hdr.max_slice_len > ILP_MAX_SLICE_LEN)
+    {
+        printf("Error: Malformed ILP file\n");
+        close(fd);
+        return false;
+    }
 
-            case 0x07: /* czero.eqz */
-                uinst->inst_id = INST_CZERO_EQZ;
-                break;
+    if (hdr.rom_origin != dev->rom.origin || (elf_hash(dev) && hdr.elf_hash != elf_hash(dev)))
+    {
+        printf("Error: ILP file was made for another program\n");
+        close(fd);
+        return false;
+    }
 
-            default:
-                res = false;
-            }
-            break;
+    uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-        case 0x02:
-            switch (funct7)
-            {
-            case 0x00: /* slt */
-                uinst->inst_id = INST_SLT;
-                break;
+    if (data == MAP_FAILED)
+    {
+        printf("Error: unable to map '%s'\n", ilp_file_name);
+        return false;
+    }
 
-            case 0x01: /* mulhsu */
-                uinst->inst_id = INST_MULHSU;
-                break;
+    ilp_entry_t *map = (ilp_entry_t*)(data + hdr.index_offset);
+    uint32_t *table = (uint32_t*)(data + hdr.table_offset);
 
-            default:
-                res = false;
-            }
-            break;
+    if (!ilp_check_table(map, hdr.n_blocks, table, hdr.table_len, hdr.max_slice_len))
+    {
+        printf("Error: Malformed ILP file\n");
+        munmap(data, size);
+        return false;
+    }
 
-        case 0x03: 
-            switch (funct7)
-            {
-                case 0x00: /* sltu */
-                    uinst->inst_id = INST_SLTU;
-                    break;
+    printf("Number of ILP blocks: %u\n", hdr.n_blocks);
+    printf("Number of threads: %u\n", hdr.max_slice_len);
+    printf("ILP table size: %u\n", hdr.table_len);
 
-                case 0x01: /* mulhu */
-                    uinst->inst_id = INST_MULHU;
-                    break;
+    dev->ilp_file = data;
+    dev->ilp_file_size = size;
+    dev->ilp_map = map;
+    dev->ilp_table = table;
+    dev->ilp_n_blocks = hdr.n_blocks;
+    dev->ilp_n_threads = hdr.max_slice_len;
+    dev->ilp_table_len = hdr.table_len;
 
-                default:
-                    res = false;
-            }
-            break;
+    return ilp_start_workers(dev, hdr.max_slice_len);
+}
 
 
-        default:
-            printf("Error: invalid R-type instruction 0x%08X\n", inst);
-            res = false;
-            break;
-        }
+/* Slice basic blocks into ILP slices of up to max_slice_len instructions
+   as they are first executed, instead of loading a table made offline */
+bool device_slice_ilp(device_t *dev, uint32_t max_slice_len)
+{
+    if (dev->ilp_map)
+    {
+        printf("Error: an ILP table is already loaded\n");
+        return false;
     }
-    break;
 
-    case 0b0010011: /* Integer Register-Immediate ops */
+    if (max_slice_len < 1 || max_slice_len > ILP_MAX_SLICE_LEN)
     {
-        uint32_t funct3 = (inst >> 12) & 0b111;
+        printf("Error: ILP slice length must be 1 to %u\n", ILP_MAX_SLICE_LEN);
+        return false;
+    }
 
-        uinst->rd = (inst >> 7) & 0b11111;
-        uinst->rs1 = (inst >> 15) & 0b11111;
-        uinst->imm = (inst >> 20) & 0b111111111111;
-        uinst->imm = (uinst->imm << 20) >> 20;
+    dev->ilp_n_blocks = (dev->prog_end - dev->rom.origin) / 4;
+    dev->ilp_n_threads = max_slice_len;
+    dev->ilp_map = calloc(dev->ilp_n_blocks + 1, sizeof(ilp_entry_t));
+    dev->ilp_table_cap = 4096;
+    dev->ilp_table = malloc(sizeof(uint32_t) * dev->ilp_table_cap);
+    dev->ilp_table_len = 0;
+    dev->ilp_lazy = true;
 
-        switch (funct3)
+    if (!dev->ilp_map || !dev->ilp_table)
+    {
+        printf("Error: can't allocate the ILP table\n");
+        return false;
+    }
+
+    printf("Slicing ILP blocks on first execution, %u instructions per slice\n",
+           max_slice_len);
+
+    return ilp_start_workers(dev, max_slice_len);
+}
+
+
+static bool unpack_resolve(device_t *dev, bool lazy);
+
+
+/* Set up the decoded program, either decoding it right away or filling
+   it with INST_UNDECODED slots decoded on their first execution */
+static bool unpack_setup(device_t *dev, bool lazy)
+{
+    if (!dev->prog_end || !(dev->prog_end > dev->rom.origin &&
+                            dev->prog_end <= (dev->rom.origin + dev->rom.size)))
+    {
+        return false;
+    }
+
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+    dev->uinsts = mem_alloc(num_insts * sizeof(uinst_t), dev->huge_pages);
+    dev->cinsts = mem_alloc(num_insts * sizeof(cinst_t), dev->huge_pages);
+
+    if (!dev->uinsts || !dev->cinsts)
+    {
+        return false;
+    }
+
+    /* Zero filled slots are INST_UNDECODED already, lazy mode leaves them
+       untouched until they run */
+    if (!lazy)
+    {
+        /* Read the whole program at once, data words simply end up as
+           INST_INVALID slots */
+        uint32_t *raw = malloc(num_insts * sizeof(uint32_t));
+
+        if (!raw || !device_read(dev, dev->rom.origin, (uint8_t*)raw,
+                                 num_insts * sizeof(uint32_t)))
         {
-        case 0x00:  /* addi */
-            uinst->inst_id = INST_ADDI;
-            break;
+            free(raw);
+            return false;
+        }
 
-        case 0x04: /* xori */
-            uinst->inst_id = INST_XORI;
-            break;
+        for (uint32_t i = 0; i < num_insts; i++)
+        {
+            unpack_instruction(raw[i], dev->uinsts + i);
+            pack_instruction(dev->uinsts + i, dev->cinsts + i);
+        }
 
-        case 0x06: /* ori */
-            uinst->inst_id = INST_ORI;
-            break;
+        free(raw);
+    }
 
-        case 0x07: /* andi */
-            uinst->inst_id = INST_ANDI;
-            break;
+    return unpack_resolve(dev, lazy);
+}
 
-        case 0x01:
-            switch (uinst->imm >> 5)
-            {
-            case 0x00: /* slli */
-                uinst->inst_id = INST_SLLI;
-                break;
 
-            default:    
-                res = false;
-            }
-            break;
+/* Resolve every unpacked instruction to its handler in the threaded
+   interpreter, so dispatch is a single indirect jump per instruction.
+   Lazily decoded slots are all undecoded, their pages aren't read */
+static bool unpack_resolve(device_t *dev, bool lazy)
+{
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+    if (!inst_handlers)
+    {
+        device_run_threaded(NULL, 0, NULL);
+    }
+
+    dev->uhandlers = malloc(num_insts * sizeof(void*));
+
+    if (!dev->uhandlers)
+    {
+        return false;
+    }
+
+    if (!dev->handlers[INST_NOP])
+    {
+        dispatch_build(dev);
+    }
+
+    if (dev->stats && !dev->block_counts)
+    {
+        dev->block_counts = calloc(num_insts, sizeof(uint64_t));
+
+        if (!dev->block_counts)
+        {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < num_insts; i++)
+    {
+        dev->uhandlers[i] = dev->handlers[lazy ? INST_UNDECODED : dev->uinsts[i].inst_id];
+    }
+
+    /* Stores to the unpacked code have to invalidate it */
+    for (uint32_t addr = dev->rom.origin; addr < dev->prog_end; addr += DEV_PAGE_SIZE)
+    {
+        dev->code_pages[addr >> DEV_PAGE_SHIFT] = 1;
+    }
+
+    dev->code_pages[(dev->prog_end - 1) >> DEV_PAGE_SHIFT] = 1;
+
+    /* Reaching _exit is detected by its handler, not by comparing every pc */
+    uint32_t exit_id = (dev->exit_addr - dev->rom.origin) / 4;
+
+    if (dev->exit_addr >= dev->rom.origin && exit_id < num_insts)
+    {
+        dev->uhandlers[exit_id] = dev->handlers[EXIT_HANDLER_ID];
+    }
+
+    return true;
+}
+
+
+bool device_pre_unpack_instructions(device_t *dev)
+{
+    return unpack_setup(dev, false);
+}
+
+
+bool device_lazy_unpack_instructions(device_t *dev)
+{
+    return unpack_setup(dev, true);
+}
+
+
+/* Header of a decode cache file, followed by the uinst_t and the cinst_t
+   arrays of the pre-unpacked program */
+#define DECODE_CACHE_MAGIC   0x43445652u    /* "RVDC" */
+#define DECODE_CACHE_VERSION 2
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t elf_hash;
+    uint32_t num_insts_ids;     /* Layout of the decoded instructions */
+    uint32_t uinst_size;
+    uint32_t cinst_size;
+    uint32_t rom_origin;
+    uint32_t prog_end;
+    uint32_t num_insts;
+    uint32_t uinsts_offset;
+    uint32_t cinsts_offset;
+
+} decode_cache_hdr_t;
+
+
+static void decode_cache_hdr(device_t *dev, decode_cache_hdr_t *hdr)
+{
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = DECODE_CACHE_MAGIC;
+    hdr->version = DECODE_CACHE_VERSION;
+    hdr->elf_hash = elf_hash(dev);
+    hdr->num_insts_ids = NUM_INSTS;
+    hdr->uinst_size = sizeof(uinst_t);
+    hdr->cinst_size = sizeof(cinst_t);
+    hdr->rom_origin = dev->rom.origin;
+    hdr->prog_end = dev->prog_end;
+    hdr->num_insts = num_insts;
+    hdr->uinsts_offset = sizeof(decode_cache_hdr_t);
+    hdr->cinsts_offset = hdr->uinsts_offset + num_insts * sizeof(uinst_t);
+}
+
+
+/* Map the decoded program saved by device_save_decode_cache() for the same
+   ELF image instead of decoding it again. The mapping is private, slots
+   decoded again after stores to the code only change this process' copy */
+bool device_load_decode_cache(device_t *dev, const char *file_name)
+{
+    if (!dev->prog_end || dev->uinsts || !(dev->prog_end > dev->rom.origin &&
+                                          dev->prog_end <= (dev->rom.origin + dev->rom.size)))
+    {
+        return false;
+    }
+
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    decode_cache_hdr_t expected;
+    decode_cache_hdr(dev, &expected);
+
+    size_t size = expected.cinsts_offset + expected.num_insts * sizeof(cinst_t);
+
+    if (fstat(fd, &st) || st.st_size != size)
+    {
+        close(fd);
+        return false;
+    }
+
+    uint8_t *cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (cache == MAP_FAILED)
+    {
+        return false;
+    }
+
+    /* A cache of another image or of another build is simply not used */
+    if (memcmp(cache, &expected, sizeof(expected)))
+    {
+        munmap(cache, size);
+        return false;
+    }
+
+    dev->decode_cache = cache;
+    dev->decode_cache_size = size;
+    dev->uinsts = (uinst_t*)(cache + expected.uinsts_offset);
+    dev->cinsts = (cinst_t*)(cache + expected.cinsts_offset);
+
+    return unpack_resolve(dev, false);
+}
+
+
+/* Save the pre-unpacked program for device_load_decode_cache(). It has to
+   be fully decoded and must not have run yet, so that it matches the ELF.
+   The file is written under a temporary name and renamed, concurrent runs
+   of the same image never see it half written */
+bool device_save_decode_cache(device_t *dev, const char *file_name)
+{
+    if (!dev->uinsts || !dev->cinsts)
+    {
+        return false;
+    }
+
+    decode_cache_hdr_t hdr;
+    decode_cache_hdr(dev, &hdr);
+
+    for (uint32_t i = 0; i < hdr.num_insts; i++)
+    {
+        if (dev->uinsts[i].inst_id == INST_UNDECODED)
+        {
+            printf("Error: the decode cache needs a pre-unpacked program\n");
+            return false;
+        }
+    }
+
+    char tmp_name[4096];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d.tmp", file_name, (int)getpid());
+
+    FILE *cache = fopen(tmp_name, "wb");
+
+    if (!cache)
+    {
+        printf("Error: unable to create '%s'\n", tmp_name);
+        return false;
+    }
+
+    bool res = fwrite(&hdr, sizeof(hdr), 1, cache) == 1 &&
+               fwrite(dev->uinsts, sizeof(uinst_t), hdr.num_insts, cache) == hdr.num_insts &&
+               fwrite(dev->cinsts, sizeof(cinst_t), hdr.num_insts, cache) == hdr.num_insts;
+
+    res = !fclose(cache) && res;
+
+    if (!res || rename(tmp_name, file_name))
+    {
+        printf("Error: unable to write '%s'\n", file_name);
+        unlink(tmp_name);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Decode the pre-unpacked slot idx from guest memory again */
+static void decode_slot(device_t *dev, uint32_t idx)
+{
+    uint32_t raw = 0;
+
+    device_read(dev, dev->rom.origin + idx * 4, (uint8_t*)&raw, sizeof(raw));
+    unpack_instruction(raw, &dev->uinsts[idx]);
+    pack_instruction(&dev->uinsts[idx], &dev->cinsts[idx]);
+
+    if (!dev->uhandlers)
+    {
+        return;
+    }
+
+    if (dev->uhandlers[idx] != dev->handlers[EXIT_HANDLER_ID])
+    {
+        dev->uhandlers[idx] = dev->handlers[dev->uinsts[idx].inst_id];
+
+        if (dev->fuse)
+        {
+            fuse_slot(dev, idx);
+        }
+    }
+
+    /* A fused pair ending here would run the old instruction */
+    if (idx > 0 && dev->uhandlers[idx - 1] != dev->handlers[EXIT_HANDLER_ID])
+    {
+        dev->uhandlers[idx - 1] = dev->handlers[dev->uinsts[idx - 1].inst_id];
+
+        if (dev->fuse)
+        {
+            fuse_slot(dev, idx - 1);
+        }
+    }
+}
+
+
+/* Fused opcode for a common pair of instructions, INST_INVALID if none */
+static uint32_t fuse_pair(const uinst_t *a, const uinst_t *b)
+{
+    switch (a->inst_id)
+    {
+    case INST_LUI:
+        if (b->inst_id == INST_ADDI && a->rd && b->rs1 == a->rd)
+        {
+            return INST_LUI_ADDI;
+        }
+        break;
+
+    case INST_AUIPC:
+        if (b->inst_id == INST_JALR && a->rd && b->rs1 == a->rd)
+        {
+            return INST_AUIPC_JALR;
+        }
+        break;
+
+    case INST_SLLI:
+        if (b->inst_id == INST_ADD && a->rd && (b->rs1 == a->rd || b->rs2 == a->rd))
+        {
+            return INST_SLLI_ADD;
+        }
+        break;
+
+    case INST_ADDI:
+        if (b->inst_id == INST_BNE && a->rd && b->rs1 == a->rd && b->rs2 == 0)
+        {
+            return INST_ADDI_BNEZ;
+        }
+        break;
+
+    case INST_LW:
+        if (b->inst_id == INST_ADDI && b->rd && b->rd == a->rs1 && b->rs1 == a->rs1)
+        {
+            return INST_LW_ADDI;
+        }
+        break;
+
+    case INST_SW:
+        if (b->inst_id == INST_ADDI && b->rd && b->rd == a->rs1 && b->rs1 == a->rs1)
+        {
+            return INST_SW_ADDI;
+        }
+        break;
+    }
+
+    return INST_INVALID;
+}
+
+
+/* Fuse the decoded slot idx with the next one if they make a known pair.
+   Only the handler of the first instruction changes. The second one
+   keeps its own handler, so jumping straight to it still works */
+static bool fuse_slot(device_t *dev, uint32_t idx)
+{
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+    /* Stats and calls are followed on the original instructions */
+    if (dev->stats || dev->track_calls || idx + 1 >= num_insts ||
+        dev->uhandlers[idx] != dev->handlers[dev->uinsts[idx].inst_id] ||
+        dev->uhandlers[idx + 1] != dev->handlers[dev->uinsts[idx + 1].inst_id])
+    {
+        return false;
+    }
+
+    uint32_t fused_id = fuse_pair(&dev->uinsts[idx], &dev->uinsts[idx + 1]);
+
+    if (fused_id == INST_INVALID)
+    {
+        return false;
+    }
+
+    dev->uhandlers[idx] = dev->handlers[fused_id];
+    return true;
+}
+
+
+uint32_t device_fuse_instructions(device_t *dev)
+{
+    if (!dev->uinsts || !dev->uhandlers)
+    {
+        return 0;
+    }
+
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+    uint32_t n_fused = 0;
+
+    for (uint32_t i = 0; i + 1 < num_insts; i++)
+    {
+        n_fused += fuse_slot(dev, i);
+    }
+
+    /* Slots that are still undecoded get fused on their first execution */
+    dev->fuse = true;
+
+    return n_fused;
+}
+
+
+/* Move the address runs stop at with RUN_EXIT_REACHED, which is _exit
+   after loading the ELF file. Used to run a program up to a given point */
+bool device_set_stop_addr(device_t *dev, uint32_t addr)
+{
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+    uint32_t old_id = (dev->exit_addr - dev->rom.origin) / 4;
+    uint32_t new_id = (addr - dev->rom.origin) / 4;
+    uint32_t old_addr = dev->exit_addr;
+
+    if (addr & 3)
+    {
+        return false;
+    }
+
+    if (dev->uhandlers && dev->exit_addr >= dev->rom.origin && old_id < num_insts)
+    {
+        dev->uhandlers[old_id] = dev->handlers[dev->uinsts[old_id].inst_id];
+
+        for (uint32_t i = old_id ? old_id - 1 : 0; dev->fuse && i <= old_id; i++)
+        {
+            fuse_slot(dev, i);
+        }
+    }
+
+    dev->exit_addr = addr;
+
+    if (dev->uhandlers && addr >= dev->rom.origin && new_id < num_insts)
+    {
+        dev->uhandlers[new_id] = dev->handlers[EXIT_HANDLER_ID];
+
+        /* A fused pair ending at the new address would run past it */
+        if (new_id > 0 && dev->uhandlers[new_id - 1] != dev->handlers[EXIT_HANDLER_ID])
+        {
+            dev->uhandlers[new_id - 1] = dev->handlers[dev->uinsts[new_id - 1].inst_id];
+        }
+    }
+
+#if defined(__x86_64__)
+    if (dev->jit_code)
+    {
+        jit_flush(dev);
+    }
+#endif
+
+    /* Blocks sliced so far may run past the new address, they get sliced
+       again. Their words stay in the table for the block being run */
+    if (dev->ilp_lazy && addr != old_addr)
+    {
+        memset(dev->ilp_map, 0, sizeof(ilp_entry_t) * dev->ilp_n_blocks);
+    }
+
+    return true;
+}
+
+
+/* Compose the dispatch table of the device from the instrumentation
+   it has enabled */
+static void dispatch_build(device_t *dev)
+{
+    if (!inst_handlers)
+    {
+        device_run_threaded(NULL, 0, NULL);
+    }
+
+    memcpy(dev->handlers, dev->stats ? stats_handlers : inst_handlers,
+           sizeof(dev->handlers));
+
+    if (dev->track_calls)
+    {
+        dev->handlers[INST_JAL] = call_handlers[INST_JAL];
+        dev->handlers[INST_JALR] = call_handlers[INST_JALR];
+    }
+}
+
+
+/* Rebuild the dispatch table and resolve the decoded code against it */
+static void dispatch_update(device_t *dev)
+{
+    dispatch_build(dev);
+
+    if (dev->uhandlers)
+    {
+        uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+        for (uint32_t i = 0; i < num_insts; i++)
+        {
+            if (dev->uhandlers[i] != inst_handlers[EXIT_HANDLER_ID])
+            {
+                dev->uhandlers[i] = dev->handlers[dev->uinsts[i].inst_id];
+            }
+        }
+
+        for (uint32_t i = 0; dev->fuse && i + 1 < num_insts; i++)
+        {
+            fuse_slot(dev, i);
+        }
+    }
+
+    /* Code outside of the unpacked range is simply decoded again */
+    for (uint32_t p = 0; dev->dcache && p < DEV_NUM_PAGES; p++)
+    {
+        dpage_t *dpage = dev->dcache[p];
+
+        for (uint32_t i = 0; dpage && i < DPAGE_INSTS; i++)
+        {
+            dpage->handlers[i] = dev->handlers[INST_UNDECODED];
+        }
+    }
+}
+
+
+/* Switch the threaded interpreter to the dispatch table counting executed
+   blocks, or back to the plain one */
+bool device_set_inst_stats(device_t *dev, bool enable)
+{
+#ifdef RV_NO_INST_STATS
+    if (enable)
+    {
+        printf("Error: instruction stats are compiled out\n");
+        return false;
+    }
+#else
+    if (!enable)
+    {
+        stats_fold(dev);
+    }
+    else if (!dev->block_counts && dev->uinsts)
+    {
+        dev->block_counts = calloc((dev->prog_end - dev->rom.origin) / 4, sizeof(uint64_t));
+
+        if (!dev->block_counts)
+        {
+            return false;
+        }
+    }
+
+    dev->stats = enable;
+    dispatch_update(dev);
+#endif
+
+    return true;
+}
+
+
+/* Follow guest calls and returns on a shadow stack, so that profiler
+   samples record the whole call chain */
+bool device_track_calls(device_t *dev, bool enable)
+{
+    if (enable && !dev->call_stack)
+    {
+        dev->call_stack = malloc(CALL_STACK_SIZE * sizeof(uint32_t));
+
+        if (!dev->call_stack)
+        {
+            return false;
+        }
+    }
+
+    /* Calls made before now are not known, the current function is the root */
+    dev->call_depth = 0;
+    dev->call_root = dev->pc;
+    dev->track_calls = enable;
+    dispatch_update(dev);
+
+    return true;
+}
+
+
+static void call_push(device_t *dev, uint32_t target)
+{
+    if (dev->call_depth < CALL_STACK_SIZE)
+    {
+        dev->call_stack[dev->call_depth] = target;
+    }
+
+    dev->call_depth++;
+}
+
+
+static void call_pop(device_t *dev)
+{
+    if (dev->call_depth)
+    {
+        dev->call_depth--;
+    }
+}
+
+
+static bool mem_mmio_write(void *ctx, uint32_t offset,
+                           const uint8_t *data, uint32_t size)
+{
+    memcpy((uint8_t*)ctx + offset, data, size);
+    return true;
+}
+
+
+static bool mem_mmio_read(void *ctx, uint32_t offset,
+                          uint8_t *data, uint32_t size)
+{
+    memcpy(data, (uint8_t*)ctx + offset, size);
+    return true;
+}
+
+
+static mmio_t *mmio_alloc(device_t *dev)
+{
+    if (dev->n_mmio == DEV_MAX_MMIO)
+    {
+        printf("Error: too many MMIO handlers\n");
+        return NULL;
+    }
+
+    return &dev->mmio[dev->n_mmio++];
+}
+
+
+/* Add a handler for the part [origin, origin + size) of a single page.
+   Handlers at the head of the list are looked up first */
+static bool page_add_mmio(device_t *dev, uint32_t origin, uint32_t size,
+                          uint32_t base, mmio_read_t read, mmio_write_t write,
+                          void *ctx, bool at_head)
+{
+    page_t *page = &dev->pages[origin >> DEV_PAGE_SHIFT];
+    mmio_t *mmio;
+
+    /* A page that was plain memory keeps it as its last handler */
+    if (page->data)
+    {
+        uint32_t page_addr = origin & ~(DEV_PAGE_SIZE - 1);
+
+        if (!(mmio = mmio_alloc(dev)))
+        {
+            return false;
+        }
+
+        *mmio = (mmio_t){page_addr, DEV_PAGE_SIZE, page_addr,
+                         mem_mmio_read, mem_mmio_write, page->data, NULL};
+        page->mmio = mmio;
+        page->data = NULL;
+    }
+
+    if (!(mmio = mmio_alloc(dev)))
+    {
+        return false;
+    }
+
+    *mmio = (mmio_t){origin, size, base, read, write, ctx, NULL};
+
+    if (at_head || !page->mmio)
+    {
+        mmio->next = page->mmio;
+        page->mmio = mmio;
+    }
+    else
+    {
+        mmio_t *last = page->mmio;
+
+        while (last->next)
+        {
+            last = last->next;
+        }
+
+        last->next = mmio;
+    }
+
+    return true;
+}
+
+
+bool device_map_memory(device_t *dev, uint32_t origin, uint32_t size, uint8_t *data)
+{
+    uint64_t end = (uint64_t)origin + size;
+
+    if (!size || end > ((uint64_t)1 << 32))
+    {
+        printf("Error: invalid memory region 0x%08X\n", origin);
+        return false;
+    }
+
+    for (uint64_t addr = origin & ~(DEV_PAGE_SIZE - 1); addr < end; addr += DEV_PAGE_SIZE)
+    {
+        page_t *page = &dev->pages[addr >> DEV_PAGE_SHIFT];
+
+        if (addr >= origin && (addr + DEV_PAGE_SIZE) <= end && !page->data && !page->mmio)
+        {
+            page->data = data + (addr - origin);
+        }
+        else
+        {
+            /* Partially covered or shared page */
+            uint64_t lo = addr > origin ? addr : origin;
+            uint64_t hi = (addr + DEV_PAGE_SIZE) < end ? (addr + DEV_PAGE_SIZE) : end;
+
+            if (!page_add_mmio(dev, lo, hi - lo, origin,
+                               mem_mmio_read, mem_mmio_write, data, false))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+bool device_map_mmio(device_t *dev, uint32_t origin, uint32_t size,
+                     mmio_read_t read, mmio_write_t write, void *ctx)
+{
+    uint64_t end = (uint64_t)origin + size;
+
+    if (!size || end > ((uint64_t)1 << 32))
+    {
+        printf("Error: invalid MMIO region 0x%08X\n", origin);
+        return false;
+    }
+
+    /* The JIT and the flat memory mode access rom and ram directly */
+    if (dev->flat ||
+        (origin < (uint64_t)dev->rom.origin + dev->rom.size && end > dev->rom.origin) ||
+        (origin < (uint64_t)dev->ram.origin + dev->ram.size && end > dev->ram.origin))
+    {
+        printf("Error: MMIO region 0x%08X can't be mapped over rom, ram "
+               "or flat memory\n", origin);
+        return false;
+    }
+
+    for (uint64_t addr = origin & ~(DEV_PAGE_SIZE - 1); addr < end; addr += DEV_PAGE_SIZE)
+    {
+        uint64_t lo = addr > origin ? addr : origin;
+        uint64_t hi = (addr + DEV_PAGE_SIZE) < end ? (addr + DEV_PAGE_SIZE) : end;
+
+        if (!page_add_mmio(dev, lo, hi - lo, origin, read, write, ctx, true))
+        {
+            return false;
+        }
+    }
+
+    dev->host_mmio = true;
+
+    return true;
+}
+
+
+/* Handler of a page that fully covers [addr, addr + size) */
+static mmio_t *mmio_find(device_t *dev, uint32_t addr, uint32_t size)
+{
+    for (mmio_t *mmio = dev->pages[addr >> DEV_PAGE_SHIFT].mmio; mmio; mmio = mmio->next)
+    {
+        if ((addr - mmio->origin) < mmio->size && (addr - mmio->origin + size) <= mmio->size)
+        {
+            return mmio;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Access that isn't within a single page of plain memory. It is split at
+   page boundaries and nothing is accessed unless every part is mapped */
+static bool page_access(device_t *dev, uint32_t addr, uint8_t *data,
+                        uint32_t size, bool write)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint32_t done = 0;
+
+        while (done < size)
+        {
+            uint32_t cur = addr + done;
+            uint32_t n = DEV_PAGE_SIZE - (cur & (DEV_PAGE_SIZE - 1));
+            page_t *page = &dev->pages[cur >> DEV_PAGE_SHIFT];
+            mmio_t *mmio = NULL;
+
+            n = n < (size - done) ? n : (size - done);
+
+            if (!page->data && !(mmio = mmio_find(dev, cur, n)))
+            {
+                return false;
+            }
+
+            if (pass == 1)
+            {
+                if (page->data && write)
+                {
+                    memcpy(page->data + (cur & (DEV_PAGE_SIZE - 1)), data + done, n);
+                }
+                else if (page->data)
+                {
+                    memcpy(data + done, page->data + (cur & (DEV_PAGE_SIZE - 1)), n);
+                }
+                else if (write ? !mmio->write || !mmio->write(mmio->ctx, cur - mmio->base, data + done, n)
+                               : !mmio->read || !mmio->read(mmio->ctx, cur - mmio->base, data + done, n))
+                {
+                    return false;
+                }
+            }
+
+            done += n;
+        }
+    }
+
+    return true;
+}
+
+
+static void ckpt_regions(device_t *dev, mem_t **regions)
+{
+    regions[0] = &dev->rom;
+    regions[1] = &dev->ram;
+    regions[2] = &dev->periph;
+}
+
+
+/* First store to a page since the last checkpoint, the page is recorded
+   as dirty and made writable until the next one */
+static bool ckpt_fault(device_t *dev, uint8_t *addr)
+{
+    mem_t *regions[CKPT_REGIONS];
+    ckpt_regions(dev, regions);
+
+    for (int r = 0; r < CKPT_REGIONS; r++)
+    {
+        uint8_t *data = regions[r]->data;
+
+        if (addr < data || addr >= data + regions[r]->size)
+        {
+            continue;
+        }
+
+        uint32_t offset = (addr - data) & ~(DEV_PAGE_SIZE - 1);
+
+        if (dev->ckpt_n_dirty >= dev->ckpt_max_dirty ||
+            mprotect(data + offset, DEV_PAGE_SIZE, PROT_READ | PROT_WRITE))
+        {
+            return false;
+        }
+
+        dev->ckpt_dirty[dev->ckpt_n_dirty++] = (regions[r]->origin + offset) >> DEV_PAGE_SHIFT;
+        return true;
+    }
+
+    return false;
+}
+
+
+/* An access to an unmapped page of a flat device lands here. The page is
+   made accessible so the access can complete, and the fault is flagged
+   for flat_read()/flat_write() to discard its result */
+static void flat_sigsegv(int sig, siginfo_t *info, void *ctx)
+{
+    uint8_t *addr = info->si_addr;
+
+    for (int i = 0; i < CKPT_MAX_DEVICES; i++)
+    {
+        if (ckpt_devices[i] && ckpt_fault(ckpt_devices[i], addr))
+        {
+            return;
+        }
+    }
+
+    for (int i = 0; i < FLAT_MAX_DEVICES; i++)
+    {
+        device_t *dev = flat_devices[i];
+
+        if (dev && addr >= dev->flat && addr < dev->flat + FLAT_SPACE_SIZE &&
+            dev->flat_n_fault_pages < 2)
+        {
+            uint8_t *page = (uint8_t*)((uintptr_t)addr & ~(flat_page_size - 1));
+
+            if (!mprotect(page, flat_page_size, PROT_READ | PROT_WRITE))
+            {
+                dev->flat_fault_pages[dev->flat_n_fault_pages++] = page;
+                dev->flat_fault = true;
+                return;
+            }
+        }
+    }
+
+    /* Not a guest access, let the previous disposition handle it */
+    sigaction(SIGSEGV, &flat_prev_action, NULL);
+}
+
+
+static void flat_unregister(device_t *dev)
+{
+    for (int i = 0; i < FLAT_MAX_DEVICES; i++)
+    {
+        if (flat_devices[i] == dev)
+        {
+            flat_devices[i] = NULL;
+        }
+    }
+}
+
+
+/* Unmap the pages touched by a faulted access again */
+static void flat_recover(device_t *dev)
+{
+    for (uint32_t i = 0; i < dev->flat_n_fault_pages; i++)
+    {
+        madvise(dev->flat_fault_pages[i], flat_page_size, MADV_DONTNEED);
+        mprotect(dev->flat_fault_pages[i], flat_page_size, PROT_NONE);
+    }
+
+    dev->flat_n_fault_pages = 0;
+    dev->flat_fault = false;
+}
+
+
+static inline bool flat_read(device_t *dev, uint32_t addr, void *data, uint32_t size)
+{
+    memcpy(data, dev->flat + addr, size);
+    __asm__ __volatile__("" ::: "memory");
+
+    if (dev->flat_fault)
+    {
+        flat_recover(dev);
+        return false;
+    }
+
+    return true;
+}
+
+
+static inline bool flat_write(device_t *dev, uint32_t addr, const void *data, uint32_t size)
+{
+    if ((addr - dev->watch_origin) < dev->watch_size)
+    {
+        watch_hit(dev, addr, size);
+    }
+
+    memcpy(dev->flat + addr, data, size);
+    __asm__ __volatile__("" ::: "memory");
+
+    if (dev->flat_fault)
+    {
+        flat_recover(dev);
+        return false;
+    }
+
+    if (dev->code_pages[addr >> DEV_PAGE_SHIFT] ||
+        dev->code_pages[(addr + size - 1) >> DEV_PAGE_SHIFT])
+    {
+        code_invalidate(dev, addr, size);
+    }
+
+    return true;
+}
+
+
+static bool flat_map_region(device_t *dev, const mem_t *mem)
+{
+    size_t size = (mem->size + flat_page_size - 1) & ~(flat_page_size - 1);
+
+    if ((mem->origin & (flat_page_size - 1)) ||
+        ((uint64_t)mem->origin + size) > ((uint64_t)1 << 32))
+    {
+        printf("Error: region 0x%08X is not page aligned\n", mem->origin);
+        return false;
+    }
+
+    if (mprotect(dev->flat + mem->origin, size, PROT_READ | PROT_WRITE))
+    {
+        printf("Error: can't map region 0x%08X\n", mem->origin);
+        return false;
+    }
+
+    return true;
+}
+
+
+static void flat_move_region(device_t *dev, mem_t *mem)
+{
+    static const uint8_t zeros[DEV_PAGE_SIZE];
+    uint8_t *data = dev->flat + mem->origin;
+
+    /* The flat space is zero filled on demand as well, copying only the
+       pages in use keeps the rest of the region untouched */
+    for (uint32_t offset = 0; offset < mem->size; offset += DEV_PAGE_SIZE)
+    {
+        uint32_t n = mem->size - offset < DEV_PAGE_SIZE ? mem->size - offset : DEV_PAGE_SIZE;
+
+        if (memcmp(mem->data + offset, zeros, n))
+        {
+            memcpy(data + offset, mem->data + offset, n);
+        }
+    }
+
+    /* Point the memory map to the new location of the region */
+    for (uint32_t i = 0; i < DEV_NUM_PAGES; i++)
+    {
+        uint8_t *page_data = dev->pages[i].data;
+
+        if (page_data >= mem->data && page_data < mem->data + mem->size)
+        {
+            dev->pages[i].data = data + (page_data - mem->data);
+        }
+    }
+
+    for (uint32_t i = 0; i < dev->n_mmio; i++)
+    {
+        uint8_t *ctx = dev->mmio[i].ctx;
+
+        if (dev->mmio[i].read == mem_mmio_read &&
+            ctx >= mem->data && ctx < mem->data + mem->size)
+        {
+            dev->mmio[i].ctx = data + (ctx - mem->data);
+        }
+    }
+
+    mem_free(mem->data, mem->size);
+    mem->data = data;
+}
+
+
+/* Ask for huge pages backing the RAM and the decoded program, before
+   anything is loaded. Fewer TLB misses for programs with a large working
+   set, at the cost of memory for small ones */
+bool device_use_huge_pages(device_t *dev)
+{
+#ifdef MADV_HUGEPAGE
+    if (dev->uinsts)
+    {
+        printf("Error: huge pages have to be enabled before decoding\n");
+        return false;
+    }
+
+    if (madvise(dev->ram.data, dev->ram.size, MADV_HUGEPAGE))
+    {
+        printf("Error: huge pages are not available\n");
+        return false;
+    }
+
+    dev->huge_pages = true;
+    return true;
+#else
+    printf("Error: huge pages are not supported on this host\n");
+    return false;
+#endif
+}
+
+
+/* Guest accesses to unmapped flat memory and stores to write protected
+   pages are caught by the same SIGSEGV handler */
+static bool sigsegv_install(void)
+{
+    if (!flat_page_size)
+    {
+        struct sigaction sa = {0};
+
+        flat_page_size = sysconf(_SC_PAGESIZE);
+        sa.sa_sigaction = flat_sigsegv;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(SIGSEGV, &sa, &flat_prev_action))
+        {
+            printf("Error: can't install the SIGSEGV handler\n");
+            flat_page_size = 0;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool device_use_flat_memory(device_t *dev)
+{
+    int slot = -1;
+
+    if (dev->flat)
+    {
+        return true;
+    }
+
+    if (dev->ckpt_dirty)
+    {
+        printf("Error: flat memory has to be set up before a checkpoint\n");
+        return false;
+    }
+
+    for (int i = 0; i < FLAT_MAX_DEVICES && slot < 0; i++)
+    {
+        if (!flat_devices[i])
+        {
+            slot = i;
+        }
+    }
+
+    if (slot < 0)
+    {
+        printf("Error: too many devices with flat memory\n");
+        return false;
+    }
+
+    /* Accesses in the flat space bypass the memory map */
+    for (uint32_t i = 0; i < dev->n_mmio; i++)
+    {
+        if (dev->mmio[i].read != mem_mmio_read)
+        {
+            printf("Error: flat memory can't be used with MMIO handlers\n");
+            return false;
+        }
+    }
+
+    if (!sigsegv_install())
+    {
+        return false;
+    }
+
+    dev->flat = mmap(NULL, FLAT_SPACE_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (dev->flat == MAP_FAILED)
+    {
+        printf("Error: can't reserve the guest address space\n");
+        dev->flat = NULL;
+        return false;
+    }
+
+    /* Regions are mapped in whole pages, so the tail of a region's last
+       page is accessible too. Overlapping regions are not supported */
+    if (!flat_map_region(dev, &dev->rom) ||
+        !flat_map_region(dev, &dev->ram) ||
+        !flat_map_region(dev, &dev->periph))
+    {
+        munmap(dev->flat, FLAT_SPACE_SIZE);
+        dev->flat = NULL;
+        return false;
+    }
+
+    flat_move_region(dev, &dev->rom);
+    flat_move_region(dev, &dev->ram);
+    flat_move_region(dev, &dev->periph);
+
+#ifdef MADV_HUGEPAGE
+    if (dev->huge_pages)
+    {
+        madvise(dev->ram.data, dev->ram.size, MADV_HUGEPAGE);
+    }
+#endif
+
+    flat_devices[slot] = dev;
+    return true;
+}
+
+
+bool device_write(device_t *dev, uint32_t addr,
+                  const uint8_t *data, uint32_t size)
+{
+    if (dev->flat && size <= 4)
+    {
+        return flat_write(dev, addr, data, size);
+    }
+
+    if ((addr - dev->watch_origin) < dev->watch_size)
+    {
+        watch_hit(dev, addr, size);
+    }
+
+    page_t *page = &dev->pages[addr >> DEV_PAGE_SHIFT];
+    uint32_t offset = addr & (DEV_PAGE_SIZE - 1);
+
+    if (page->data && (offset + size) <= DEV_PAGE_SIZE)
+    {
+        memcpy(page->data + offset, data, size);
+
+        if (dev->code_pages[addr >> DEV_PAGE_SHIFT])
+        {
+            code_invalidate(dev, addr, size);
+        }
+
+        return true;
+    }
+
+    if (!page_access(dev, addr, (uint8_t*)data, size, true))
+    {
+        return false;
+    }
+
+    if (dev->code_pages[addr >> DEV_PAGE_SHIFT] ||
+        dev->code_pages[(addr + size - 1) >> DEV_PAGE_SHIFT])
+    {
+        code_invalidate(dev, addr, size);
+    }
+
+    return true;
+}
+
+
+bool device_read(device_t *dev, uint32_t addr, uint8_t *data, uint32_t size)
+{
+    if (dev->flat && size <= 4)
+    {
+        return flat_read(dev, addr, data, size);
+    }
+
+    page_t *page = &dev->pages[addr >> DEV_PAGE_SHIFT];
+    uint32_t offset = addr & (DEV_PAGE_SIZE - 1);
+
+    if (page->data && (offset + size) <= DEV_PAGE_SIZE)
+    {
+        memcpy(data, page->data + offset, size);
+        return true;
+    }
+
+    return page_access(dev, addr, data, size, false);
+}
+
+
+/* Write protect a guest page again after the checkpoint took it */
+static void ckpt_protect(device_t *dev, uint32_t page)
+{
+    mem_t *regions[CKPT_REGIONS];
+    ckpt_regions(dev, regions);
+
+    for (int r = 0; r < CKPT_REGIONS; r++)
+    {
+        uint32_t offset = (page << DEV_PAGE_SHIFT) - regions[r]->origin;
+
+        if (offset < regions[r]->size)
+        {
+            mprotect(regions[r]->data + offset, DEV_PAGE_SIZE, PROT_READ);
+            return;
+        }
+    }
+}
+
+
+/* Copy a guest page between the memory and the checkpoint copy */
+static void ckpt_copy(device_t *dev, uint32_t page, bool restore)
+{
+    mem_t *regions[CKPT_REGIONS];
+    ckpt_regions(dev, regions);
+
+    for (int r = 0; r < CKPT_REGIONS; r++)
+    {
+        uint32_t offset = (page << DEV_PAGE_SHIFT) - regions[r]->origin;
+
+        if (offset < regions[r]->size)
+        {
+            uint32_t n = regions[r]->size - offset < DEV_PAGE_SIZE ?
+                         regions[r]->size - offset : DEV_PAGE_SIZE;
+
+            if (restore)
+            {
+                memcpy(regions[r]->data + offset, dev->ckpt_data[r] + offset, n);
+            }
+            else
+            {
+                memcpy(dev->ckpt_data[r] + offset, regions[r]->data + offset, n);
+            }
+
+            return;
+        }
+    }
+}
+
+
+static void ckpt_release(device_t *dev)
+{
+    mem_t *regions[CKPT_REGIONS];
+    ckpt_regions(dev, regions);
+
+    if (!dev->ckpt_dirty)
+    {
+        return;
+    }
+
+    for (int i = 0; i < CKPT_MAX_DEVICES; i++)
+    {
+        if (ckpt_devices[i] == dev)
+        {
+            ckpt_devices[i] = NULL;
+        }
+    }
+
+    for (int r = 0; r < CKPT_REGIONS; r++)
+    {
+        mprotect(regions[r]->data, regions[r]->size, PROT_READ | PROT_WRITE);
+        mem_free(dev->ckpt_data[r], regions[r]->size);
+        dev->ckpt_data[r] = NULL;
+    }
+
+    free(dev->ckpt_dirty);
+    dev->ckpt_dirty = NULL;
+    dev->ckpt_n_dirty = 0;
+}
+
+
+/* Remember the registers and the memory to return to them with
+   device_reset_to_checkpoint(). The memory is write protected and the
+   first store to a page marks it dirty, so only the first checkpoint
+   copies everything. Later ones copy the pages dirtied since */
+bool device_checkpoint(device_t *dev)
+{
+    mem_t *regions[CKPT_REGIONS];
+    ckpt_regions(dev, regions);
+
+    if (!dev->ckpt_dirty)
+    {
+        int slot = -1;
+
+        for (int i = 0; i < CKPT_MAX_DEVICES && slot < 0; i++)
+        {
+            if (!ckpt_devices[i])
+            {
+                slot = i;
+            }
+        }
+
+        if (slot < 0 || !sigsegv_install() || flat_page_size != DEV_PAGE_SIZE)
+        {
+            printf("Error: checkpoints are not available for this device\n");
+            return false;
+        }
+
+        dev->ckpt_max_dirty = 0;
+
+        for (int r = 0; r < CKPT_REGIONS; r++)
+        {
+            dev->ckpt_max_dirty += (regions[r]->size + DEV_PAGE_SIZE - 1) / DEV_PAGE_SIZE;
+        }
+
+        dev->ckpt_dirty = malloc(dev->ckpt_max_dirty * sizeof(uint32_t));
+
+        for (int r = 0; r < CKPT_REGIONS; r++)
+        {
+            dev->ckpt_data[r] = mem_alloc(regions[r]->size, false);
+        }
+
+        if (!dev->ckpt_dirty || !dev->ckpt_data[0] || !dev->ckpt_data[1] || !dev->ckpt_data[2])
+        {
+            printf("Error: can't allocate the checkpoint\n");
+            ckpt_release(dev);
+            return false;
+        }
+
+        /* Pages never written stay zero in the copy as well */
+        static const uint8_t zeros[DEV_PAGE_SIZE];
+
+        for (int r = 0; r < CKPT_REGIONS; r++)
+        {
+            for (uint32_t offset = 0; offset < regions[r]->size; offset += DEV_PAGE_SIZE)
+            {
+                uint32_t n = regions[r]->size - offset < DEV_PAGE_SIZE ?
+                             regions[r]->size - offset : DEV_PAGE_SIZE;
+
+                if (memcmp(regions[r]->data + offset, zeros, n))
+                {
+                    memcpy(dev->ckpt_data[r] + offset, regions[r]->data + offset, n);
+                }
+            }
+
+            mprotect(regions[r]->data, regions[r]->size, PROT_READ);
+        }
+
+        ckpt_devices[slot] = dev;
+    }
+    else
+    {
+        for (uint32_t i = 0; i < dev->ckpt_n_dirty; i++)
+        {
+            ckpt_copy(dev, dev->ckpt_dirty[i], false);
+            ckpt_protect(dev, dev->ckpt_dirty[i]);
+        }
+    }
+
+    dev->ckpt_n_dirty = 0;
+    dev->ckpt_pc = dev->pc;
+    memcpy(dev->ckpt_regs, dev->regs, sizeof(dev->regs));
+
+    /* A run may have stopped in the middle of an ILP block */
+    dev->ckpt_ilp_id = dev->ilp_cur_id;
+    dev->ckpt_ilp_items = dev->ilp_cur_items;
+    dev->ckpt_ilp_done = dev->ilp_cur_done;
+    memcpy(dev->ckpt_ilp_saved, dev->ilp_saved, sizeof(dev->ilp_saved));
+
+    return true;
+}
+
+
+/* Return to the last checkpoint, copying back only the pages written
+   since then */
+bool device_reset_to_checkpoint(device_t *dev)
+{
+    if (!dev->ckpt_dirty)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < dev->ckpt_n_dirty; i++)
+    {
+        uint32_t page = dev->ckpt_dirty[i];
+
+        ckpt_copy(dev, page, true);
+        ckpt_protect(dev, page);
+
+        if (dev->code_pages[page])
+        {
+            code_invalidate(dev, page << DEV_PAGE_SHIFT, DEV_PAGE_SIZE);
+        }
+    }
+
+    dev->ckpt_n_dirty = 0;
+    dev->pc = dev->ckpt_pc;
+    memcpy(dev->regs, dev->ckpt_regs, sizeof(dev->regs));
+
+    dev->ilp_cur_id = dev->ckpt_ilp_id;
+    dev->ilp_cur_items = dev->ckpt_ilp_items;
+    dev->ilp_cur_done = dev->ckpt_ilp_done;
+    memcpy(dev->ilp_saved, dev->ckpt_ilp_saved, sizeof(dev->ilp_saved));
+
+    return true;
+}
+
+
+/* Snapshot file layout: header, table of runs of non-zero pages, then the
+   page data aligned to DEV_PAGE_SIZE so that it can be mapped on restore */
+#define SNAPSHOT_MAGIC   0x53535652u    /* "RVSS" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_REGIONS 3
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t elf_hash;
+    uint32_t regs[32];
+    uint32_t pc;
+    uint32_t n_runs;
+    uint32_t origins[SNAPSHOT_REGIONS];
+    uint32_t sizes[SNAPSHOT_REGIONS];
+
+} snapshot_hdr_t;
+
+
+typedef struct
+{
+    uint32_t region;
+    uint32_t page;
+    uint32_t n_pages;
+    uint32_t reserved;
+    uint64_t offset;
+
+} snapshot_run_t;
+
+
+static void snapshot_regions(device_t *dev, mem_t **regions)
+{
+    regions[0] = &dev->rom;
+    regions[1] = &dev->ram;
+    regions[2] = &dev->periph;
+}
+
+
+/* Save registers and all memory regions, pages that are all zero are
+   left out */
+bool device_save_snapshot(device_t *dev, const char *file_name)
+{
+    static const uint8_t zeros[DEV_PAGE_SIZE];
+    mem_t *regions[SNAPSHOT_REGIONS];
+    snapshot_hdr_t hdr = {0};
+    snapshot_run_t *runs = NULL;
+    uint32_t max_runs = 0;
+
+    snapshot_regions(dev, regions);
+
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.elf_hash = elf_hash(dev);
+    hdr.pc = dev->pc;
+    memcpy(hdr.regs, dev->regs, sizeof(hdr.regs));
+
+    for (uint32_t r = 0; r < SNAPSHOT_REGIONS; r++)
+    {
+        hdr.origins[r] = regions[r]->origin;
+        hdr.sizes[r] = regions[r]->size;
+
+        uint32_t n_pages = (regions[r]->size + DEV_PAGE_SIZE - 1) / DEV_PAGE_SIZE;
+
+        for (uint32_t page = 0; page < n_pages; page++)
+        {
+            uint32_t offset = page * DEV_PAGE_SIZE;
+            uint32_t n = regions[r]->size - offset < DEV_PAGE_SIZE ?
+                         regions[r]->size - offset : DEV_PAGE_SIZE;
+
+            if (!memcmp(regions[r]->data + offset, zeros, n))
+            {
+                continue;
+            }
+
+            snapshot_run_t *last = hdr.n_runs ? &runs[hdr.n_runs - 1] : NULL;
+
+            if (last && last->region == r && last->page + last->n_pages == page)
+            {
+                last->n_pages++;
+                continue;
+            }
+
+            if (hdr.n_runs == max_runs)
+            {
+                max_runs = max_runs ? max_runs * 2 : 64;
+                snapshot_run_t *new_runs = realloc(runs, max_runs * sizeof(snapshot_run_t));
+
+                if (!new_runs)
+                {
+                    free(runs);
+                    return false;
+                }
+
+                runs = new_runs;
+            }
+
+            runs[hdr.n_runs++] = (snapshot_run_t){.region = r, .page = page, .n_pages = 1};
+        }
+    }
+
+    uint64_t offset = sizeof(hdr) + hdr.n_runs * sizeof(snapshot_run_t);
+    offset = (offset + DEV_PAGE_SIZE - 1) & ~(uint64_t)(DEV_PAGE_SIZE - 1);
+
+    for (uint32_t i = 0; i < hdr.n_runs; i++)
+    {
+        runs[i].offset = offset;
+        offset += (uint64_t)runs[i].n_pages * DEV_PAGE_SIZE;
+    }
+
+    FILE *snapshot = fopen(file_name, "wb");
+
+    if (!snapshot)
+    {
+        printf("Error: unable to create '%s'\n", file_name);
+        free(runs);
+        return false;
+    }
+
+    bool res = fwrite(&hdr, sizeof(hdr), 1, snapshot) == 1 &&
+               fwrite(runs, sizeof(snapshot_run_t), hdr.n_runs, snapshot) == hdr.n_runs;
+
+    for (uint32_t i = 0; res && i < hdr.n_runs; i++)
+    {
+        const mem_t *mem = regions[runs[i].region];
+        uint32_t start = runs[i].page * DEV_PAGE_SIZE;
+        uint32_t size = runs[i].n_pages * DEV_PAGE_SIZE;
+
+        /* The last page of a region may be partial */
+        uint32_t n = mem->size - start < size ? mem->size - start : size;
+
+        res = !fseek(snapshot, runs[i].offset, SEEK_SET) &&
+              fwrite(mem->data + start, 1, n, snapshot) == n &&
+              fwrite(zeros, 1, size - n, snapshot) == size - n;
+    }
+
+    res = !fclose(snapshot) && res;
+    free(runs);
+
+    if (!res)
+    {
+        printf("Error: unable to write '%s'\n", file_name);
+    }
+
+    return res;
+}
+
+
+static void stats_fold(device_t *dev);
+
+
+/* Restore a snapshot taken by device_save_snapshot() with the same memory
+   layout and program. Saved pages are mapped copy-on-write from the file
+   where the host page size allows it, so only the pages a run touches get
+   read. Code decoded before is decoded again */
+bool device_load_snapshot(device_t *dev, const char *file_name)
+{
+    mem_t *regions[SNAPSHOT_REGIONS];
+    snapshot_hdr_t hdr;
+    int fd = open(file_name, O_RDONLY);
+
+    if (fd < 0)
+    {
+        printf("Error: unable to open '%s'\n", file_name);
+        return false;
+    }
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION)
+    {
+        printf("Error: invalid snapshot file '%s'\n", file_name);
+        close(fd);
+        return false;
+    }
+
+    snapshot_regions(dev, regions);
+
+    for (uint32_t r = 0; r < SNAPSHOT_REGIONS; r++)
+    {
+        if (hdr.origins[r] != regions[r]->origin || hdr.sizes[r] != regions[r]->size)
+        {
+            printf("Error: the snapshot has a different memory layout\n");
+            close(fd);
+            return false;
+        }
+    }
+
+    if (hdr.elf_hash && elf_hash(dev) && hdr.elf_hash != elf_hash(dev))
+    {
+        printf("Error: the snapshot was taken with another program\n");
+        close(fd);
+        return false;
+    }
+
+    snapshot_run_t *runs = malloc((hdr.n_runs + 1) * sizeof(snapshot_run_t));
+    size_t runs_size = hdr.n_runs * sizeof(snapshot_run_t);
+
+    if (!runs || pread(fd, runs, runs_size, sizeof(hdr)) != runs_size)
+    {
+        printf("Error: invalid snapshot file '%s'\n", file_name);
+        free(runs);
+        close(fd);
+        return false;
+    }
+
+    /* Every run is checked before anything gets replaced, so that a
+       malformed file leaves the device as it was */
+    struct stat st;
+    bool valid = !fstat(fd, &st);
+
+    for (uint32_t i = 0; valid && i < hdr.n_runs; i++)
+    {
+        uint64_t start = (uint64_t)runs[i].page * DEV_PAGE_SIZE;
+        uint64_t size = (uint64_t)runs[i].n_pages * DEV_PAGE_SIZE;
+
+        valid = runs[i].region < SNAPSHOT_REGIONS &&
+                start + size <= ((regions[runs[i].region]->size + DEV_PAGE_SIZE - 1) &
+                                 ~(DEV_PAGE_SIZE - 1)) &&
+                runs[i].offset <= (uint64_t)st.st_size &&
+                size <= (uint64_t)st.st_size - runs[i].offset;
+    }
+
+    if (!valid)
+    {
+        printf("Error: malformed snapshot file '%s'\n", file_name);
+        free(runs);
+        close(fd);
+        return false;
+    }
+
+    /* The regions are replaced altogether */
+    ckpt_release(dev);
+
+    /* Regions start out as fresh zero pages, then get the saved ones */
+    bool map = sysconf(_SC_PAGESIZE) == DEV_PAGE_SIZE;
+
+    for (uint32_t r = 0; r < SNAPSHOT_REGIONS; r++)
+    {
+        if (!map || mmap(regions[r]->data, regions[r]->size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+                         -1, 0) == MAP_FAILED)
+        {
+            memset(regions[r]->data, 0, regions[r]->size);
+        }
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (dev->huge_pages)
+    {
+        madvise(dev->ram.data, dev->ram.size, MADV_HUGEPAGE);
+    }
+#endif
+
+    bool res = true;
+
+    for (uint32_t i = 0; res && i < hdr.n_runs; i++)
+    {
+        const mem_t *mem = regions[runs[i].region];
+        uint64_t start = (uint64_t)runs[i].page * DEV_PAGE_SIZE;
+        uint64_t size = (uint64_t)runs[i].n_pages * DEV_PAGE_SIZE;
+
+        if (map && mmap(mem->data + start, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, fd, runs[i].offset) != MAP_FAILED)
+        {
+            continue;
+        }
+
+        uint32_t n = mem->size - start < size ? mem->size - start : size;
+        res = pread(fd, mem->data + start, n, runs[i].offset) == n;
+    }
+
+    free(runs);
+    close(fd);
+
+    if (!res)
+    {
+        printf("Error: unable to read '%s'\n", file_name);
+        return false;
+    }
+
+    memcpy(dev->regs, hdr.regs, sizeof(dev->regs));
+    dev->regs[0] = 0;
+    dev->pc = hdr.pc;
+
+    /* Nothing of an ILP block the device was running carries over */
+    dev->ilp_cur_items = 0;
+    dev->ilp_cur_done = 0;
+
+    /* The pre-unpacked program goes back to being decoded lazily, which
+       is cheaper than decoding it again right away. Pending block counts
+       are folded while their slots still say what ran */
+    stats_fold(dev);
+
+    uint32_t num_insts = dev->uinsts ? (dev->prog_end - dev->rom.origin) / 4 : 0;
+    const uinst_t undecoded = {.inst_id = INST_UNDECODED};
+
+    for (uint32_t i = 0; i < num_insts; i++)
+    {
+        dev->uinsts[i] = undecoded;
+        pack_instruction(&undecoded, dev->cinsts + i);
+
+        if (dev->uhandlers && dev->uhandlers[i] != dev->handlers[EXIT_HANDLER_ID])
+        {
+            dev->uhandlers[i] = dev->handlers[INST_UNDECODED];
+        }
+    }
+
+    for (uint32_t page = 0; page < DEV_NUM_PAGES; page++)
+    {
+        uint32_t addr = page << DEV_PAGE_SHIFT;
+
+        if (dev->code_pages[page] && dev->dcache && dev->dcache[page])
+        {
+            code_invalidate(dev, addr, DEV_PAGE_SIZE);
+        }
+    }
+
+#if defined(__x86_64__)
+    if (dev->jit_code)
+    {
+        jit_flush(dev);
+    }
+#endif
+
+    return true;
+}
+
+
+/* A store landed in the window spanning all watched ranges */
+static void watch_hit(device_t *dev, uint32_t addr, uint32_t size)
+{
+    for (uint32_t i = 0; i < dev->n_watches; i++)
+    {
+        const watch_t *watch = &dev->watches[i];
+
+        if (addr < watch->origin + watch->size && addr + size > watch->origin)
+        {
+            dev->events |= watch->events;
+            dev->watch_written = true;
+        }
+    }
+}
+
+
+bool device_watch_mmio(device_t *dev, uint32_t origin, uint32_t size, uint32_t events)
+{
+    if (dev->n_watches == DEV_MAX_WATCHES || !size)
+    {
+        printf("Error: can't watch 0x%08X\n", origin);
+        return false;
+    }
+
+    dev->watches[dev->n_watches++] = (watch_t){origin, size, events};
+
+    /* Grow the window to cover every watched range */
+    uint32_t lo = origin;
+    uint32_t hi = origin + size;
+
+    if (dev->watch_size)
+    {
+        lo = dev->watch_origin < lo ? dev->watch_origin : lo;
+        hi = (dev->watch_origin + dev->watch_size) > hi ? (dev->watch_origin + dev->watch_size) : hi;
+    }
+
+    dev->watch_origin = lo;
+    dev->watch_size = hi - lo;
+
+    return true;
+}
+
+
+/* A store changed decoded instructions. Their slots are decoded again
+   when executed next, and translated code goes away altogether */
+static void code_invalidate(device_t *dev, uint32_t addr, uint32_t size)
+{
+    const uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+    const void *decode = dev->handlers[INST_UNDECODED];
+    uint32_t last = (addr + size - 1) & ~3;
+
+    for (uint32_t pc = addr & ~3; ; pc += 4)
+    {
+        uint32_t idx = (pc - dev->rom.origin) >> 2;
+        dpage_t *dpage = dev->dcache ? dev->dcache[pc >> DEV_PAGE_SHIFT] : NULL;
+
+        if (dev->uinsts && idx < num_insts)
+        {
+            /* The unpacked program is shared with the ILP path and the JIT,
+               so it is updated right away */
+            decode_slot(dev, idx);
+        }
+        else if (dpage)
+        {
+            dpage->handlers[(pc & (DEV_PAGE_SIZE - 1)) >> 2] = decode;
+        }
+
+        if (pc == last)
+        {
+            break;
+        }
+    }
+
+#if defined(__x86_64__)
+    if (dev->jit_code)
+    {
+        jit_flush(dev);
+    }
+#endif
+
+    /* Make the running code return to the dispatch loop */
+    dev->watch_written = true;
+}
+
+
+/* Decoded page for code outside of the pre-unpacked range */
+static dpage_t *dcache_page(device_t *dev, uint32_t pc)
+{
+    uint32_t page = pc >> DEV_PAGE_SHIFT;
+
+    if (!dev->dcache)
+    {
+        dev->dcache = calloc(DEV_NUM_PAGES, sizeof(void*));
+
+        if (!dev->dcache)
+        {
+            return NULL;
+        }
+
+#if defined(__x86_64__)
+        /* Translated code stores to ram without checking for code */
+        if (dev->jit_code)
+        {
+            jit_flush(dev);
+        }
+#endif
+    }
+
+    if (!dev->dcache[page])
+    {
+        dpage_t *dpage = malloc(sizeof(dpage_t));
+
+        if (!dpage)
+        {
+            return NULL;
+        }
+
+        for (uint32_t i = 0; i < DPAGE_INSTS; i++)
+        {
+            dpage->handlers[i] = dev->handlers[INST_UNDECODED];
+        }
+
+        dev->dcache[page] = dpage;
+        dev->code_pages[page] = 1;
+    }
+
+    return dev->dcache[page];
+}
+
+
+void device_set_reg(device_t *dev, int rd, uint32_t val)
+{
+    dev->regs[rd] = val;
+}
+
+
+bool device_run_instruction(device_t *dev, uint32_t inst, uint32_t pc_ro)
+{
+    uinst_t uinst;
+
+    if (!unpack_instruction(inst, &uinst))
+    {
+        printf("Error: failed executing instruction: "
+               "0x%08X at address 0x%08X\n", inst, dev->pc);
+        
+        return false;
+    }
+
+    return device_run_unpacked_instruction(dev, uinst, pc_ro);
+}
+
+
+static bool unpack_instruction(uint32_t inst, uinst_t *uinst)
+{
+    uint32_t opcode = inst & 0b1111111;
+    bool res = true;
+    uinst->inst_id = INST_INVALID;
+
+    switch (opcode)
+    {
+    case 0b0110011:  /* Integer Register-Register ops */
+    {
+        uint32_t funct3 = (inst >> 12) & 0b111;
+        uint32_t funct7 = (inst >> 25) & 0b1111111;
+
+        uinst->rd = (inst >> 7) & 0b11111;
+        uinst->rs1 = (inst >> 15) & 0b11111;
+        uinst->rs2 = (inst >> 20) & 0b11111;
+
+        switch (funct3)
+        {
+        case 0x00:
+            switch (funct7)
+            {
+            case 0x00: /* add */
+                uinst->inst_id = INST_ADD;
+                break;
+
+            case 0x20: /* sub */
+                uinst->inst_id = INST_SUB;
+                break;
+
+            case 0x01: /* mul */
+                uinst->inst_id = INST_MUL;
+                break;
+
+            default:
+                res = false;
+            }
+            break;
+
+        case 0x04: 
+            switch (funct7)
+            {
+            case 0x0: /* xor */
+                uinst->inst_id = INST_XOR;
+                break;
+
+            case 0x01: /* div */
+                uinst->inst_id = INST_DIV;
+                break;
+
+            default:
+                break;
+            }
+            break;
+
+
+        case 0x06:
+            switch (funct7)
+            {
+            case 0x0: /* or */
+                uinst->inst_id = INST_OR;
+                break;
+            
+            case 0x01: /* rem */
+                uinst->inst_id = INST_REM;
+                break;
+
+            default:
+                break;
+            }
+            break;
+
+      
+        case 0x07: 
+            switch (funct7)
+            {
+            case 0x0: /* and */
+                uinst->inst_id = INST_AND;
+                break;                
+            
+            case 0x01: /* remu */
+                uinst->inst_id = INST_REMU;
+                break;
+
+            case 0x07: /* czero.nez */
+                uinst->inst_id = INST_CZERO_NEZ;
+                break;
+
+            default:
+                break;
+            }
+            break;
+
+
+        case 0x01:
+            switch (funct7)
+            {
+            case 0x00: /* sll */
+                uinst->inst_id = INST_SLL;
+                break;
+
+            case 0x01: /* mulh */
+                uinst->inst_id = INST_MULH;
+                break;
+
+            default:
+                res = false;
+            }
+            break;
+
+        case 0x05:
+            switch (funct7)
+            {
+            case 0x00: /* srl */
+                uinst->inst_id = INST_SRL;
+                break;
+
+            case 0x20: /* sra */
+                uinst->inst_id = INST_SRA;
+                break;
+
+            case 0x01: /* divu */
+                uinst->inst_id = INST_DIVU;
+                break;
+
+            case 0x07: /* czero.eqz */
+                uinst->inst_id = INST_CZERO_EQZ;
+                break;
+
+            default:
+                res = false;
+            }
+            break;
+
+        case 0x02:
+            switch (funct7)
+            {
+            case 0x00: /* slt */
+                uinst->inst_id = INST_SLT;
+                break;
+
+            case 0x01: /* mulhsu */
+                uinst->inst_id = INST_MULHSU;
+                break;
+
+            default:
+                res = false;
+            }
+            break;
+
+        case 0x03: 
+            switch (funct7)
+            {
+                case 0x00: /* sltu */
+                    uinst->inst_id = INST_SLTU;
+                    break;
+
+                case 0x01: /* mulhu */
+                    uinst->inst_id = INST_MULHU;
+                    break;
+
+                default:
+                    res = false;
+            }
+            break;
+
+
+        default:
+            res = false;
+            break;
+        }
+    }
+    break;
+
+    case 0b0010011: /* Integer Register-Immediate ops */
+    {
+        uint32_t funct3 = (inst >> 12) & 0b111;
+
+        uinst->rd = (inst >> 7) & 0b11111;
+        uinst->rs1 = (inst >> 15) & 0b11111;
+        uinst->imm = (inst >> 20) & 0b111111111111;
+        uinst->imm = (uinst->imm << 20) >> 20;
+
+        switch (funct3)
+        {
+        case 0x00:  /* addi */
+            uinst->inst_id = INST_ADDI;
+            break;
+
+        case 0x04: /* xori */
+            uinst->inst_id = INST_XORI;
+            break;
+
+        case 0x06: /* ori */
+            uinst->inst_id = INST_ORI;
+            break;
+
+        case 0x07: /* andi */
+            uinst->inst_id = INST_ANDI;
+            break;
+
+        case 0x01:
+            switch (uinst->imm >> 5)
+            {
+            case 0x00: /* slli */
+                uinst->inst_id = INST_SLLI;
+                break;
+
+            default:    
+                res = false;
+            }
+            break;
+
+        case 0x05:
+            switch (uinst->imm >> 5)
+            {
+            case 0x00: /* srli */
+                uinst->inst_id = INST_SRLI;
+                break;
+
+            case 0x20: /* srai */
+                uinst->inst_id = INST_SRAI;
+                break;
+
+            default:
+                res = false;
+            }
+            break;
+
+        case 0x02: /* slti */
+            uinst->inst_id = INST_SLTI;
+            break;
+
+        case 0x03: /* sltiu */
+            uinst->inst_id = INST_SLTIU;
+            break;
+
+        default:
+            res = false;
+            break;
+        }   
+    }
+    break;
+
+    case 0b0100011: /* Store ops */
+    {
+        uint32_t funct3 = (inst >> 12) & 0b111;
+
+        uinst->rs1 = (inst >> 15) & 0b11111;
+        uinst->rs2 = (inst >> 20) & 0b11111;
+        uinst->imm = (inst >> 7) & 0b11111;
+        uinst->imm |= ((inst >> 25) & 0b1111111) << 5;
+        uinst->imm = (uinst->imm << 20) >> 20;
+        
+        switch (funct3)
+        {
+        case 0x00: /* sb */
+            uinst->inst_id = INST_SB;
+            break;
+
+        case 0x01: /* sh */
+            uinst->inst_id = INST_SH;
+            break;
+
+        case 0x02: /* sw */
+            uinst->inst_id = INST_SW;
+            break;
+
+        default:
+            res = false;
+            break;
+        }
+    }
+    break;
+
+    case 0b0000011: /* Load ops */
+    {
+        uint32_t funct3 = (inst >> 12) & 0b111;
+
+        uinst->rd = (inst >> 7) & 0b11111;
+        uinst->rs1 = (inst >> 15) & 0b11111;
+        uinst->imm = (inst >> 20) & 0b111111111111;
+        uinst->imm = (uinst->imm << 20) >> 20;
+
+        switch (funct3)
+        {
+        case 0x00: /* lb */
+            uinst->inst_id = INST_LB;
+            break;
+
+        case 0x01: /* lh */
+            uinst->inst_id = INST_LH;
+            break;
+
+        case 0x02: /* lw */
+            uinst->inst_id = INST_LW;
+            break;
+
+        case 0x04: /* lbu */
+            uinst->inst_id = INST_LBU;
+            break;
+
+        case 0x05: /* lhu */
+            uinst->inst_id = INST_LHU;
+            break;
+
+        default:
+            res = false;
+            break;
+        }
+    }
+    break;
+
+    case 0b1100011: /* Branching ops */
+    {
+        uint32_t funct3 = (inst >> 12) & 0b111;
+        
+        uinst->rs1 = (inst >> 15) & 0b11111;
+        uinst->rs2 = (inst >> 20) & 0b11111;
+
+        uinst->imm = (inst >> 8) & 0b1111;
+        uinst->imm |= ((inst >> 7) & 1) << 10;
+        uinst->imm |= ((inst >> 25) & 0b111111) << 4;
+        uinst->imm = (uinst->imm << 1) | (((inst >> 31) & 1) << 12);
+        uinst->imm = (uinst->imm << 19) >> 19;
+
+        switch (funct3)
+        {
+        case 0x00: /* beq == */
+            uinst->inst_id = INST_BEQ;
+            break;
+
+        case 0x01: /* bne != */
+            uinst->inst_id = INST_BNE;
+            break;
+
+        case 0x04: /* blt < */
+            uinst->inst_id = INST_BLT;
+            break;
+
+        case 0x05: /* bge >= */
+            uinst->inst_id = INST_BGE;
+            break;
+
+        case 0x06: /* bltu < (u) */
+            uinst->inst_id = INST_BLTU;
+            break;
+
+        case 0x07: /* bgeu >= (u) */
+            uinst->inst_id = INST_BGEU;
+            break;
+
+        default:
+            res = false;
+            break;
+        }
+
+    }
+    break;
+
+    case 0b1101111: /* jal */
+    {
+        uinst->rd = (inst >> 7) & 0b11111;
+
+        uinst->imm = ((inst >> 21) & 0b1111111111) << 1;
+        uinst->imm |= ((inst >> 20) & 1) << 11;
+        uinst->imm |= ((inst >> 12) & 0b11111111) << 12;
+        uinst->imm |= (inst >> 31) << 20;
+        uinst->imm = (uinst->imm << 11) >> 11;
+
+        uinst->inst_id = INST_JAL;
+    }
+    break;
+
+    case 0b1100111: /* jalr */
+    {
+        uint32_t funct3 = (inst >> 12) & 0b111;
+
+        uinst->rd = (inst >> 7) & 0b11111;
+        uinst->rs1 = (inst >> 15) & 0b11111;
+        uinst->imm = (inst >> 20) & 0b111111111111;
+        uinst->imm = (uinst->imm << 20) >> 20;
+
+        switch (funct3)
+        {
+        case 0x00:
+            uinst->inst_id = INST_JALR;
+            break;
+
+        default:
+            res = false;
+            break;
+        }
+    }
+    break;
+
+    case 0b0110111: /* lui */
+    {
+        uinst->rd = (inst >> 7) & 0b11111;
+        uinst->imm = (inst >> 12) & 0xfffff;
+        uinst->imm = (uinst->imm << 11) >> 11;
+
+        uinst->inst_id = INST_LUI;
+    }
+    break;
+
+    case 0b0010111: /* auipc */
+    {
+        uinst->rd = (inst >> 7) & 0b11111;
+        uinst->imm = (inst >> 12) & 0xfffff;
+        uinst->imm = (uinst->imm << 11) >> 11;
+        
+        uinst->inst_id = INST_AUIPC;
+    }
+    break;
+
+    case 0b1110011: /* Env call & breakpoint */
+    {
+        uint32_t funct12 = (inst >> 20) & 0b111111111111;
+        uint32_t funct3 = (inst >> 12) & 0b111;
+       
+        uinst->rs1 = (inst >> 15) & 0b11111;
+        uinst->rd = (inst >> 7) & 0b11111;
+
+        res = (uinst->rs1 == funct3) == (uinst->rd == 0x0);
+
+        switch (funct12)
+        {
+        case 0x00:
+            uinst->inst_id = INST_ECALL;
+            break;
+
+        case 0x01:
+            uinst->inst_id = INST_BREAK;
+            break;
+
+        default:
+            res = false;
+            break;
+        }
+    }
+    break;
+
+    default:
+        res = false;
+        break;
+    }
+
+    return res; 
+}
+
+
+static void pack_instruction(const uinst_t *uinst, cinst_t *cinst)
+{
+    cinst->op = (uinst->inst_id & 0xff) |
+                ((uinst->rd & 0x1f) << 8) |
+                ((uinst->rs1 & 0x1f) << 16) |
+                ((uinst->rs2 & 0x1f) << 24);
+    cinst->imm = uinst->imm;
+}
+
+
+/* Run an instruction updating *pc, which is dev->pc or the sum of the pc
+   increments of an ILP worker */
+static bool run_unpacked(device_t *dev, uinst_t inst, uint32_t pc_ro, uint32_t *pc)
+{
+    bool res = true;
+    bool pc_updated = false;
+
+    switch(inst.inst_id)
+    {
+    case INST_NOP:
+        break;
+
+    case INST_ADD:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] + dev->regs[inst.rs2]);
+        break;
+
+    case INST_SUB:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] - dev->regs[inst.rs2]);
+        break;
+
+    case INST_MUL:
+        {
+            int32_t prod = (int32_t)dev->regs[inst.rs1] * (int32_t)dev->regs[inst.rs2];
+            device_set_reg(dev, inst.rd, (uint32_t)prod);
+        }
+        break;
+
+    case INST_XOR:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] ^ dev->regs[inst.rs2]);
+        break;
+
+    case INST_DIV:
+        device_set_reg(dev, inst.rd, (uint32_t)((int32_t)dev->regs[inst.rs1] / \
+                                           (int32_t)dev->regs[inst.rs2]));
+        break;
+
+    case INST_OR:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] | dev->regs[inst.rs2]);
+        break;
+
+    case INST_REM:
+        device_set_reg(dev, inst.rd, (uint32_t)((int32_t)dev->regs[inst.rs1] % \
+                                           (int32_t)dev->regs[inst.rs2]));
+        break;
+
+    case INST_AND:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] & dev->regs[inst.rs2]);
+        break;
+
+    case INST_REMU:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] % dev->regs[inst.rs2]);
+        break;
+
+    case INST_CZERO_NEZ:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs2] ? 0 : dev->regs[inst.rs1]);
+        break;
+
+    case INST_SLL:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] << dev->regs[inst.rs2]);
+        break;
+
+    case INST_MULH:
+        {
+            int64_t op1 = (int64_t)(int32_t)dev->regs[inst.rs1];
+            int64_t op2 = (int64_t)(int32_t)dev->regs[inst.rs2];
+            int64_t prod = op1 * op2;
+            // printf("MULH: 0x%08X * 0x%08X = 0x%08X\n", dev->regs[inst.rs1], dev->regs[inst.rs2], (uint32_t)(prod >> 32));
+            device_set_reg(dev, inst.rd, (uint32_t)(prod >> 32));
+        }
+        break;
+
+    case INST_SRL:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] >> dev->regs[inst.rs2]);
+        break;
+
+    case INST_SRA:
+        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] >> dev->regs[inst.rs2]);
+        break;
+
+    case INST_DIVU:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] / dev->regs[inst.rs2]);
+        break;
+
+    case INST_CZERO_EQZ:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs2] ? dev->regs[inst.rs1] : 0);
+        break;
+
+    case INST_SLT:
+        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] < \
+                                (int32_t)dev->regs[inst.rs2] ? 1 : 0);
+        break;
+
+    case INST_MULHSU:
+        {
+            int64_t prod = (int64_t)(int32_t)dev->regs[inst.rs1] * (uint64_t)dev->regs[inst.rs2];
+            device_set_reg(dev, inst.rd, (uint32_t)(prod >> 32));
+        }
+        break;
+
+    case INST_SLTU:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] < dev->regs[inst.rs2] ? 1 : 0);
+        break;
+
+    case INST_MULHU:
+        {
+            uint64_t prod = (uint64_t)dev->regs[inst.rs1] * (uint64_t)dev->regs[inst.rs2];
+            device_set_reg(dev, inst.rd, (uint32_t)(prod >> 32));
+        }
+        break;
+
+    case INST_ADDI:
+        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] + inst.imm);
+        break;
+
+    case INST_XORI:
+        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] ^ inst.imm);
+        break;
+
+    case INST_ORI:
+        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] | inst.imm);
+        break;
+
+    case INST_ANDI:
+        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] & inst.imm);
+        break;
+
+    case INST_SLLI:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] << (inst.imm & 0b11111));
+        break;
+
+    case INST_SRLI:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] >> (inst.imm & 0b11111));
+        break;
+
+    case INST_SRAI:
+        device_set_reg(dev, inst.rd,
+                       ((int32_t)(dev->regs[inst.rs1]) >> (inst.imm & 0b11111)));
+        break;
+
+    case INST_SLTI:
+        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] < inst.imm ? 1 : 0);
+        break;
+
+    case INST_SLTIU:
+        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] < \
+                                ((uint32_t)inst.imm & 0b111111111111) ? 1 : 0);
+        break;
+
+    case INST_SB:
+        {
+            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
+            uint8_t bt = dev->regs[inst.rs2] & 0xff;
+            res = device_write(dev, addr, &bt, 1);
+        }
+        break;
+
+    case INST_SH:
+        {
+            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
+            uint16_t hw = dev->regs[inst.rs2] & 0xffff;
+            res = device_write(dev, addr, (uint8_t*)&hw, 2);
+        }
+        break;
+
+    case INST_SW:
+        {
+            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
+            res = device_write(dev, addr, (uint8_t*)&dev->regs[inst.rs2], 4);
+        }
+        break;
+
+    case INST_LB:
+        {
+            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
+            int8_t sb;
+            res = device_read(dev, addr, (uint8_t*)&sb, 1);
+            device_set_reg(dev, inst.rd, (int32_t)sb);
+        }
+        break;
+
+    case INST_LH:
+        {
+            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
+            int16_t shw;
+            res = device_read(dev, addr, (uint8_t*)&shw, 2);
+            device_set_reg(dev, inst.rd, (int32_t)shw);
+        }
+        break;
+
+    case INST_LW:
+        {
+            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
+            uint32_t w;
+            res = device_read(dev, addr, (uint8_t*)&w, 4);
+            device_set_reg(dev, inst.rd, w);
+        }
+        break;
+
+    case INST_LBU:
+        {
+            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
+            uint8_t ub;
+            res = device_read(dev, addr, &ub, 1);
+            device_set_reg(dev, inst.rd, ub);
+        }
+        break;
+
+    case INST_LHU:
+        {
+            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
+            uint16_t hw;
+            res = device_read(dev, addr, (uint8_t*)&hw, 2);
+            device_set_reg(dev, inst.rd, hw);
+        }
+        break;
+
+    case INST_BEQ:
+        if ((int32_t)(dev->regs[inst.rs1]) == (int32_t)(dev->regs[inst.rs2]))
+        {
+            *pc += inst.imm;
+            pc_updated = true;
+        }
+        break;
+
+    case INST_BNE:
+        if ((int32_t)(dev->regs[inst.rs1]) != (int32_t)(dev->regs[inst.rs2]))
+        {
+            *pc += inst.imm;
+            pc_updated = true;
+        }
+        break;
+
+    case INST_BLT:
+        if ((int32_t)(dev->regs[inst.rs1]) < (int32_t)(dev->regs[inst.rs2]))
+        {
+            *pc += inst.imm;
+            pc_updated = true;
+        }
+        break;
+
+    case INST_BGE:
+        if ((int32_t)(dev->regs[inst.rs1]) >= (int32_t)(dev->regs[inst.rs2]))
+        {
+            *pc += inst.imm;
+            pc_updated = true;
+        }
+        break;
+
+    case INST_BLTU:
+        if (dev->regs[inst.rs1] < dev->regs[inst.rs2])
+        {
+            *pc += inst.imm;
+            pc_updated = true;
+        }
+        break;
+
+    case INST_BGEU:
+        if (dev->regs[inst.rs1] >= dev->regs[inst.rs2])
+        {
+            *pc += inst.imm;
+            pc_updated = true;
+        }
+        break;
+
+    case INST_JAL:
+        if (dev->track_calls && inst.rd == 1)
+        {
+            call_push(dev, pc_ro + inst.imm);
+        }
+
+        device_set_reg(dev, inst.rd, pc_ro + 4);
+        *pc += inst.imm;
+        pc_updated = true;
+        break;
+
+    case INST_JALR:
+        {
+            uint32_t target = dev->regs[inst.rs1] + inst.imm;
+
+            if (dev->track_calls && inst.rd == 1)
+            {
+                call_push(dev, target);
+            }
+            else if (dev->track_calls && !inst.rd && inst.rs1 == 1 && !inst.imm)
+            {
+                call_pop(dev);
+            }
+
+            device_set_reg(dev, inst.rd, pc_ro + 4);
+            *pc = target;
+            pc_updated = true;
+        }
+        break;
+
+    case INST_LUI:
+        device_set_reg(dev, inst.rd, inst.imm << 12);
+        break;
+
+    case INST_AUIPC:
+        device_set_reg(dev, inst.rd, pc_ro + (inst.imm << 12));
+        break;
+
+    case INST_ECALL:
+        break;
+
+    case INST_BREAK:
+        break;
+
+    case INST_INVALID:
+    default:
+        res = false;
+        break;
+
+    }
+
+    if (res && !pc_updated)
+    {
+        *pc += 4;
+    }
+
+    dev->regs[0] = 0;
+
+#ifndef RV_NO_INST_STATS
+    if (res && dev->stats)
+    {
+        dev->inst_stats[inst.inst_id]++;
+    }
+#endif
+
+    return res;
+}
+
+
+static bool device_run_unpacked_instruction(device_t *dev, uinst_t inst, uint32_t pc_ro)
+{
+    return run_unpacked(dev, inst, pc_ro, &dev->pc);
+}
+
+
+/*
+ * x86-64 translator for hot basic blocks.
+ *
+ * The interpreter counts how often each jump target is reached and hands
+ * blocks that cross JIT_THRESHOLD to jit_translate(). A block is translated
+ * instruction by instruction into native code that works on the guest
+ * register file directly: a few of the busiest guest registers live in
+ * callee-saved host registers for as long as native code runs, the rest
+ * stay in dev->regs, addressed off rbx which holds the device pointer.
+ * RAM (and ROM for loads) is accessed inline, everything else goes through
+ * device_read() / device_write(). Block exits with a static target are
+ * chained to the translated target, once it exists; jalr looks its target
+ * up in jit_blocks. Anything the native code cannot continue with, returns
+ * to the interpreter with dev->pc pointing at the next instruction.
+ */
+
+#if defined(__x86_64__)
+
+#define JIT_CODE_SIZE   (16 * 1024 * 1024)
+#define JIT_THRESHOLD   64
+#define JIT_MAX_BLOCK   64
+#define JIT_CONTINUE    (-1)
+
+/* Layout of the code buffer: the common exit, the entry trampoline, blocks */
+#define JIT_EXIT_POS    0
+#define JIT_ENTRY_POS   64
+
+enum
+{
+    X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI,
+    X86_R8,  X86_R9,  X86_R10, X86_R11, X86_R12, X86_R13, X86_R14, X86_R15,
+};
+
+enum
+{
+    X86_CC_B = 0x2, X86_CC_AE = 0x3, X86_CC_E = 0x4, X86_CC_NE = 0x5,
+    X86_CC_A = 0x7, X86_CC_L = 0xc, X86_CC_GE = 0xd,
+};
+
+/* Guest registers kept in host registers: sp, s0, a0, a4, a5. These go to
+   rbp and r12-r15, the callee-saved registers besides rbx, so they survive
+   the calls to device_read(), device_write() and the division helper
+   without spill code. rv32 gcc code addresses locals off sp, keeps values
+   that live across calls in s0 first, passes arguments and results in a0
+   and takes temporaries from a5 downwards */
+static const int8_t JIT_HOST_REG[32] =
+{
+    -1, -1, X86_R12, -1, -1, -1, -1, -1,
+    X86_RBP, -1, X86_R13, -1, -1, -1, X86_R14, X86_R15,
+    -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+typedef struct
+{
+    uint8_t  *code;
+    uint32_t pos;
+    uint32_t size;
+
+} jit_asm_t;
+
+typedef int (*jit_entry_t)(device_t *dev, void *block);
+
+
+static void x86_byte(jit_asm_t *a, uint8_t b)
+{
+    if (a->pos < a->size)
+    {
+        a->code[a->pos] = b;
+    }
+    a->pos++;
+}
+
+
+static void x86_dword(jit_asm_t *a, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        x86_byte(a, (v >> (i * 8)) & 0xff);
+    }
+}
+
+
+static void x86_qword(jit_asm_t *a, uint64_t v)
+{
+    x86_dword(a, (uint32_t)v);
+    x86_dword(a, (uint32_t)(v >> 32));
+}
+
+
+static void x86_rex(jit_asm_t *a, bool w, int reg, int rm)
+{
+    if (w || reg >= 8 || rm >= 8)
+    {
+        x86_byte(a, 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3));
+    }
+}
+
+
+/* op reg, rm - register to register form */
+static void x86_rr(jit_asm_t *a, uint8_t op, int reg, int rm)
+{
+    x86_rex(a, false, reg, rm);
+    x86_byte(a, op);
+    x86_byte(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+/* 0x0f-prefixed op reg, rm - register to register form */
+static void x86_rr_0f(jit_asm_t *a, uint8_t op, int reg, int rm)
+{
+    x86_rex(a, false, reg, rm);
+    x86_byte(a, 0x0f);
+    x86_byte(a, op);
+    x86_byte(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+/* op reg, [rbx + disp] */
+static void x86_rbx(jit_asm_t *a, bool w, uint8_t op, int reg, int32_t disp)
+{
+    x86_rex(a, w, reg, X86_RBX);
+    x86_byte(a, op);
+
+    if (disp >= -128 && disp <= 127)
+    {
+        x86_byte(a, 0x40 | ((reg & 7) << 3) | X86_RBX);
+        x86_byte(a, (uint8_t)disp);
+    }
+    else
+    {
+        x86_byte(a, 0x80 | ((reg & 7) << 3) | X86_RBX);
+        x86_dword(a, (uint32_t)disp);
+    }
+}
+
+
+/* Group 1 ALU op (/n) with a 32-bit immediate */
+static void x86_alu_imm(jit_asm_t *a, int n, int rm, uint32_t imm)
+{
+    x86_rex(a, false, 0, rm);
+    x86_byte(a, 0x81);
+    x86_byte(a, 0xc0 | (n << 3) | (rm & 7));
+    x86_dword(a, imm);
+}
+
+
+static void x86_mov_imm(jit_asm_t *a, int rm, uint32_t imm)
+{
+    x86_rex(a, false, 0, rm);
+    x86_byte(a, 0xb8 | (rm & 7));
+    x86_dword(a, imm);
+}
+
+
+static void x86_call(jit_asm_t *a, const void *fn)
+{
+    x86_byte(a, 0x48);              /* movabs rax, fn */
+    x86_byte(a, 0xb8);
+    x86_qword(a, (uint64_t)(uintptr_t)fn);
+    x86_byte(a, 0xff);              /* call rax */
+    x86_byte(a, 0xd0);
+}
+
+
+/* Emit a jcc/jmp with a 32-bit displacement, return where it is to be patched */
+static uint32_t x86_jcc(jit_asm_t *a, int cc)
+{
+    x86_byte(a, 0x0f);
+    x86_byte(a, 0x80 | cc);
+    x86_dword(a, 0);
+    return a->pos - 4;
+}
+
+
+static uint32_t x86_jmp(jit_asm_t *a)
+{
+    x86_byte(a, 0xe9);
+    x86_dword(a, 0);
+    return a->pos - 4;
+}
+
+
+static void x86_patch(jit_asm_t *a, uint32_t site, uint32_t target)
+{
+    int32_t rel = (int32_t)(target - (site + 4));
+
+    if (site + sizeof(rel) <= a->size)
+    {
+        memcpy(a->code + site, &rel, sizeof(rel));
+    }
+}
+
+
+static void jit_get(jit_asm_t *a, int hreg, uint32_t greg)
+{
+    if (greg == 0)
+    {
+        x86_rr(a, 0x31, hreg, hreg);                    /* xor hreg, hreg */
+    }
+    else if (JIT_HOST_REG[greg] >= 0)
+    {
+        x86_rr(a, 0x89, JIT_HOST_REG[greg], hreg);      /* mov hreg, host */
+    }
+    else
+    {
+        x86_rbx(a, false, 0x8b, hreg, greg * 4);        /* mov hreg, [regs] */
+    }
+}
+
+
+static void jit_put(jit_asm_t *a, uint32_t greg, int hreg)
+{
+    if (greg == 0)
+    {
+        return;
+    }
+
+    if (JIT_HOST_REG[greg] >= 0)
+    {
+        x86_rr(a, 0x89, hreg, JIT_HOST_REG[greg]);      /* mov host, hreg */
+    }
+    else
+    {
+        x86_rbx(a, false, 0x89, hreg, greg * 4);        /* mov [regs], hreg */
+    }
+}
+
+
+/*
+ * Leave native code: give back the budget of the instructions that have
+ * not been executed and return 'reason' with 'pc' as the next instruction.
+ * With dynamic_pc the pc is already in eax.
+ */
+static void jit_exit(device_t *dev, jit_asm_t *a, uint32_t pc, bool dynamic_pc,
+                     int reason, uint32_t n_unexecuted)
+{
+    if (n_unexecuted)
+    {
+        x86_rbx(a, true, 0x81, 0, offsetof(device_t, jit_budget)); /* add [budget], n */
+        x86_dword(a, n_unexecuted);
+    }
+
+    if (!dynamic_pc)
+    {
+        x86_mov_imm(a, X86_RAX, pc);
+    }
+
+    x86_mov_imm(a, X86_RCX, (uint32_t)reason);
+    x86_patch(a, x86_jmp(a), JIT_EXIT_POS);
+}
+
+
+static uint32_t jit_num_insts(device_t *dev)
+{
+    return (dev->prog_end - dev->rom.origin) / 4;
+}
+
+
+static void jit_link(device_t *dev, uint32_t site, uint32_t target_id)
+{
+    if (dev->jit_blocks[target_id])
+    {
+        jit_asm_t a = {dev->jit_code, 0, dev->jit_code_size};
+        x86_patch(&a, site, (uint8_t*)dev->jit_blocks[target_id] - dev->jit_code);
+        return;
+    }
+
+    if (dev->jit_n_patches == dev->jit_max_patches)
+    {
+        uint32_t max_patches = dev->jit_max_patches ? dev->jit_max_patches * 2 : 1024;
+        jit_patch_t *patches = realloc(dev->jit_patches, max_patches * sizeof(jit_patch_t));
+
+        if (!patches)
+        {
+            return; /* The site just keeps returning to the interpreter */
+        }
+
+        dev->jit_patches = patches;
+        dev->jit_max_patches = max_patches;
+    }
+
+    dev->jit_patches[dev->jit_n_patches].site = site;
+    dev->jit_patches[dev->jit_n_patches].next = dev->jit_patch_heads[target_id];
+    dev->jit_patch_heads[target_id] = ++dev->jit_n_patches;
+}
+
+
+/*
+ * Continue at a statically known pc: a jump that is patched to the target
+ * block once it is translated, falling through to a return to the
+ * interpreter until then.
+ */
+static void jit_chain(device_t *dev, jit_asm_t *a, uint32_t pc,
+                      uint32_t *sites, uint32_t *targets, uint32_t *n_sites)
+{
+    uint32_t id = (pc - dev->rom.origin) >> 2;
+
+    if (!(pc & 3) && id < jit_num_insts(dev) && pc != dev->exit_addr)
+    {
+        uint32_t site = x86_jmp(a);
+        sites[*n_sites] = site;
+        targets[*n_sites] = id;
+        (*n_sites)++;
+    }
+
+    jit_exit(dev, a, pc, false, JIT_CONTINUE, 0);
+}
+
+
+static uint32_t jit_helper_div(uint32_t a, uint32_t b, uint32_t inst_id)
+{
+    switch (inst_id)
+    {
+    case INST_DIV:
+        return (uint32_t)((int32_t)a / (int32_t)b);
+
+    case INST_REM:
+        return (uint32_t)((int32_t)a % (int32_t)b);
+
+    case INST_DIVU:
+        return a / b;
+
+    default:
+        return a % b;
+    }
+}
+
+
+/* Inline access to a memory region, jumps to the returned site when the
+   address (in eax) is outside of it */
+static uint32_t jit_mem_fast(device_t *dev, jit_asm_t *a, size_t mem_offset,
+                             const mem_t *mem, uint32_t size)
+{
+    x86_rr(a, 0x89, X86_RAX, X86_RDX);                      /* mov edx, eax */
+    x86_alu_imm(a, 5, X86_RDX, mem->origin);                /* sub edx, origin */
+    x86_alu_imm(a, 7, X86_RDX, mem->size - size);           /* cmp edx, size - n */
+    uint32_t miss = x86_jcc(a, X86_CC_A);
+    x86_rbx(a, true, 0x8b, X86_RSI,                         /* mov rsi, [mem.data] */
+            mem_offset + offsetof(mem_t, data));
+    return miss;
+}
+
+
+static void jit_load(device_t *dev, jit_asm_t *a, const uinst_t *inst,
+                     uint32_t pc, uint32_t n_left)
+{
+    static const uint8_t LOAD_OPS[][2] =
+    {
+        [INST_LB - INST_LB]  = {0x0f, 0xbe},
+        [INST_LH - INST_LB]  = {0x0f, 0xbf},
+        [INST_LW - INST_LB]  = {0x00, 0x8b},
+        [INST_LBU - INST_LB] = {0x0f, 0xb6},
+        [INST_LHU - INST_LB] = {0x0f, 0xb7},
+    };
+    const uint8_t *op = LOAD_OPS[inst->inst_id - INST_LB];
+    uint32_t size = inst->inst_id == INST_LW ? 4 :
+                    (inst->inst_id == INST_LH || inst->inst_id == INST_LHU) ? 2 : 1;
+    uint32_t done[2];
+
+    jit_get(a, X86_RAX, inst->rs1);
+    x86_alu_imm(a, 0, X86_RAX, inst->imm);                  /* add eax, imm */
+
+    for (int i = 0; i < 2; i++)
+    {
+        uint32_t miss = i == 0 ?
+            jit_mem_fast(dev, a, offsetof(device_t, ram), &dev->ram, size) :
+            jit_mem_fast(dev, a, offsetof(device_t, rom), &dev->rom, size);
+
+        if (op[0])                                          /* eax <- [rsi + rdx] */
+        {
+            x86_byte(a, op[0]);
+        }
+        x86_byte(a, op[1]);
+        x86_byte(a, 0x04);
+        x86_byte(a, 0x16);
+        done[i] = x86_jmp(a);
+        x86_patch(a, miss, a->pos);
+    }
+
+    /* device_read(dev, addr, rsp, size) */
+    x86_byte(a, 0x48);                                      /* mov rdi, rbx */
+    x86_rr(a, 0x89, X86_RBX, X86_RDI);
+    x86_rr(a, 0x89, X86_RAX, X86_RSI);                      /* mov esi, eax */
+    x86_byte(a, 0x48);                                      /* mov rdx, rsp */
+    x86_rr(a, 0x89, X86_RSP, X86_RDX);
+    x86_mov_imm(a, X86_RCX, size);
+    x86_call(a, device_read);
+    x86_byte(a, 0x84);                                      /* test al, al */
+    x86_byte(a, 0xc0);
+    uint32_t ok = x86_jcc(a, X86_CC_NE);
+    jit_exit(dev, a, pc, false, RUN_FAULT, n_left);
+    x86_patch(a, ok, a->pos);
+
+    if (op[0])                                              /* eax <- [rsp] */
+    {
+        x86_byte(a, op[0]);
+    }
+    x86_byte(a, op[1]);
+    x86_byte(a, 0x04);
+    x86_byte(a, 0x24);
+
+    x86_patch(a, done[0], a->pos);
+    x86_patch(a, done[1], a->pos);
+    jit_put(a, inst->rd, X86_RAX);
+}
+
+
+static void jit_store(device_t *dev, jit_asm_t *a, const uinst_t *inst,
+                      uint32_t pc, uint32_t n_left)
+{
+    uint32_t size = inst->inst_id == INST_SW ? 4 : inst->inst_id == INST_SH ? 2 : 1;
+    uint32_t done = 0;
+    bool fast = !dev->dcache &&
+                ((dev->watch_origin + dev->watch_size <= dev->ram.origin) ||
+                 (dev->watch_origin >= dev->ram.origin + dev->ram.size));
+
+    jit_get(a, X86_RAX, inst->rs1);
+    x86_alu_imm(a, 0, X86_RAX, inst->imm);                  /* add eax, imm */
+    jit_get(a, X86_RCX, inst->rs2);
+
+    if (fast)
+    {
+        uint32_t miss = jit_mem_fast(dev, a, offsetof(device_t, ram), &dev->ram, size);
+
+        if (size == 2)                                      /* [rsi + rdx] <- ecx */
+        {
+            x86_byte(a, 0x66);
+        }
+        x86_byte(a, size == 1 ? 0x88 : 0x89);
+        x86_byte(a, 0x0c);
+        x86_byte(a, 0x16);
+        done = x86_jmp(a);
+        x86_patch(a, miss, a->pos);
+    }
+
+    /* device_write(dev, addr, rsp, size) */
+    x86_byte(a, 0x89);                                      /* mov [rsp], ecx */
+    x86_byte(a, 0x0c);
+    x86_byte(a, 0x24);
+    x86_byte(a, 0x48);                                      /* mov rdi, rbx */
+    x86_rr(a, 0x89, X86_RBX, X86_RDI);
+    x86_rr(a, 0x89, X86_RAX, X86_RSI);                      /* mov esi, eax */
+    x86_byte(a, 0x48);                                      /* mov rdx, rsp */
+    x86_rr(a, 0x89, X86_RSP, X86_RDX);
+    x86_mov_imm(a, X86_RCX, size);
+    x86_call(a, device_write);
+    x86_byte(a, 0x84);                                      /* test al, al */
+    x86_byte(a, 0xc0);
+    uint32_t ok = x86_jcc(a, X86_CC_NE);
+    jit_exit(dev, a, pc, false, RUN_FAULT, n_left);
+    x86_patch(a, ok, a->pos);
+
+    x86_rbx(a, false, 0x80, 7, offsetof(device_t, watch_written)); /* cmp byte [watch], 0 */
+    x86_byte(a, 0);
+    uint32_t quiet = x86_jcc(a, X86_CC_E);
+    jit_exit(dev, a, pc + 4, false, RUN_MMIO_WRITTEN, n_left - 1);
+    x86_patch(a, quiet, a->pos);
+
+    if (fast)
+    {
+        x86_patch(a, done, a->pos);
+    }
+}
+
+
+static void jit_alu(jit_asm_t *a, const uinst_t *inst)
+{
+    if (inst->rd == 0)
+    {
+        return;
+    }
+
+    jit_get(a, X86_RAX, inst->rs1);
+    jit_get(a, X86_RCX, inst->rs2);
+
+    switch (inst->inst_id)
+    {
+    case INST_ADD: x86_rr(a, 0x01, X86_RCX, X86_RAX); break;
+    case INST_SUB: x86_rr(a, 0x29, X86_RCX, X86_RAX); break;
+    case INST_XOR: x86_rr(a, 0x31, X86_RCX, X86_RAX); break;
+    case INST_OR:  x86_rr(a, 0x09, X86_RCX, X86_RAX); break;
+    case INST_AND: x86_rr(a, 0x21, X86_RCX, X86_RAX); break;
+    case INST_SLL: x86_rr(a, 0xd3, 4, X86_RAX); break;
+    case INST_SRL: x86_rr(a, 0xd3, 5, X86_RAX); break;
+    case INST_SRA: x86_rr(a, 0xd3, 7, X86_RAX); break;
+    case INST_MUL: x86_rr_0f(a, 0xaf, X86_RAX, X86_RCX); break;
+
+    case INST_SLT:
+    case INST_SLTU:
+        x86_rr(a, 0x39, X86_RCX, X86_RAX);                  /* cmp eax, ecx */
+        x86_rr_0f(a, inst->inst_id == INST_SLT ? 0x9c : 0x92, 0, X86_RAX);
+        x86_rr_0f(a, 0xb6, X86_RAX, X86_RAX);               /* movzx eax, al */
+        break;
+
+    case INST_MULH:
+    case INST_MULHSU:
+    case INST_MULHU:
+        if (inst->inst_id != INST_MULHU)
+        {
+            x86_byte(a, 0x48);                              /* movsxd rax, eax */
+            x86_rr(a, 0x63, X86_RAX, X86_RAX);
+        }
+        if (inst->inst_id == INST_MULH)
+        {
+            x86_byte(a, 0x48);                              /* movsxd rcx, ecx */
+            x86_rr(a, 0x63, X86_RCX, X86_RCX);
+        }
+        x86_byte(a, 0x48);                                  /* imul rax, rcx */
+        x86_rr_0f(a, 0xaf, X86_RAX, X86_RCX);
+        x86_byte(a, 0x48);                                  /* shr rax, 32 */
+        x86_rr(a, 0xc1, 5, X86_RAX);
+        x86_byte(a, 32);
+        break;
+
+    case INST_CZERO_EQZ:
+    case INST_CZERO_NEZ:
+        x86_rr(a, 0x31, X86_RDX, X86_RDX);                  /* xor edx, edx */
+        x86_rr(a, 0x85, X86_RCX, X86_RCX);                  /* test ecx, ecx */
+        x86_rr_0f(a, inst->inst_id == INST_CZERO_EQZ ? 0x44 : 0x45,
+                  X86_RAX, X86_RDX);                        /* cmovz/nz eax, edx */
+        break;
+
+    default: /* Division */
+        x86_rr(a, 0x89, X86_RAX, X86_RDI);
+        x86_rr(a, 0x89, X86_RCX, X86_RSI);
+        x86_mov_imm(a, X86_RDX, inst->inst_id);
+        x86_call(a, jit_helper_div);
+        break;
+    }
+
+    jit_put(a, inst->rd, X86_RAX);
+}
+
+
+static void jit_alu_imm(jit_asm_t *a, const uinst_t *inst)
+{
+    if (inst->rd == 0)
+    {
+        return;
+    }
+
+    jit_get(a, X86_RAX, inst->rs1);
+
+    switch (inst->inst_id)
+    {
+    case INST_ADDI: x86_alu_imm(a, 0, X86_RAX, inst->imm); break;
+    case INST_XORI: x86_alu_imm(a, 6, X86_RAX, inst->imm); break;
+    case INST_ORI:  x86_alu_imm(a, 1, X86_RAX, inst->imm); break;
+    case INST_ANDI: x86_alu_imm(a, 4, X86_RAX, inst->imm); break;
+
+    case INST_SLLI:
+    case INST_SRLI:
+    case INST_SRAI:
+        x86_rr(a, 0xc1, inst->inst_id == INST_SLLI ? 4 :
+                        inst->inst_id == INST_SRLI ? 5 : 7, X86_RAX);
+        x86_byte(a, inst->imm & 0b11111);
+        break;
+
+    default: /* slti, sltiu */
+        x86_alu_imm(a, 7, X86_RAX, inst->inst_id == INST_SLTI ?
+                    (uint32_t)inst->imm : ((uint32_t)inst->imm & 0b111111111111));
+        x86_rr_0f(a, inst->inst_id == INST_SLTI ? 0x9c : 0x92, 0, X86_RAX);
+        x86_rr_0f(a, 0xb6, X86_RAX, X86_RAX);
+        break;
+    }
+
+    jit_put(a, inst->rd, X86_RAX);
+}
+
+
+static void jit_flush(device_t *dev)
+{
+    uint32_t num_insts = jit_num_insts(dev);
+
+    dev->jit_code_used = dev->jit_code_start;
+    dev->jit_n_patches = 0;
+    memset(dev->jit_blocks, 0, num_insts * sizeof(void*));
+    memset(dev->jit_patch_heads, 0, num_insts * sizeof(uint32_t));
+}
+
+
+static bool jit_translate(device_t *dev, uint32_t id)
+{
+    const uint32_t num_insts = jit_num_insts(dev);
+    const uint32_t start_pc = dev->rom.origin + id * 4;
+    uint32_t n = 0;
+
+    /* A block ends with a control transfer, before _exit or an invalid or
+       not yet decoded instruction */
+    while (id + n < num_insts && n < JIT_MAX_BLOCK &&
+           start_pc + n * 4 != dev->exit_addr)
+    {
+        uint32_t inst_id = dev->uinsts[id + n].inst_id;
+
+        if (inst_id == INST_INVALID || dev->uhandlers[id + n] == dev->handlers[INST_UNDECODED])
+        {
+            break;
+        }
+
+        n++;
+
+        if ((inst_id >= INST_BEQ && inst_id <= INST_JALR))
+        {
+            break;
+        }
+    }
+
+    if (!n)
+    {
+        return false;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        jit_asm_t a = {dev->jit_code, dev->jit_code_used, dev->jit_code_size};
+        uint32_t sites[2], targets[2], n_sites = 0;
+        uint32_t entry = a.pos;
+        uint32_t i;
+
+        /* Enter only with enough budget for the whole block */
+        x86_rbx(&a, true, 0x81, 7, offsetof(device_t, jit_budget)); /* cmp [budget], n */
+        x86_dword(&a, n);
+        uint32_t enough = x86_jcc(&a, X86_CC_GE);
+        jit_exit(dev, &a, start_pc, false, JIT_CONTINUE, 0);
+        x86_patch(&a, enough, a.pos);
+        x86_rbx(&a, true, 0x81, 5, offsetof(device_t, jit_budget)); /* sub [budget], n */
+        x86_dword(&a, n);
+
+        for (i = 0; i < n; i++)
+        {
+            const uinst_t *inst = &dev->uinsts[id + i];
+            uint32_t pc = start_pc + i * 4;
+
+            switch (inst->inst_id)
+            {
+            case INST_ADD: case INST_SUB: case INST_MUL: case INST_XOR:
+            case INST_DIV: case INST_OR: case INST_REM: case INST_AND:
+            case INST_REMU: case INST_CZERO_NEZ: case INST_SLL: case INST_MULH:
+            case INST_SRL: case INST_SRA: case INST_DIVU: case INST_CZERO_EQZ:
+            case INST_SLT: case INST_MULHSU: case INST_SLTU: case INST_MULHU:
+                jit_alu(&a, inst);
+                break;
+
+            case INST_ADDI: case INST_XORI: case INST_ORI: case INST_ANDI:
+            case INST_SLLI: case INST_SRLI: case INST_SRAI: case INST_SLTI:
+            case INST_SLTIU:
+                jit_alu_imm(&a, inst);
+                break;
+
+            case INST_SB: case INST_SH: case INST_SW:
+                jit_store(dev, &a, inst, pc, n - i);
+                break;
+
+            case INST_LB: case INST_LH: case INST_LW: case INST_LBU: case INST_LHU:
+                jit_load(dev, &a, inst, pc, n - i);
+                break;
+
+            case INST_BEQ: case INST_BNE: case INST_BLT:
+            case INST_BGE: case INST_BLTU: case INST_BGEU:
+            {
+                static const uint8_t CC[] =
+                {
+                    X86_CC_E, X86_CC_NE, X86_CC_L, X86_CC_GE, X86_CC_B, X86_CC_AE
+                };
+
+                jit_get(&a, X86_RAX, inst->rs1);
+                jit_get(&a, X86_RCX, inst->rs2);
+                x86_rr(&a, 0x39, X86_RCX, X86_RAX);         /* cmp eax, ecx */
+                uint32_t taken = x86_jcc(&a, CC[inst->inst_id - INST_BEQ]);
+                jit_chain(dev, &a, pc + 4, sites, targets, &n_sites);
+                x86_patch(&a, taken, a.pos);
+                jit_chain(dev, &a, pc + inst->imm, sites, targets, &n_sites);
+            }
+            break;
+
+            case INST_JAL:
+                x86_mov_imm(&a, X86_RAX, pc + 4);
+                jit_put(&a, inst->rd, X86_RAX);
+                jit_chain(dev, &a, pc + inst->imm, sites, targets, &n_sites);
+                break;
+
+            case INST_JALR:
+            {
+                jit_get(&a, X86_RAX, inst->rs1);
+                x86_alu_imm(&a, 0, X86_RAX, inst->imm);
+                x86_mov_imm(&a, X86_RCX, pc + 4);
+                jit_put(&a, inst->rd, X86_RCX);
+
+                /* Jump straight to the target if it has been translated */
+                x86_byte(&a, 0xa8);                         /* test al, 3 */
+                x86_byte(&a, 0x03);
+                uint32_t miss1 = x86_jcc(&a, X86_CC_NE);
+                x86_rr(&a, 0x89, X86_RAX, X86_RDX);         /* mov edx, eax */
+                x86_alu_imm(&a, 5, X86_RDX, dev->rom.origin);
+                x86_rr(&a, 0xc1, 5, X86_RDX);               /* shr edx, 2 */
+                x86_byte(&a, 2);
+                x86_alu_imm(&a, 7, X86_RDX, num_insts);
+                uint32_t miss2 = x86_jcc(&a, X86_CC_AE);
+                x86_rbx(&a, true, 0x8b, X86_RSI, offsetof(device_t, jit_blocks));
+                x86_byte(&a, 0x48);                         /* mov rsi, [rsi + rdx * 8] */
+                x86_byte(&a, 0x8b);
+                x86_byte(&a, 0x34);
+                x86_byte(&a, 0xd6);
+                x86_byte(&a, 0x48);                         /* test rsi, rsi */
+                x86_rr(&a, 0x85, X86_RSI, X86_RSI);
+                uint32_t miss3 = x86_jcc(&a, X86_CC_E);
+                x86_byte(&a, 0xff);                         /* jmp rsi */
+                x86_byte(&a, 0xe6);
+                x86_patch(&a, miss1, a.pos);
+                x86_patch(&a, miss2, a.pos);
+                x86_patch(&a, miss3, a.pos);
+                jit_exit(dev, &a, 0, true, JIT_CONTINUE, 0);
+            }
+            break;
+
+            case INST_LUI:
+                if (inst->rd)
+                {
+                    x86_mov_imm(&a, X86_RAX, inst->imm << 12);
+                    jit_put(&a, inst->rd, X86_RAX);
+                }
+                break;
+
+            case INST_AUIPC:
+                if (inst->rd)
+                {
+                    x86_mov_imm(&a, X86_RAX, pc + (inst->imm << 12));
+                    jit_put(&a, inst->rd, X86_RAX);
+                }
+                break;
+
+            default: /* nop, ecall, ebreak */
+                break;
+            }
+        }
+
+        if (dev->uinsts[id + n - 1].inst_id < INST_BEQ ||
+            dev->uinsts[id + n - 1].inst_id > INST_JALR)
+        {
+            jit_chain(dev, &a, start_pc + n * 4, sites, targets, &n_sites);
+        }
+
+        if (a.pos > a.size)
+        {
+            /* Out of code space, start over with an empty cache */
+            jit_flush(dev);
+            continue;
+        }
+
+        dev->jit_code_used = a.pos;
+        dev->jit_blocks[id] = dev->jit_code + entry;
+
+        for (i = 0; i < n_sites; i++)
+        {
+            jit_link(dev, sites[i], targets[i]);
+        }
+
+        /* Chain the blocks that were waiting for this one */
+        uint32_t p = dev->jit_patch_heads[id];
+
+        while (p)
+        {
+            x86_patch(&a, dev->jit_patches[p - 1].site, entry);
+            p = dev->jit_patches[p - 1].next;
+        }
+
+        dev->jit_patch_heads[id] = 0;
+
+        return true;
+    }
+
+    return false;
+}
+
+
+static bool jit_init(device_t *dev)
+{
+    uint32_t num_insts = jit_num_insts(dev);
+
+    dev->jit_code_size = JIT_CODE_SIZE;
+    dev->jit_code = mmap(NULL, dev->jit_code_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (dev->jit_code == MAP_FAILED)
+    {
+        dev->jit_code = NULL;
+        return false;
+    }
+
+    dev->jit_blocks = calloc(num_insts, sizeof(void*));
+    dev->jit_counts = calloc(num_insts, sizeof(uint16_t));
+    dev->jit_patch_heads = calloc(num_insts, sizeof(uint32_t));
+
+    if (!dev->jit_blocks || !dev->jit_counts || !dev->jit_patch_heads)
+    {
+        return false;
+    }
+
+    jit_asm_t a = {dev->jit_code, JIT_EXIT_POS, dev->jit_code_size};
+
+    /* Common exit: eax - next pc, ecx - reason to return */
+    x86_rbx(&a, false, 0x89, X86_RAX, offsetof(device_t, pc));
+
+    for (int r = 1; r < 32; r++)
+    {
+        if (JIT_HOST_REG[r] >= 0)
+        {
+            x86_rbx(&a, false, 0x89, JIT_HOST_REG[r], r * 4);
+        }
+    }
+
+    x86_rr(&a, 0x89, X86_RCX, X86_RAX);                     /* mov eax, ecx */
+    x86_byte(&a, 0x48); x86_byte(&a, 0x83);                 /* add rsp, 24 */
+    x86_byte(&a, 0xc4); x86_byte(&a, 24);
+    x86_byte(&a, 0x41); x86_byte(&a, 0x5f);                 /* pop r15 */
+    x86_byte(&a, 0x41); x86_byte(&a, 0x5e);                 /* pop r14 */
+    x86_byte(&a, 0x41); x86_byte(&a, 0x5d);                 /* pop r13 */
+    x86_byte(&a, 0x41); x86_byte(&a, 0x5c);                 /* pop r12 */
+    x86_byte(&a, 0x5d);                                     /* pop rbp */
+    x86_byte(&a, 0x5b);                                     /* pop rbx */
+    x86_byte(&a, 0xc3);                                     /* ret */
+
+    while (a.pos < JIT_ENTRY_POS)
+    {
+        x86_byte(&a, 0xcc);                                 /* int3 */
+    }
+
+    /* int entry(device_t *dev, void *block) */
+    x86_byte(&a, 0x53);                                     /* push rbx */
+    x86_byte(&a, 0x55);                                     /* push rbp */
+    x86_byte(&a, 0x41); x86_byte(&a, 0x54);                 /* push r12 */
+    x86_byte(&a, 0x41); x86_byte(&a, 0x55);                 /* push r13 */
+    x86_byte(&a, 0x41); x86_byte(&a, 0x56);                 /* push r14 */
+    x86_byte(&a, 0x41); x86_byte(&a, 0x57);                 /* push r15 */
+    x86_byte(&a, 0x48); x86_byte(&a, 0x83);                 /* sub rsp, 24 */
+    x86_byte(&a, 0xec); x86_byte(&a, 24);
+    x86_byte(&a, 0x48);                                     /* mov rbx, rdi */
+    x86_rr(&a, 0x89, X86_RDI, X86_RBX);
+
+    for (int r = 1; r < 32; r++)
+    {
+        if (JIT_HOST_REG[r] >= 0)
+        {
+            x86_rbx(&a, false, 0x8b, JIT_HOST_REG[r], r * 4);
+        }
+    }
+
+    x86_byte(&a, 0xff);                                     /* jmp rsi */
+    x86_byte(&a, 0xe6);
+
+    dev->jit_code_start = a.pos;
+    dev->jit_code_used = a.pos;
+
+    return true;
+}
+
+#endif
+
+
+/*
+ * Threaded interpreter over the pre-unpacked instructions. Every handler
+ * ends with its own copy of the dispatch sequence and jumps straight to the
+ * handler of the next instruction (resolved in device_pre_unpack_instructions),
+ * so there is no central switch for the branch predictor to stumble on.
+ * Runs until the budget is exhausted or an event the host has to handle.
+ * Called with dev == NULL it only publishes its handler table.
+ */
+static run_reason_t device_run_threaded(device_t *dev, uint64_t budget, uint64_t *n_done)
+{
+    static const void *const HANDLERS[NUM_INSTS + 1] =
+    {
+        [INST_NOP]       = &&op_nop,
+        [INST_ADD]       = &&op_add,
+        [INST_SUB]       = &&op_sub,
+        [INST_MUL]       = &&op_mul,
+        [INST_XOR]       = &&op_xor,
+        [INST_DIV]       = &&op_div,
+        [INST_OR]        = &&op_or,
+        [INST_REM]       = &&op_rem,
+        [INST_AND]       = &&op_and,
+        [INST_REMU]      = &&op_remu,
+        [INST_CZERO_NEZ] = &&op_czero_nez,
+        [INST_SLL]       = &&op_sll,
+        [INST_MULH]      = &&op_mulh,
+        [INST_SRL]       = &&op_srl,
+        [INST_SRA]       = &&op_sra,
+        [INST_DIVU]      = &&op_divu,
+        [INST_CZERO_EQZ] = &&op_czero_eqz,
+        [INST_SLT]       = &&op_slt,
+        [INST_MULHSU]    = &&op_mulhsu,
+        [INST_SLTU]      = &&op_sltu,
+        [INST_MULHU]     = &&op_mulhu,
+        [INST_ADDI]      = &&op_addi,
+        [INST_XORI]      = &&op_xori,
+        [INST_ORI]       = &&op_ori,
+        [INST_ANDI]      = &&op_andi,
+        [INST_SLLI]      = &&op_slli,
+        [INST_SRLI]      = &&op_srli,
+        [INST_SRAI]      = &&op_srai,
+        [INST_SLTI]      = &&op_slti,
+        [INST_SLTIU]     = &&op_sltiu,
+        [INST_SB]        = &&op_sb,
+        [INST_SH]        = &&op_sh,
+        [INST_SW]        = &&op_sw,
+        [INST_LB]        = &&op_lb,
+        [INST_LH]        = &&op_lh,
+        [INST_LW]        = &&op_lw,
+        [INST_LBU]       = &&op_lbu,
+        [INST_LHU]       = &&op_lhu,
+        [INST_BEQ]       = &&op_beq,
+        [INST_BNE]       = &&op_bne,
+        [INST_BLT]       = &&op_blt,
+        [INST_BGE]       = &&op_bge,
+        [INST_BLTU]      = &&op_bltu,
+        [INST_BGEU]      = &&op_bgeu,
+        [INST_JAL]       = &&op_jal,
+        [INST_JALR]      = &&op_jalr,
+        [INST_LUI]       = &&op_lui,
+        [INST_AUIPC]     = &&op_auipc,
+        [INST_ECALL]     = &&op_ecall,
+        [INST_BREAK]     = &&op_break,
+        [INST_INVALID]   = &&op_invalid,
+
+        [INST_LUI_ADDI]   = &&op_lui_addi,
+        [INST_AUIPC_JALR] = &&op_auipc_jalr,
+        [INST_SLLI_ADD]   = &&op_slli_add,
+        [INST_ADDI_BNEZ]  = &&op_addi_bnez,
+        [INST_LW_ADDI]    = &&op_lw_addi,
+        [INST_SW_ADDI]    = &&op_sw_addi,
+        [INST_UNDECODED]  = &&op_decode,
+
+        [EXIT_HANDLER_ID] = &&op_exit,
+    };
+
+    /* Selected by device_track_calls() */
+    static const void *const CALL_HANDLERS[NUM_INSTS + 1] =
+    {
+        [INST_JAL]  = &&op_jal_call,
+        [INST_JALR] = &&op_jalr_call,
+    };
+
+#ifndef RV_NO_INST_STATS
+    /* Selected by device_set_inst_stats(), fused pairs are not used */
+    static const void *STATS_HANDLERS[NUM_INSTS + 1];
+#endif
+
+    if (!dev)
+    {
+        inst_handlers = HANDLERS;
+        call_handlers = CALL_HANDLERS;
+#ifndef RV_NO_INST_STATS
+        memcpy(STATS_HANDLERS, HANDLERS, sizeof(HANDLERS));
+        STATS_HANDLERS[INST_BEQ]  = &&op_beq_counted;
+        STATS_HANDLERS[INST_BNE]  = &&op_bne_counted;
+        STATS_HANDLERS[INST_BLT]  = &&op_blt_counted;
+        STATS_HANDLERS[INST_BGE]  = &&op_bge_counted;
+        STATS_HANDLERS[INST_BLTU] = &&op_bltu_counted;
+        STATS_HANDLERS[INST_BGEU] = &&op_bgeu_counted;
+        STATS_HANDLERS[INST_JAL]  = &&op_jal_counted;
+        STATS_HANDLERS[INST_JALR] = &&op_jalr_counted;
+        stats_handlers = STATS_HANDLERS;
+#endif
+        return RUN_BUDGET_EXHAUSTED;
+    }
+
+    uint32_t *regs = dev->regs;
+#ifdef RV_WIDE_UINSTS
+    const tinst_t *tinsts = dev->uinsts;
+#else
+    const tinst_t *tinsts = dev->cinsts;
+#endif
+    const void **uhandlers = dev->uhandlers;
+    const uint32_t origin = dev->rom.origin;
+    const bool flat = dev->flat != NULL;
+    const uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+#if defined(__x86_64__)
+    if (dev->jit && !dev->jit_code && !jit_init(dev))
+    {
+        dev->jit = false;
+    }
+
+    /* Calls made by translated code would be missed */
+    void **jit_blocks = dev->jit && !dev->track_calls ? dev->jit_blocks : NULL;
+#else
+    void **jit_blocks = NULL;
+#endif
+
+    const tinst_t *inst;
+    tinst_t slow_inst;
+    uint32_t pc = dev->pc;
+    uint32_t idx;
+    uint64_t count = 0;
+    run_reason_t reason = RUN_BUDGET_EXHAUSTED;
+#ifndef RV_NO_INST_STATS
+    uint64_t *block_counts = dev->stats ? dev->block_counts : NULL;
+#endif
+
+    dev->watch_written = false;
+
+/* Fetch the next instruction and jump to its handler */
+#define DISPATCH()                                                  \
+    do                                                              \
+    {                                                               \
+        if (count == budget)                                        \
+        {                                                           \
+            goto done;                                              \
+        }                                                           \
+        count++;                                                    \
+        idx = (pc - origin) >> 2;                                   \
+        if (idx >= num_insts)                                       \
+        {                                                           \
+            goto not_unpacked;                                      \
+        }                                                           \
+        inst = &tinsts[idx];                                        \
+        goto *uhandlers[idx];                                       \
+    }                                                               \
+    while (0)
+
+#define SET_RD(val)                                                 \
+    do                                                              \
+    {                                                               \
+        regs[I_RD] = (val);                                         \
+        regs[0] = 0;                                                \
+    }                                                               \
+    while (0)
+
+#define NEXT()                                                      \
+    do                                                              \
+    {                                                               \
+        pc += 4;                                                    \
+        DISPATCH();                                                 \
+    }                                                               \
+    while (0)
+
+#define JUMP(target)                                                \
+    do                                                              \
+    {                                                               \
+        pc = (target);                                              \
+        if (jit_blocks)                                             \
+        {                                                           \
+            goto jit_enter;                                         \
+        }                                                           \
+        DISPATCH();                                                 \
+    }                                                               \
+    while (0)
+
+/* Look at the events right after a store that raised them */
+#define NEXT_STORE()                                                \
+    do                                                              \
+    {                                                               \
+        if (dev->watch_written)                                     \
+        {                                                           \
+            pc += 4;                                                \
+            goto store_check;                                       \
+        }                                                           \
+        NEXT();                                                     \
+    }                                                               \
+    while (0)
+
+#define BRANCH(cond)                                                \
+    do                                                              \
+    {                                                               \
+        if (cond)                                                   \
+        {                                                           \
+            JUMP(pc + inst->imm);                                   \
+        }                                                           \
+        NEXT();                                                     \
+    }                                                               \
+    while (0)
+
+/* A fused pair runs as its two original instructions back to back. With
+   only one instruction left in the budget just the first one is executed */
+#define FUSED()                                                     \
+    do                                                              \
+    {                                                               \
+        if (count == budget)                                        \
+        {                                                           \
+            goto *HANDLERS[I_ID];                                   \
+        }                                                           \
+    }                                                               \
+    while (0)
+
+#define FUSED_SECOND()                                              \
+    do                                                              \
+    {                                                               \
+        count++;                                                    \
+        inst++;                                                     \
+        pc += 4;                                                    \
+    }                                                               \
+    while (0)
+
+#ifdef RV_WIDE_UINSTS
+#define I_ID  (inst->inst_id)
+#define I_RD  (inst->rd)
+#define I_RS1 (inst->rs1)
+#define I_RS2 (inst->rs2)
+#else
+#define I_ID  CINST_ID(inst)
+#define I_RD  CINST_RD(inst)
+#define I_RS1 CINST_RS1(inst)
+#define I_RS2 CINST_RS2(inst)
+#endif
+
+#define RS1  (regs[I_RS1])
+#define RS2  (regs[I_RS2])
+#define ADDR (regs[I_RS1] + inst->imm)
+
+#define LOAD(data, size)                                            \
+    (flat ? flat_read(dev, ADDR, (data), (size)) :                  \
+            device_read(dev, ADDR, (uint8_t*)(data), (size)))
+
+#define STORE(data, size)                                           \
+    (flat ? flat_write(dev, ADDR, (data), (size)) :                 \
+            device_write(dev, ADDR, (const uint8_t*)(data), (size)))
+
+#ifndef RV_NO_INST_STATS
+/* One more execution of the block starting at pc */
+#define COUNT_BLOCK()                                               \
+    do                                                              \
+    {                                                               \
+        idx = (pc - origin) >> 2;                                   \
+        if (idx < num_insts)                                        \
+        {                                                           \
+            block_counts[idx]++;                                    \
+        }                                                           \
+    }                                                               \
+    while (0)
+
+#define BRANCH_COUNTED(cond)                                        \
+    do                                                              \
+    {                                                               \
+        pc = (cond) ? pc + inst->imm : pc + 4;                      \
+        COUNT_BLOCK();                                              \
+        DISPATCH();                                                 \
+    }                                                               \
+    while (0)
+
+/* Code outside of the pre-unpacked range is counted per instruction */
+#define RAM_HANDLER(id) (block_counts ? &&op_count : dev->handlers[id])
+
+/* Regular handler of a call tracking one */
+#define CALL_NEXT(id) (block_counts ? STATS_HANDLERS[id] : HANDLERS[id])
+
+    /* The run enters a block at pc. Stopping in the middle of a block
+       uncounts its remaining part starting at the stop pc, so only the
+       executed instructions add up in stats_fold() */
+    if (block_counts)
+    {
+        COUNT_BLOCK();
+    }
+#else
+#define RAM_HANDLER(id) (dev->handlers[id])
+#define CALL_NEXT(id)   (HANDLERS[id])
+#endif
+
+    DISPATCH();
+
+op_nop:
+    NEXT();
+
+op_add:
+    SET_RD(RS1 + RS2);
+    NEXT();
+
+op_sub:
+    SET_RD(RS1 - RS2);
+    NEXT();
+
+op_mul:
+    SET_RD((uint32_t)((int32_t)RS1 * (int32_t)RS2));
+    NEXT();
+
+op_xor:
+    SET_RD(RS1 ^ RS2);
+    NEXT();
+
+op_div:
+    SET_RD((uint32_t)((int32_t)RS1 / (int32_t)RS2));
+    NEXT();
+
+op_or:
+    SET_RD(RS1 | RS2);
+    NEXT();
+
+op_rem:
+    SET_RD((uint32_t)((int32_t)RS1 % (int32_t)RS2));
+    NEXT();
+
+op_and:
+    SET_RD(RS1 & RS2);
+    NEXT();
+
+op_remu:
+    SET_RD(RS1 % RS2);
+    NEXT();
+
+op_czero_nez:
+    SET_RD(RS2 ? 0 : RS1);
+    NEXT();
+
+op_sll:
+    SET_RD(RS1 << RS2);
+    NEXT();
+
+op_mulh:
+    SET_RD((uint32_t)(((int64_t)(int32_t)RS1 * (int64_t)(int32_t)RS2) >> 32));
+    NEXT();
+
+op_srl:
+    SET_RD(RS1 >> RS2);
+    NEXT();
+
+op_sra:
+    SET_RD((int32_t)RS1 >> RS2);
+    NEXT();
+
+op_divu:
+    SET_RD(RS1 / RS2);
+    NEXT();
+
+op_czero_eqz:
+    SET_RD(RS2 ? RS1 : 0);
+    NEXT();
+
+op_slt:
+    SET_RD((int32_t)RS1 < (int32_t)RS2 ? 1 : 0);
+    NEXT();
+
+op_mulhsu:
+    SET_RD((uint32_t)(((int64_t)(int32_t)RS1 * (uint64_t)RS2) >> 32));
+    NEXT();
+
+op_sltu:
+    SET_RD(RS1 < RS2 ? 1 : 0);
+    NEXT();
+
+op_mulhu:
+    SET_RD((uint32_t)(((uint64_t)RS1 * (uint64_t)RS2) >> 32));
+    NEXT();
+
+op_addi:
+    SET_RD((int32_t)RS1 + inst->imm);
+    NEXT();
+
+op_xori:
+    SET_RD((int32_t)RS1 ^ inst->imm);
+    NEXT();
+
+op_ori:
+    SET_RD((int32_t)RS1 | inst->imm);
+    NEXT();
+
+op_andi:
+    SET_RD((int32_t)RS1 & inst->imm);
+    NEXT();
+
+op_slli:
+    SET_RD(RS1 << (inst->imm & 0b11111));
+    NEXT();
+
+op_srli:
+    SET_RD(RS1 >> (inst->imm & 0b11111));
+    NEXT();
+
+op_srai:
+    SET_RD((int32_t)RS1 >> (inst->imm & 0b11111));
+    NEXT();
+
+op_slti:
+    SET_RD((int32_t)RS1 < inst->imm ? 1 : 0);
+    NEXT();
+
+op_sltiu:
+    SET_RD(RS1 < ((uint32_t)inst->imm & 0b111111111111) ? 1 : 0);
+    NEXT();
+
+op_sb:
+    {
+        uint8_t bt = RS2 & 0xff;
+
+        if (!STORE(&bt, 1))
+        {
+            goto fault;
+        }
+    }
+    NEXT_STORE();
+
+op_sh:
+    {
+        uint16_t hw = RS2 & 0xffff;
+
+        if (!STORE(&hw, 2))
+        {
+            goto fault;
+        }
+    }
+    NEXT_STORE();
+
+op_sw:
+    if (!STORE(&RS2, 4))
+    {
+        goto fault;
+    }
+    NEXT_STORE();
+
+op_lb:
+    {
+        int8_t sb;
+
+        if (!LOAD(&sb, 1))
+        {
+            goto fault;
+        }
+        SET_RD((int32_t)sb);
+    }
+    NEXT();
+
+op_lh:
+    {
+        int16_t shw;
+
+        if (!LOAD(&shw, 2))
+        {
+            goto fault;
+        }
+        SET_RD((int32_t)shw);
+    }
+    NEXT();
+
+op_lw:
+    {
+        uint32_t w;
+
+        if (!LOAD(&w, 4))
+        {
+            goto fault;
+        }
+        SET_RD(w);
+    }
+    NEXT();
+
+op_lbu:
+    {
+        uint8_t ub;
+
+        if (!LOAD(&ub, 1))
+        {
+            goto fault;
+        }
+        SET_RD(ub);
+    }
+    NEXT();
+
+op_lhu:
+    {
+        uint16_t hw;
+
+        if (!LOAD(&hw, 2))
+        {
+            goto fault;
+        }
+        SET_RD(hw);
+    }
+    NEXT();
+
+op_beq:
+    BRANCH(RS1 == RS2);
+
+op_bne:
+    BRANCH(RS1 != RS2);
+
+op_blt:
+    BRANCH((int32_t)RS1 < (int32_t)RS2);
+
+op_bge:
+    BRANCH((int32_t)RS1 >= (int32_t)RS2);
+
+op_bltu:
+    BRANCH(RS1 < RS2);
+
+op_bgeu:
+    BRANCH(RS1 >= RS2);
+
+op_jal:
+    SET_RD(pc + 4);
+    JUMP(pc + inst->imm);
+
+op_jalr:
+    {
+        uint32_t target = ADDR;
+        SET_RD(pc + 4);
+        JUMP(target);
+    }
+
+op_lui:
+    SET_RD(inst->imm << 12);
+    NEXT();
+
+op_auipc:
+    SET_RD(pc + (inst->imm << 12));
+    NEXT();
+
+op_ecall:
+    NEXT();
+
+op_break:
+    NEXT();
+
+op_invalid:
+    /* Data words are only reported once something tries to execute them */
+    {
+        uint32_t raw = 0;
+
+        device_read(dev, pc, (uint8_t*)&raw, sizeof(raw));
+        printf("Error: failed executing instruction: "
+               "0x%08X at address 0x%08X\n", raw, pc);
+    }
+    goto fault;
+
+op_lui_addi:
+    FUSED();
+    SET_RD(inst->imm << 12);
+    FUSED_SECOND();
+    SET_RD((int32_t)RS1 + inst->imm);
+    NEXT();
+
+op_auipc_jalr:
+    FUSED();
+    SET_RD(pc + (inst->imm << 12));
+    FUSED_SECOND();
+    {
+        uint32_t target = ADDR;
+        SET_RD(pc + 4);
+        JUMP(target);
+    }
+
+op_slli_add:
+    FUSED();
+    SET_RD(RS1 << (inst->imm & 0b11111));
+    FUSED_SECOND();
+    SET_RD(RS1 + RS2);
+    NEXT();
+
+op_addi_bnez:
+    FUSED();
+    SET_RD((int32_t)RS1 + inst->imm);
+    FUSED_SECOND();
+    BRANCH(RS1 != RS2);
+
+op_lw_addi:
+    FUSED();
+    {
+        uint32_t w;
+
+        if (!LOAD(&w, 4))
+        {
+            goto fault;
+        }
+        SET_RD(w);
+    }
+    FUSED_SECOND();
+    SET_RD((int32_t)RS1 + inst->imm);
+    NEXT();
+
+op_sw_addi:
+    FUSED();
+    if (!STORE(&RS2, 4))
+    {
+        goto fault;
+    }
+    FUSED_SECOND();
+    SET_RD((int32_t)RS1 + inst->imm);
+    NEXT_STORE();
+
+op_exit:
+    count--;
+    reason = RUN_EXIT_REACHED;
+    goto done;
+
+op_jal_call:
+    if (I_RD == 1)
+    {
+        call_push(dev, pc + inst->imm);
+    }
+    goto *CALL_NEXT(INST_JAL);
+
+op_jalr_call:
+    if (I_RD == 1)
+    {
+        call_push(dev, ADDR);
+    }
+    else if (!I_RD && I_RS1 == 1 && !inst->imm)
+    {
+        call_pop(dev);
+    }
+    goto *CALL_NEXT(INST_JALR);
+
+#ifndef RV_NO_INST_STATS
+op_count:
+    /* Code outside of the pre-unpacked range is counted per instruction */
+    dev->inst_stats[I_ID]++;
+    goto *dev->handlers[I_ID];
+
+/* Control transfers of the stats table count the block they lead to */
+op_beq_counted:
+    BRANCH_COUNTED(RS1 == RS2);
+
+op_bne_counted:
+    BRANCH_COUNTED(RS1 != RS2);
+
+op_blt_counted:
+    BRANCH_COUNTED((int32_t)RS1 < (int32_t)RS2);
+
+op_bge_counted:
+    BRANCH_COUNTED((int32_t)RS1 >= (int32_t)RS2);
+
+op_bltu_counted:
+    BRANCH_COUNTED(RS1 < RS2);
+
+op_bgeu_counted:
+    BRANCH_COUNTED(RS1 >= RS2);
+
+op_jal_counted:
+    SET_RD(pc + 4);
+    pc += inst->imm;
+    COUNT_BLOCK();
+    DISPATCH();
+
+op_jalr_counted:
+    {
+        uint32_t target = ADDR;
+        SET_RD(pc + 4);
+        pc = target;
+    }
+    COUNT_BLOCK();
+    DISPATCH();
+#endif
+
+not_unpacked:
+    /* Code outside of the pre-unpacked range, e.g. running from RAM */
+    {
+        uint32_t raw;
+        dpage_t *dpage;
+
+        if (pc == dev->exit_addr)
+        {
+            goto op_exit;
+        }
+
+        if (!device_read(dev, pc, (uint8_t*)&raw, sizeof(raw)))
+        {
+            goto fault;
+        }
+
+        if (!(pc & 3) && (dpage = dcache_page(dev, pc)))
+        {
+            idx = (pc & (DEV_PAGE_SIZE - 1)) >> 2;
+            inst = &dpage->insts[idx];
+            goto *dpage->handlers[idx];
+        }
+
+        uinst_t uinst;
+
+        if (!unpack_instruction(raw, &uinst))
+        {
+            printf("Error: failed executing instruction: "
+                   "0x%08X at address 0x%08X\n", raw, pc);
+            goto fault;
+        }
+
+#ifdef RV_WIDE_UINSTS
+        slow_inst = uinst;
+#else
+        pack_instruction(&uinst, &slow_inst);
+#endif
+        inst = &slow_inst;
+        goto *RAM_HANDLER(uinst.inst_id);
+    }
+
+op_decode:
+    /* First execution of a slot, or its instruction has been overwritten */
+    {
+        uint32_t raw;
+        uinst_t uinst;
+        dpage_t *dpage;
+
+        idx = (pc - origin) >> 2;
+
+        if (idx < num_insts)
+        {
+            decode_slot(dev, idx);
+            goto *uhandlers[idx];
+        }
+
+        if (!device_read(dev, pc, (uint8_t*)&raw, sizeof(raw)))
+        {
+            goto fault;
+        }
+
+        unpack_instruction(raw, &uinst);
+        dpage = dev->dcache[pc >> DEV_PAGE_SHIFT];
+        idx = (pc & (DEV_PAGE_SIZE - 1)) >> 2;
+
+#ifdef RV_WIDE_UINSTS
+        dpage->insts[idx] = uinst;
+#else
+        pack_instruction(&uinst, &dpage->insts[idx]);
+#endif
+        dpage->handlers[idx] = RAM_HANDLER(uinst.inst_id);
+        goto *dpage->handlers[idx];
+    }
+
+store_check:
+    /* A store raised events or overwrote decoded code */
+    dev->watch_written = false;
+
+    if (dev->events)
+    {
+        reason = RUN_MMIO_WRITTEN;
+        goto done;
+    }
+    DISPATCH();
+
+jit_enter:
+    /* Count the jump targets, run them natively once they are hot */
+#if defined(__x86_64__)
+    idx = (pc - origin) >> 2;
+
+    if (!(pc & 3) && idx < num_insts)
+    {
+        if (!jit_blocks[idx] && ++dev->jit_counts[idx] == JIT_THRESHOLD)
+        {
+            jit_translate(dev, idx);
+        }
+
+        if (jit_blocks[idx])
+        {
+            uint32_t entry_pc = pc;
+            int jit_res;
+
+            dev->jit_budget = budget - count;
+            jit_res = ((jit_entry_t)(dev->jit_code + JIT_ENTRY_POS))(dev, jit_blocks[idx]);
+            count = budget - dev->jit_budget;
+            pc = dev->pc;
+
+            if (jit_res == RUN_MMIO_WRITTEN)
+            {
+                goto store_check;
+            }
+
+            if (jit_res != JIT_CONTINUE)
+            {
+                reason = (run_reason_t)jit_res;
+                goto done;
+            }
+
+            if (pc != entry_pc)
+            {
+                goto jit_enter;
+            }
+        }
+    }
+#endif
+    DISPATCH();
+
+fault:
+    count--;
+    reason = RUN_FAULT;
+
+done:
+    dev->pc = pc;
+
+#ifndef RV_NO_INST_STATS
+    if (block_counts)
+    {
+        idx = (pc - origin) >> 2;
+
+        if (idx < num_insts)
+        {
+            block_counts[idx]--;
+        }
+    }
+#endif
+
+    if (n_done)
+    {
+        *n_done = count;
+    }
+
+    return reason;
+
+#undef DISPATCH
+#undef SET_RD
+#undef NEXT
+#undef JUMP
+#undef NEXT_STORE
+#undef BRANCH
+#undef FUSED
+#undef FUSED_SECOND
+#undef COUNT_BLOCK
+#undef BRANCH_COUNTED
+#undef RAM_HANDLER
+#undef CALL_NEXT
+#undef I_ID
+#undef I_RD
+#undef I_RS1
+#undef I_RS2
+#undef RS1
+#undef RS2
+#undef ADDR
+#undef LOAD
+#undef STORE
+}
+
+
+const symbol_t *device_find_symbol_by_name(device_t *dev, const char *name)
+{
+    uint32_t lo = 0;
+    uint32_t hi = dev->n_symbols;
+
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        int cmp = strcmp(dev->sym_by_name[mid].name, name);
+
+        if (!cmp)
+        {
+            return &dev->sym_by_name[mid];
+        }
+
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+
+const symbol_t *device_find_symbol(device_t *dev, uint32_t addr)
+{
+    uint32_t lo = 0;
+    uint32_t hi = dev->n_symbols;
+
+    /* Last symbol starting at or before addr */
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (dev->symbols[mid].addr <= addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    if (!lo)
+    {
+        return NULL;
+    }
+
+    const symbol_t *sym = &dev->symbols[lo - 1];
+
+    if (sym->size && addr - sym->addr >= sym->size)
+    {
+        return NULL;
+    }
+
+    return sym;
+}
+
+
+/* Start sampling the guest pc every 'interval' instructions on average,
+   or stop with an interval of 0. Previous samples are dropped */
+bool device_start_profiler(device_t *dev, uint32_t interval)
+{
+    dev->prof_interval = 0;
+
+    if (!interval)
+    {
+        return true;
+    }
+
+    if (dev->prog_end <= dev->rom.origin)
+    {
+        printf("Error: no program to profile\n");
+        return false;
+    }
+
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+    free(dev->prof_samples);
+    dev->prof_samples = calloc(num_insts, sizeof(uint64_t));
+
+    if (!dev->prof_samples)
+    {
+        return false;
+    }
+
+    dev->prof_other = 0;
+    dev->n_stack_samples = 0;
+    dev->n_stack_frames = 0;
+
+    if (dev->stack_samples)
+    {
+        memset(dev->stack_samples, 0, dev->stack_samples_size * sizeof(stack_sample_t));
+    }
+
+    dev->prof_seed = 0x9e3779b9;
+    dev->prof_interval = interval;
+    dev->prof_countdown = interval;
+
+    return true;
+}
+
+
+/* Entry of the function containing addr, or addr if there is no symbol */
+static uint32_t func_addr(device_t *dev, uint32_t addr)
+{
+    const symbol_t *sym = device_find_symbol(dev, addr);
+
+    return sym ? sym->addr : addr;
+}
+
+
+static bool stack_samples_grow(device_t *dev)
+{
+    uint32_t size = dev->stack_samples_size ? dev->stack_samples_size * 2 : 1024;
+    stack_sample_t *samples = calloc(size, sizeof(stack_sample_t));
+
+    if (!samples)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < dev->stack_samples_size; i++)
+    {
+        stack_sample_t *sample = &dev->stack_samples[i];
+
+        if (sample->count)
+        {
+            uint32_t j = sample->hash & (size - 1);
+
+            while (samples[j].count)
+            {
+                j = (j + 1) & (size - 1);
+            }
+
+            samples[j] = *sample;
+        }
+    }
+
+    free(dev->stack_samples);
+    dev->stack_samples = samples;
+    dev->stack_samples_size = size;
+
+    return true;
+}
+
+
+/* Count one sample of the current call chain, from the root function to the
+   one containing pc */
+static void prof_sample_stack(device_t *dev)
+{
+    uint32_t frames[CALL_STACK_SIZE + 2];
+    uint32_t depth = 0;
+    uint32_t hash = 2166136261u;
+
+    frames[depth++] = func_addr(dev, dev->call_root);
+
+    for (uint32_t i = 0; i < dev->call_depth && i < CALL_STACK_SIZE; i++)
+    {
+        frames[depth++] = func_addr(dev, dev->call_stack[i]);
+    }
+
+    /* Differs from the last callee after a tail call */
+    uint32_t leaf = func_addr(dev, dev->pc);
+
+    if (leaf != frames[depth - 1])
+    {
+        frames[depth++] = leaf;
+    }
+
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        hash = (hash ^ frames[i]) * 16777619u;
+    }
+
+    if (dev->n_stack_samples * 2 >= dev->stack_samples_size &&
+        !stack_samples_grow(dev))
+    {
+        return;
+    }
+
+    uint32_t mask = dev->stack_samples_size - 1;
+    uint32_t i = hash & mask;
+
+    for (; dev->stack_samples[i].count; i = (i + 1) & mask)
+    {
+        stack_sample_t *sample = &dev->stack_samples[i];
+
+        if (sample->hash == hash && sample->depth == depth &&
+            !memcmp(&dev->stack_frames[sample->frames], frames, depth * sizeof(uint32_t)))
+        {
+            sample->count++;
+            return;
+        }
+    }
+
+    /* A new call chain */
+    if (dev->n_stack_frames + depth > dev->stack_frames_size)
+    {
+        uint32_t size = (dev->stack_frames_size + depth) * 2;
+        uint32_t *stack_frames = realloc(dev->stack_frames, size * sizeof(uint32_t));
+
+        if (!stack_frames)
+        {
+            return;
+        }
+
+        dev->stack_frames = stack_frames;
+        dev->stack_frames_size = size;
+    }
+
+    memcpy(&dev->stack_frames[dev->n_stack_frames], frames, depth * sizeof(uint32_t));
+
+    dev->stack_samples[i].hash = hash;
+    dev->stack_samples[i].depth = depth;
+    dev->stack_samples[i].frames = dev->n_stack_frames;
+    dev->stack_samples[i].count = 1;
+    dev->n_stack_frames += depth;
+    dev->n_stack_samples++;
+}
+
+
+/* Write the call chains of the profiler samples in the folded stacks format
+   that flamegraph tools take, one "func;func;func count" line per chain */
+bool device_save_folded_stacks(device_t *dev, const char *file_name)
+{
+    FILE *out = fopen(file_name, "w");
+
+    if (!out)
+    {
+        printf("Error: unable to open '%s'\n", file_name);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < dev->stack_samples_size; i++)
+    {
+        const stack_sample_t *sample = &dev->stack_samples[i];
+
+        if (!sample->count)
+        {
+            continue;
+        }
+
+        for (uint32_t j = 0; j < sample->depth; j++)
+        {
+            uint32_t addr = dev->stack_frames[sample->frames + j];
+            const symbol_t *sym = device_find_symbol(dev, addr);
+
+            if (sym)
+            {
+                fprintf(out, "%s%s", j ? ";" : "", sym->name);
+            }
+            else
+            {
+                fprintf(out, "%s0x%08X", j ? ";" : "", addr);
+            }
+        }
+
+        fprintf(out, " %lu\n", sample->count);
+    }
+
+    fclose(out);
+    return true;
+}
+
+
+static void prof_sample(device_t *dev)
+{
+    uint32_t idx = (dev->pc - dev->rom.origin) >> 2;
+
+    if (idx < (dev->prog_end - dev->rom.origin) / 4)
+    {
+        dev->prof_samples[idx]++;
+    }
+    else
+    {
+        dev->prof_other++;
+    }
+
+    if (dev->track_calls)
+    {
+        prof_sample_stack(dev);
+    }
+
+    /* Jitter the interval so that loops don't alias with it */
+    dev->prof_seed ^= dev->prof_seed << 13;
+    dev->prof_seed ^= dev->prof_seed >> 17;
+    dev->prof_seed ^= dev->prof_seed << 5;
+    dev->prof_countdown = dev->prof_interval / 2 + 1 + dev->prof_seed % dev->prof_interval;
+}
+
+
+/* Flat profile of the samples by function */
+void device_printout_profile(device_t *dev)
+{
+    if (!dev->prof_samples)
+    {
+        return;
+    }
+
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+    uint32_t n_entries = dev->n_symbols + 2;
+    uint64_t *counts = calloc(n_entries, sizeof(uint64_t));
+    uint32_t *order = malloc(n_entries * sizeof(uint32_t));
+    uint64_t total = dev->prof_other;
+
+    if (!counts || !order)
+    {
+        free(counts);
+        free(order);
+        return;
+    }
+
+    /* The last two entries are unknown code and code outside of the program */
+    for (uint32_t i = 0; i < num_insts; i++)
+    {
+        if (dev->prof_samples[i])
+        {
+            const symbol_t *sym = device_find_symbol(dev, dev->rom.origin + i * 4);
+
+            counts[sym ? sym - dev->symbols : dev->n_symbols] += dev->prof_samples[i];
+            total += dev->prof_samples[i];
+        }
+    }
+
+    counts[dev->n_symbols + 1] = dev->prof_other;
+
+    uint32_t n_order = 0;
+
+    for (uint32_t i = 0; i < n_entries; i++)
+    {
+        if (counts[i])
+        {
+            uint32_t j = n_order++;
+
+            for (; j > 0 && counts[order[j - 1]] < counts[i]; j--)
+            {
+                order[j] = order[j - 1];
+            }
+
+            order[j] = i;
+        }
+    }
+
+    printf("Profile: %lu samples\n", total);
+    printf("%8s %10s  %s\n", "%", "samples", "function");
+
+    for (uint32_t i = 0; i < n_order && i < PROF_MAX_LINES; i++)
+    {
+        uint32_t id = order[i];
+        const char *name = id < dev->n_symbols ? dev->symbols[id].name :
+                           id == dev->n_symbols ? "[unknown]" : "[outside of the program]";
+
+        printf("%7.2f%% %10lu  %s\n", 100.0 * counts[id] / total, counts[id], name);
+    }
+
+    free(counts);
+    free(order);
+}
+
+
+static const char *str_inst(uint32_t inst_id)
+{
+    const char* const STR_INST[] = 
+    {
+        "undecoded",
+        "nop",
+        "add",
+        "sub",
+        "mul",
+        "xor",
+        "div",
+        "or",
+        "rem",
+        "and",
+        "remu",
+        "czero_nez",
+        "sll",
+        "mulh",
+        "srl",
+        "sra",
+        "divu",
+        "czero_eqz",
+        "slt",
+        "mulhsu",
+        "sltu",
+        "mulhu",
+        "addi",
+        "xori",
+        "ori",
+        "andi",
+        "slli",
+        "srli",
+        "srai",
+        "slti",
+        "sltiu",
+        "sb",
+        "sh",
+        "sw",
+        "lb",
+        "lh",
+        "lw",
+        "lbu",
+        "lhu",
+        "beq",
+        "bne",
+        "blt",
+        "bge",
+        "bltu",
+        "bgeu",
+        "jal",
+        "jalr",
+        "lui",
+        "auipc",
+        "ecall",
+        "break",
+        "wtf",
+        "lui+addi",
+        "auipc+jalr",
+        "slli+add",
+        "addi+bnez",
+        "lw+addi",
+        "sw+addi",
+    };
+
+    if (inst_id < NUM_INSTS)
+    {
+        return STR_INST[inst_id];
+    }
+
+    return STR_INST[INST_INVALID];
+}
+
+
+/* Add the counted blocks to inst_stats. A block runs from the slot it was
+   entered at to the next control transfer, so its count goes to every slot
+   up to there. Runs stopping mid-block uncount the rest of it, see
+   device_run_threaded() */
+static void stats_fold(device_t *dev)
+{
+    if (!dev->block_counts)
+    {
+        return;
+    }
+
+    uint32_t num_insts = (dev->prog_end - dev->rom.origin) / 4;
+
+    for (uint32_t i = 0; i < num_insts; i++)
+    {
+        uint64_t n = dev->block_counts[i];
+
+        if (!n)
+        {
+            continue;
+        }
+
+        for (uint32_t j = i; j < num_insts; j++)
+        {
+            uint32_t inst_id = dev->uinsts[j].inst_id;
+
+            dev->inst_stats[inst_id] += n;
+
+            if (inst_id == INST_INVALID || (inst_id >= INST_BEQ && inst_id <= INST_JALR))
+            {
+                break;
+            }
+        }
+
+        dev->block_counts[i] = 0;
+    }
+}
+
+
+void device_printout_instruction_stats(device_t *dev)
+{
+    stats_fold(dev);
+
+    printf("Instruction stats:\n");
+    printf("{");
+
+    for (int i = 0; i < NUM_INSTS; i++)
+    {
+        if ((i % 8) == 0)
+        {
+            printf("\n    ");
+        }
+
+        printf("\"%s\": %llu", str_inst(i), dev->inst_stats[i]);
+        
+        if (i < NUM_INSTS - 1)
+        {
+            printf(", ");
+        }
+        else
+        {
+            printf("\n");
+        }
+    }
+
+    printf("}\n");
+}
+
+
+static inline void ilp_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#endif
+}
+
+
+static uint64_t ilp_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/* Run a share of a slice. Instructions of a slice don't depend on each
+   other, only the pc is shared. Apart from jalr they only add to it, so
+   workers sum their increments in pc_delta and the caller adds them up */
+static bool ilp_run_items(device_t *dev, ilp_thread_data_t *td, uint32_t *pc)
+{
+    bool res = true;
+
+    for (uint32_t i = 0; i < td->n_items; i++)
+    {
+        res = run_unpacked(dev, td->items[i].inst, td->items[i].addr, pc) && res;
+    }
+
+    return res;
+}
+
+
+static void *ilp_thread_proc(void *arg)
+{
+    ilp_thread_data_t *td = arg;
+    device_t *dev = (device_t*)td->dev;
+    uint32_t epoch = 0;
+
+    for (;;)
+    {
+        uint32_t spins = 0;
+        uint32_t next;
+
+        /* Spin for the next slice, give the core away when none comes */
+        while ((next = __atomic_load_n(&dev->ilp_sync.epoch, __ATOMIC_ACQUIRE)) == epoch)
+        {
+            if (++spins < ILP_SPINS)
+            {
+                ilp_pause();
+            }
+            else
+            {
+                sched_yield();
+            }
+        }
+
+        epoch = next;
+
+        if (dev->ilp_sync.quit)
+        {
+            return NULL;
+        }
+
+        /* Items handed out for a later epoch are picked up once it starts */
+        if (__atomic_load_n(&td->epoch, __ATOMIC_RELAXED) == epoch)
+        {
+            td->pc_delta = 0;
+            td->ok = ilp_run_items(dev, td, &td->pc_delta);
+            __atomic_fetch_add(&dev->ilp_sync.n_done, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void ilp_stop_workers(device_t *dev)
+{
+    if (!dev->ilp_threads_data)
+    {
+        return;
+    }
+
+    dev->ilp_sync.quit = true;
+    __atomic_add_fetch(&dev->ilp_sync.epoch, 1, __ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i <= dev->ilp_n_workers; i++)
+    {
+        if (i)
+        {
+            pthread_join(dev->ilp_threads[i], NULL);
+        }
+
+        free(dev->ilp_threads_data[i].items);
+    }
+
+    free(dev->ilp_threads);
+    free(dev->ilp_threads_data);
+    free(dev->ilp_slice);
+    dev->ilp_threads = NULL;
+    dev->ilp_threads_data = NULL;
+    dev->ilp_slice = NULL;
+}
+
+
+/* Run same operation ALU instructions of a serially run slice as vector
+   ops, with AVX2 when the host has it */
+bool device_use_ilp_simd(device_t *dev, bool enable)
+{
+    dev->ilp_simd = enable;
+#if defined(__x86_64__)
+    dev->ilp_simd_avx2 = enable && __builtin_cpu_supports("avx2");
+#endif
+
+    return true;
+}
+
+
+/* Drop to serial slices in a forked child, which has no workers */
+void device_ilp_forked(device_t *dev)
+{
+    if (!dev->ilp_threads_data)
+    {
+        return;
+    }
+
+    /* Only the forking thread exists in the child, the workers' data can
+       go but there is nothing to join */
+    for (uint32_t i = 1; i <= dev->ilp_n_workers; i++)
+    {
+        free(dev->ilp_threads_data[i].items);
+        dev->ilp_threads_data[i].items = NULL;
+    }
+
+    dev->ilp_n_workers = 0;
+    dev->ilp_workers = 0;
+}
+
+
+/* Worker count tried by a calibration candidate: none, then powers of two
+   up to all of them */
+static uint32_t ilp_candidate_workers(device_t *dev, uint32_t candidate)
+{
+    uint32_t workers = candidate ? 1u << (candidate - 1) : 0;
+
+    return workers < dev->ilp_n_workers ? workers : dev->ilp_n_workers;
+}
+
+
+/* Add up the time of slices run with the current candidate and move on to
+   the next one, early when it's already slower than running serially. Once
+   all are timed the fastest is kept until the next round */
+static void ilp_calibrate(device_t *dev, uint64_t ns)
+{
+    uint32_t candidate = dev->ilp_calib_candidate;
+
+    dev->ilp_calib_ns += ns;
+    dev->ilp_calib_left--;
+
+    if (dev->ilp_calib_left && (!candidate || dev->ilp_calib_ns <= dev->ilp_slice_ns[0]))
+    {
+        return;
+    }
+
+    dev->ilp_slice_ns[candidate] = dev->ilp_calib_ns;
+    dev->ilp_slice_n[candidate] = ILP_CALIB_SLICES - dev->ilp_calib_left;
+    dev->ilp_calib_ns = 0;
+
+    if (candidate + 1 < ILP_MAX_CANDIDATES &&
+        ilp_candidate_workers(dev, candidate + 1) > ilp_candidate_workers(dev, candidate))
+    {
+        dev->ilp_calib_candidate++;
+        dev->ilp_workers = ilp_candidate_workers(dev, dev->ilp_calib_candidate);
+        dev->ilp_calib_left = ILP_CALIB_SLICES;
+        return;
+    }
+
+    uint32_t best = 0;
+
+    for (uint32_t i = 1; i <= candidate; i++)
+    {
+        if ((double)dev->ilp_slice_ns[i] / dev->ilp_slice_n[i] <
+            (double)dev->ilp_slice_ns[best] / dev->ilp_slice_n[best])
+        {
+            best = i;
+        }
+    }
+
+    dev->ilp_workers = ilp_candidate_workers(dev, best);
+    dev->ilp_calib_candidate = ILP_MAX_CANDIDATES;
+    dev->ilp_calib_left = ILP_RECALIB_SLICES;
+}
+
+
+/* Registers and memory an instruction of a block being sliced depends on */
+typedef struct
+{
+    uint32_t addr;
+    uint32_t inst_id;
+    uint32_t slice;
+    uint32_t reads;             /* Register masks, x0 excluded */
+    uint32_t writes;
+    uint32_t mem_base;          /* Base register and byte range accessed */
+    int32_t  mem_lo;
+    int32_t  mem_hi;
+    uint8_t  mem;               /* 0, ILP_MEM_READ or ILP_MEM_WRITE */
+    uint32_t exit;              /* Where a side exit leaves the block, or 0 */
+
+} ilp_dep_t;
+
+#define ILP_MEM_READ  1
+#define ILP_MEM_WRITE 2
+
+
+/* Get the instruction at addr, decoding its slot if needed */
+static bool ilp_fetch(device_t *dev, uint32_t addr, uinst_t *inst)
+{
+    if (dev->uinsts && addr >= dev->rom.origin && addr < dev->prog_end)
+    {
+        uint32_t inst_id = (addr - dev->rom.origin) / 4;
+
+        if (dev->uinsts[inst_id].inst_id == INST_UNDECODED)
+        {
+            decode_slot(dev, inst_id);
+        }
+
+        *inst = dev->uinsts[inst_id];
+        return true;
+    }
+
+    uint32_t raw;
+
+    return device_read(dev, addr, (uint8_t*)&raw, sizeof(raw)) &&
+           unpack_instruction(raw, inst);
+}
+
+
+/* Fill in the dependencies of inst, return false if it ends a block.
+   Conditional branches are side exits and don't */
+static bool ilp_deps(const uinst_t *inst, ilp_dep_t *dep)
+{
+    uint32_t rs1 = 1u << inst->rs1;
+    uint32_t rs2 = 1u << inst->rs2;
+    uint32_t rd = 1u << inst->rd;
+    bool cont = true;
+
+    switch (inst->inst_id)
+    {
+    case INST_NOP:
+        break;
+
+    case INST_ADD ... INST_MULHU:
+        dep->reads = rs1 | rs2;
+        dep->writes = rd;
+        break;
+
+    case INST_ADDI ... INST_SLTIU:
+        dep->reads = rs1;
+        dep->writes = rd;
+        break;
+
+    case INST_SB ... INST_SW:
+        dep->reads = rs1 | rs2;
+        dep->mem = ILP_MEM_WRITE;
+        dep->mem_hi = 1 << (inst->inst_id - INST_SB);
+        break;
+
+    case INST_LB ... INST_LHU:
+        dep->reads = rs1;
+        dep->writes = rd;
+        dep->mem = ILP_MEM_READ;
+        dep->mem_hi = inst->inst_id == INST_LW ? 4 :
+                      inst->inst_id == INST_LH || inst->inst_id == INST_LHU ? 2 : 1;
+        break;
+
+    case INST_JAL:
+    case INST_LUI:
+    case INST_AUIPC:
+        dep->writes = rd;
+        break;
+
+    case INST_JALR:
+        dep->reads = rs1;
+        dep->writes = rd;
+        cont = false;
+        break;
+
+    case INST_BEQ ... INST_BGEU:
+        dep->reads = rs1 | rs2;
+        break;
 
-        case 0x05:
-            switch (uinst->imm >> 5)
-            {
-            case 0x00: /* srli */
-                uinst->inst_id = INST_SRLI;
-                break;
+    default:
+        cont = false;
+        break;
+    }
 
-            case 0x20: /* srai */
-                uinst->inst_id = INST_SRAI;
-                break;
+    if (dep->mem)
+    {
+        dep->mem_base = inst->rs1;
+        dep->mem_lo = inst->imm;
+        dep->mem_hi += inst->imm;
+    }
 
-            default:
-                res = false;
-            }
-            break;
+    dep->reads &= ~1u;
+    dep->writes &= ~1u;
 
-        case 0x02: /* slti */
-            uinst->inst_id = INST_SLTI;
-            break;
+    return cont;
+}
 
-        case 0x03: /* sltiu */
-            uinst->inst_id = INST_SLTIU;
-            break;
 
-        default:
-            printf("Error: invalid I-type instruction 0x%08X\n", inst);
-            res = false;
-            break;
-        }   
+/* Accesses through the same base register only overlap if their ranges
+   do, different bases may point anywhere */
+static bool ilp_conflict(const ilp_dep_t *a, const ilp_dep_t *b)
+{
+    if ((a->writes & (b->reads | b->writes)) || (a->reads & b->writes))
+    {
+        return true;
     }
-    break;
 
-    case 0b0100011: /* Store ops */
+    if (!a->mem || !b->mem || (a->mem | b->mem) == ILP_MEM_READ)
     {
-        uint32_t funct3 = (inst >> 12) & 0b111;
+        return false;
+    }
 
-        uinst->rs1 = (inst >> 15) & 0b11111;
-        uinst->rs2 = (inst >> 20) & 0b11111;
-        uinst->imm = (inst >> 7) & 0b11111;
-        uinst->imm |= ((inst >> 25) & 0b1111111) << 5;
-        uinst->imm = (uinst->imm << 20) >> 20;
-        
-        switch (funct3)
-        {
-        case 0x00: /* sb */
-            uinst->inst_id = INST_SB;
-            break;
+    return a->mem_base != b->mem_base ||
+           (a->mem_lo < b->mem_hi && b->mem_lo < a->mem_hi);
+}
 
-        case 0x01: /* sh */
-            uinst->inst_id = INST_SH;
-            break;
 
-        case 0x02: /* sw */
-            uinst->inst_id = INST_SW;
-            break;
+/* Whether an instruction may run ahead of a side exit it follows: an ALU
+   op that can't trap, writing a register not written earlier in the
+   block, so the exit can restore the value it had at the block entry */
+static bool ilp_speculative(const ilp_dep_t *dep, uint32_t written)
+{
+    if (dep->writes & written)
+    {
+        return false;
+    }
 
-        default:
-            printf("Error: invalid S-type instruction 0x%08X\n", inst);
-            res = false;
-            break;
-        }
+    switch (dep->inst_id)
+    {
+    case INST_DIV:
+    case INST_DIVU:
+    case INST_REM:
+    case INST_REMU:
+        /* Division by zero traps on the host */
+        return false;
+
+    case INST_LUI:
+    case INST_AUIPC:
+        return true;
+
+    default:
+        return dep->inst_id >= INST_ADD && dep->inst_id <= INST_SLTIU;
     }
-    break;
+}
 
-    case 0b0000011: /* Load ops */
+
+/* Build the slices of the block at ilp_map[b_id] the way thread_slicer.py
+   does: follow the code through jal and the expected way of branches,
+   backward ones taken and forward ones not, up to jalr, a jump back into
+   the block, the stop address or ILP_MAX_EXITS side exits. Every instruction but the last
+   goes in the first slice after the last one it depends on that has room,
+   and the last alone. Side exits go after everything before them, only
+   ilp_speculative() instructions after them may go up to their slice.
+   Branching in the executor sums up pc increments, so jal and auipc don't
+   depend on each other */
+static bool ilp_slice_block(device_t *dev, uint32_t b_id)
+{
+    ilp_dep_t deps[ILP_MAX_BLOCK];
+    uint32_t slice_len[ILP_MAX_BLOCK];
+    uint32_t pc = dev->rom.origin + b_id * 4;
+    uint32_t n = 0;
+    uint32_t n_exits = 0;
+    uint64_t start = ilp_time_ns();
+
+    for (;;)
     {
-        uint32_t funct3 = (inst >> 12) & 0b111;
+        uinst_t inst;
+        ilp_dep_t *dep = &deps[n];
 
-        uinst->rd = (inst >> 7) & 0b11111;
-        uinst->rs1 = (inst >> 15) & 0b11111;
-        uinst->imm = (inst >> 20) & 0b111111111111;
-        uinst->imm = (uinst->imm << 20) >> 20;
+        if (!ilp_fetch(dev, pc, &inst))
+        {
+            if (n)
+            {
+                break;
+            }
 
-        switch (funct3)
+            inst.inst_id = INST_INVALID;
+        }
+
+        memset(dep, 0, sizeof(*dep));
+        dep->addr = pc;
+        dep->inst_id = inst.inst_id;
+
+        bool cont = ilp_deps(&inst, dep);
+        uint32_t next_pc = inst.inst_id == INST_JAL ? pc + inst.imm : pc + 4;
+
+        if (inst.inst_id >= INST_BEQ && inst.inst_id <= INST_BGEU)
         {
-        case 0x00: /* lb */
-            uinst->inst_id = INST_LB;
-            break;
+            dep->exit = (int32_t)inst.imm < 0 ? pc + 4 : pc + inst.imm;
+            next_pc = (int32_t)inst.imm < 0 ? pc + inst.imm : pc + 4;
+        }
 
-        case 0x01: /* lh */
-            uinst->inst_id = INST_LH;
-            break;
+        bool loop = false;
 
-        case 0x02: /* lw */
-            uinst->inst_id = INST_LW;
-            break;
+        for (uint32_t i = 0; i <= n; i++)
+        {
+            loop = loop || deps[i].addr == next_pc;
+        }
 
-        case 0x04: /* lbu */
-            uinst->inst_id = INST_LBU;
-            break;
+        n++;
 
-        case 0x05: /* lhu */
-            uinst->inst_id = INST_LHU;
+        /* A jump back into the block ends it, and so does reaching the stop
+           address, which runs only check between blocks */
+        if (!cont || loop || n == ILP_MAX_BLOCK || next_pc == dev->exit_addr ||
+            next_pc < dev->rom.origin || next_pc >= dev->prog_end)
+        {
             break;
+        }
 
-        default:
-            printf("Error: invalid I-type instruction 0x%08X\n", inst);
-            res = false;
-            break;
+        if (dep->exit)
+        {
+            if (n_exits == ILP_MAX_EXITS ||
+                dep->exit < dev->rom.origin || dep->exit >= dev->prog_end)
+            {
+                break;
+            }
+
+            n_exits++;
         }
+
+        pc = next_pc;
     }
-    break;
 
-    case 0b1100011: /* Branching ops */
+    /* The last instruction may branch either way */
+    deps[n - 1].exit = 0;
+    n_exits = 0;
+
+    for (uint32_t i = 0; i < n; i++)
     {
-        uint32_t funct3 = (inst >> 12) & 0b111;
-        
-        uinst->rs1 = (inst >> 15) & 0b11111;
-        uinst->rs2 = (inst >> 20) & 0b11111;
+        n_exits += deps[i].exit != 0;
+    }
 
-        uinst->imm = (inst >> 8) & 0b1111;
-        uinst->imm |= ((inst >> 7) & 1) << 10;
-        uinst->imm |= ((inst >> 25) & 0b111111) << 4;
-        uinst->imm = (uinst->imm << 1) | (((inst >> 31) & 1) << 12);
-        uinst->imm = (uinst->imm << 19) >> 19;
+    uint32_t n_slices = 0;
+    uint32_t written = 0;
+    uint32_t last = 0;          /* Highest slice taken so far */
+    uint32_t exit_floor = 0;    /* First slice after the last side exit */
 
-        switch (funct3)
+    for (uint32_t i = 0; i + 1 < n; i++)
+    {
+        uint32_t slice = 0;
+
+        for (uint32_t j = 0; j < i; j++)
         {
-        case 0x00: /* beq == */
-            uinst->inst_id = INST_BEQ;
-            break;
+            if (deps[j].slice >= slice && ilp_conflict(&deps[i], &deps[j]))
+            {
+                slice = deps[j].slice + 1;
+            }
+        }
 
-        case 0x01: /* bne != */
-            uinst->inst_id = INST_BNE;
-            break;
+        if (deps[i].exit && slice < last)
+        {
+            slice = last;
+        }
 
-        case 0x04: /* blt < */
-            uinst->inst_id = INST_BLT;
-            break;
+        if ((deps[i].exit || !ilp_speculative(&deps[i], written)) && slice < exit_floor)
+        {
+            slice = exit_floor;
+        }
 
-        case 0x05: /* bge >= */
-            uinst->inst_id = INST_BGE;
-            break;
+        while (slice < n_slices && slice_len[slice] >= dev->ilp_n_threads)
+        {
+            slice++;
+        }
 
-        case 0x06: /* bltu < (u) */
-            uinst->inst_id = INST_BLTU;
-            break;
+        if (slice == n_slices)
+        {
+            slice_len[n_slices++] = 0;
+        }
 
-        case 0x07: /* bgeu >= (u) */
-            uinst->inst_id = INST_BGEU;
-            break;
+        slice_len[slice]++;
+        deps[i].slice = slice;
+        written |= deps[i].writes;
+        last = slice > last ? slice : last;
 
-        default:
-            printf("Error: invalid B-type instruction 0x%08X\n", inst);
-            res = false;
-            break;
+        if (deps[i].exit)
+        {
+            exit_floor = slice + 1;
         }
-
     }
-    break;
-
-    case 0b1101111: /* jal */
-    {
-        uinst->rd = (inst >> 7) & 0b11111;
 
-        uinst->imm = ((inst >> 21) & 0b1111111111) << 1;
-        uinst->imm |= ((inst >> 20) & 1) << 11;
-        uinst->imm |= ((inst >> 12) & 0b11111111) << 12;
-        uinst->imm |= (inst >> 31) << 20;
-        uinst->imm = (uinst->imm << 11) >> 11;
+    deps[n - 1].slice = n_slices++;
 
-        uinst->inst_id = INST_JAL;
-    }
-    break;
+    /* Registers the instructions after a side exit write up to its slice */
+    uint32_t restore[ILP_MAX_BLOCK];
+    uint32_t saved = 0;
 
-    case 0b1100111: /* jalr */
+    for (uint32_t i = 0; i + 1 < n; i++)
     {
-        uint32_t funct3 = (inst >> 12) & 0b111;
-
-        uinst->rd = (inst >> 7) & 0b11111;
-        uinst->rs1 = (inst >> 15) & 0b11111;
-        uinst->imm = (inst >> 20) & 0b111111111111;
-        uinst->imm = (uinst->imm << 20) >> 20;
+        restore[i] = 0;
 
-        switch (funct3)
+        for (uint32_t j = i + 1; deps[i].exit && j + 1 < n; j++)
         {
-        case 0x00:
-            uinst->inst_id = INST_JALR;
-            break;
-
-        default:
-            printf("Error: invalid I-type instruction 0x%08X\n", inst);
-            res = false;
-            break;
+            if (deps[j].slice <= deps[i].slice)
+            {
+                restore[i] |= deps[j].writes;
+            }
         }
+
+        saved |= restore[i];
     }
-    break;
 
-    case 0b0110111: /* lui */
+    /* Each instruction and each slice terminator takes a word, each side
+       exit four and saving registers two */
+    uint32_t size = n + n_slices + n_exits * 4 + (saved ? 2 : 0);
+
+    if (dev->ilp_table_len + size > dev->ilp_table_cap)
     {
-        uinst->rd = (inst >> 7) & 0b11111;
-        uinst->imm = (inst >> 12) & 0xfffff;
-        uinst->imm = (uinst->imm << 11) >> 11;
+        uint32_t cap = dev->ilp_table_cap * 2 + size;
+        uint32_t *table = realloc(dev->ilp_table, sizeof(uint32_t) * cap);
 
-        uinst->inst_id = INST_LUI;
+        if (!table)
+        {
+            printf("Error: can't grow the ILP table\n");
+            return false;
+        }
+
+        dev->ilp_table = table;
+        dev->ilp_table_cap = cap;
     }
-    break;
 
-    case 0b0010111: /* auipc */
+    ilp_entry_t *entry = &dev->ilp_map[b_id];
+    uint32_t *out = dev->ilp_table + dev->ilp_table_len;
+
+    if (saved)
     {
-        uinst->rd = (inst >> 7) & 0b11111;
-        uinst->imm = (inst >> 12) & 0xfffff;
-        uinst->imm = (uinst->imm << 11) >> 11;
-        
-        uinst->inst_id = INST_AUIPC;
+        *out++ = ILP_BLOCK_SAVE;
+        *out++ = saved;
     }
-    break;
 
-    case 0b1110011: /* Env call & breakpoint */
+    /* Instructions of a slice with the same operation go next to each
+       other, so the executor can run them as vector ops */
+    for (uint32_t slice = 0; slice < n_slices; slice++)
     {
-        uint32_t funct12 = (inst >> 20) & 0b111111111111;
-        uint32_t funct3 = (inst >> 12) & 0b111;
-       
-        uinst->rs1 = (inst >> 15) & 0b11111;
-        uinst->rd = (inst >> 7) & 0b11111;
+        for (uint32_t i = 0; i + 1 < n; i++)
+        {
+            if (deps[i].exit && deps[i].slice == slice)
+            {
+                *out++ = ILP_SLICE_EXIT;
+                *out++ = (deps[i].addr - dev->rom.origin) / 4;
+                *out++ = (deps[i].exit - dev->rom.origin) / 4;
+                *out++ = restore[i];
+            }
+        }
 
-        res = (uinst->rs1 == funct3) == (uinst->rd == 0x0);
+        uint32_t *first = out;
 
-        switch (funct12)
+        for (uint32_t i = 0; i < n; i++)
         {
-        case 0x00:
-            uinst->inst_id = INST_ECALL;
-            break;
+            if (deps[i].slice != slice)
+            {
+                continue;
+            }
 
-        case 0x01:
-            uinst->inst_id = INST_BREAK;
-            break;
+            uint32_t *pos = out++;
 
-        default:
-            printf("Error: invalid I-type instruction 0x%08X\n", inst);
-            res = false;
-            break;
+            while (pos > first && deps[i].inst_id < deps[pos[-1]].inst_id)
+            {
+                *pos = pos[-1];
+                pos--;
+            }
+
+            *pos = i;
+        }
+
+        for (uint32_t *p = first; p < out; p++)
+        {
+            *p = (deps[*p].addr - dev->rom.origin) / 4;
         }
+
+        *out++ = ILP_SLICE_END;
     }
-    break;
 
-    default:
-        printf("Error: unrecognized opcode 0x%02X\n", opcode);
-        res = false;
-        break;
-    }
+    entry->offset = dev->ilp_table_len;
+    entry->size = size;
+    dev->ilp_table_len += size;
+    dev->ilp_n_sliced++;
+    dev->ilp_slicing_ns += ilp_time_ns() - start;
+
+    return true;
+}
+
+
+/* ALU operations a slice can run as vector ops */
+#define ILP_SIMD_OPS                                                        \
+    ((1ull << INST_ADD) | (1ull << INST_SUB) | (1ull << INST_MUL) |         \
+     (1ull << INST_XOR) | (1ull << INST_OR) | (1ull << INST_AND) |          \
+     (1ull << INST_SLL) | (1ull << INST_SRL) | (1ull << INST_SRA) |         \
+     (1ull << INST_SLT) | (1ull << INST_SLTU) | (1ull << INST_ADDI) |       \
+     (1ull << INST_XORI) | (1ull << INST_ORI) | (1ull << INST_ANDI) |       \
+     (1ull << INST_SLLI) | (1ull << INST_SRLI) | (1ull << INST_SRAI) |      \
+     (1ull << INST_SLTI) | (1ull << INST_SLTIU))
 
-    return res; 
+static inline bool ilp_simd_op(uint32_t inst_id)
+{
+    return inst_id < 64 && ((ILP_SIMD_OPS >> inst_id) & 1);
 }
 
 
-static bool device_run_unpacked_instruction(device_t *dev, uinst_t inst, uint32_t pc_ro)
+static bool ilp_simd_imm(uint32_t inst_id)
 {
-    bool res = true;
-    bool pc_updated = false;
+    return inst_id >= INST_ADDI && inst_id <= INST_SLTIU;
+}
 
-    switch(inst.inst_id)
-    {
-    case INST_NOP:
-        break;
 
-    case INST_ADD:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] + dev->regs[inst.rs2]);
-        break;
+/* One operation on up to ILP_SIMD_LANES lanes, operands are register
+   indices and immediates */
+static void ilp_simd_scalar(const uint32_t *regs, uint32_t inst_id,
+                            const int32_t *rs1, const int32_t *rs2,
+                            const int32_t *imm, uint32_t *res)
+{
+    bool use_imm = ilp_simd_imm(inst_id);
 
-    case INST_SUB:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] - dev->regs[inst.rs2]);
-        break;
+    for (uint32_t k = 0; k < ILP_SIMD_LANES; k++)
+    {
+        uint32_t a = regs[rs1[k]];
+        uint32_t b = use_imm ? (uint32_t)imm[k] : regs[rs2[k]];
 
-    case INST_MUL:
+        switch (inst_id)
         {
-            int32_t prod = (int32_t)dev->regs[inst.rs1] * (int32_t)dev->regs[inst.rs2];
-            device_set_reg(dev, inst.rd, (uint32_t)prod);
+        case INST_ADD:  case INST_ADDI:  res[k] = a + b; break;
+        case INST_SUB:                   res[k] = a - b; break;
+        case INST_MUL:                   res[k] = a * b; break;
+        case INST_XOR:  case INST_XORI:  res[k] = a ^ b; break;
+        case INST_OR:   case INST_ORI:   res[k] = a | b; break;
+        case INST_AND:  case INST_ANDI:  res[k] = a & b; break;
+        case INST_SLL:  case INST_SLLI:  res[k] = a << (b & 31); break;
+        case INST_SRL:  case INST_SRLI:  res[k] = a >> (b & 31); break;
+        case INST_SRA:  case INST_SRAI:  res[k] = (int32_t)a >> (b & 31); break;
+        case INST_SLT:  case INST_SLTI:  res[k] = (int32_t)a < (int32_t)b; break;
+        case INST_SLTU: case INST_SLTIU: res[k] = a < b; break;
         }
-        break;
+    }
+}
 
-    case INST_XOR:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] ^ dev->regs[inst.rs2]);
-        break;
 
-    case INST_DIV:
-        device_set_reg(dev, inst.rd, (uint32_t)((int32_t)dev->regs[inst.rs1] / \
-                                           (int32_t)dev->regs[inst.rs2]));
-        break;
+#if defined(__x86_64__)
+/* ilp_simd_scalar() as a gather of the operands, one AVX2 op and a store */
+__attribute__((target("avx2")))
+static void ilp_simd_avx2(const uint32_t *regs, uint32_t inst_id,
+                          const int32_t *rs1, const int32_t *rs2,
+                          const int32_t *imm, uint32_t *res)
+{
+    __m256i a = _mm256_i32gather_epi32((const int*)regs,
+                                       _mm256_loadu_si256((const __m256i*)rs1), 4);
+    __m256i b = ilp_simd_imm(inst_id) ?
+                _mm256_loadu_si256((const __m256i*)imm) :
+                _mm256_i32gather_epi32((const int*)regs,
+                                       _mm256_loadu_si256((const __m256i*)rs2), 4);
+    __m256i shamt = _mm256_and_si256(b, _mm256_set1_epi32(31));
+    __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    __m256i r;
+
+    switch (inst_id)
+    {
+    case INST_ADD:  case INST_ADDI:  r = _mm256_add_epi32(a, b); break;
+    case INST_SUB:                   r = _mm256_sub_epi32(a, b); break;
+    case INST_MUL:                   r = _mm256_mullo_epi32(a, b); break;
+    case INST_XOR:  case INST_XORI:  r = _mm256_xor_si256(a, b); break;
+    case INST_OR:   case INST_ORI:   r = _mm256_or_si256(a, b); break;
+    case INST_AND:  case INST_ANDI:  r = _mm256_and_si256(a, b); break;
+    case INST_SLL:  case INST_SLLI:  r = _mm256_sllv_epi32(a, shamt); break;
+    case INST_SRL:  case INST_SRLI:  r = _mm256_srlv_epi32(a, shamt); break;
+    case INST_SRA:  case INST_SRAI:  r = _mm256_srav_epi32(a, shamt); break;
 
-    case INST_OR:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] | dev->regs[inst.rs2]);
+    case INST_SLT:
+    case INST_SLTI:
+        r = _mm256_srli_epi32(_mm256_cmpgt_epi32(b, a), 31);
         break;
 
-    case INST_REM:
-        device_set_reg(dev, inst.rd, (uint32_t)((int32_t)dev->regs[inst.rs1] % \
-                                           (int32_t)dev->regs[inst.rs2]));
+    case INST_SLTU:
+    case INST_SLTIU:
+        /* Unsigned compare as a signed one with the sign bits flipped */
+        r = _mm256_srli_epi32(_mm256_cmpgt_epi32(_mm256_xor_si256(b, sign),
+                                                 _mm256_xor_si256(a, sign)), 31);
         break;
 
-    case INST_AND:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] & dev->regs[inst.rs2]);
+    default:
+        r = _mm256_setzero_si256();
         break;
+    }
 
-    case INST_REMU:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] % dev->regs[inst.rs2]);
-        break;
+    _mm256_storeu_si256((__m256i*)res, r);
+}
+#endif
 
-    case INST_CZERO_NEZ:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs2] ? 0 : dev->regs[inst.rs1]);
-        break;
 
-    case INST_SLL:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] << dev->regs[inst.rs2]);
-        break;
+/* Run n_lanes instructions with the same ALU operation as vector ops */
+static void ilp_run_lanes(device_t *dev, const ilp_item_t *items, uint32_t n_lanes)
+{
+    uint32_t inst_id = items[0].inst.inst_id;
 
-    case INST_MULH:
+    for (uint32_t l = 0; l < n_lanes; l += ILP_SIMD_LANES)
+    {
+        int32_t rs1[ILP_SIMD_LANES];
+        int32_t rs2[ILP_SIMD_LANES];
+        int32_t imm[ILP_SIMD_LANES];
+        uint32_t res[ILP_SIMD_LANES];
+        uint32_t n = n_lanes - l < ILP_SIMD_LANES ? n_lanes - l : ILP_SIMD_LANES;
+
+        /* Unused lanes read x0 */
+        for (uint32_t k = 0; k < ILP_SIMD_LANES; k++)
         {
-            int64_t op1 = (int64_t)(int32_t)dev->regs[inst.rs1];
-            int64_t op2 = (int64_t)(int32_t)dev->regs[inst.rs2];
-            int64_t prod = op1 * op2;
-            // printf("MULH: 0x%08X * 0x%08X = 0x%08X\n", dev->regs[inst.rs1], dev->regs[inst.rs2], (uint32_t)(prod >> 32));
-            device_set_reg(dev, inst.rd, (uint32_t)(prod >> 32));
+            const uinst_t *inst = &items[l + (k < n ? k : 0)].inst;
+
+            rs1[k] = k < n ? inst->rs1 : 0;
+            rs2[k] = k < n ? inst->rs2 : 0;
+            imm[k] = inst->imm;
         }
-        break;
 
-    case INST_SRL:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] >> dev->regs[inst.rs2]);
-        break;
+#if defined(__x86_64__)
+        if (dev->ilp_simd_avx2)
+        {
+            ilp_simd_avx2(dev->regs, inst_id, rs1, rs2, imm, res);
+        }
+        else
+#endif
+        {
+            ilp_simd_scalar(dev->regs, inst_id, rs1, rs2, imm, res);
+        }
 
-    case INST_SRA:
-        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] >> dev->regs[inst.rs2]);
-        break;
+        for (uint32_t k = 0; k < n; k++)
+        {
+            dev->regs[items[l + k].inst.rd] = res[k];
+        }
+    }
 
-    case INST_DIVU:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] / dev->regs[inst.rs2]);
-        break;
+    dev->regs[0] = 0;
+    dev->pc += 4 * n_lanes;
+    dev->ilp_simd_groups++;
+    dev->ilp_simd_lanes += n_lanes;
+}
 
-    case INST_CZERO_EQZ:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs2] ? dev->regs[inst.rs1] : 0);
-        break;
 
-    case INST_SLT:
-        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] < \
-                                (int32_t)dev->regs[inst.rs2] ? 1 : 0);
-        break;
+/* Run a slice on the calling thread, runs of at least ILP_SIMD_MIN_LANES
+   instructions with the same ALU operation as vector ops. Both slicers
+   put such instructions next to each other. The slicer proved the
+   instructions independent, so no lane reads a register another one
+   writes and they may run in any order */
+static bool ilp_run_simd(device_t *dev, const ilp_item_t *items, uint32_t n_items)
+{
+    bool res = true;
 
-    case INST_MULHSU:
+    for (uint32_t i = 0, j; i < n_items; i = j)
+    {
+        uint32_t inst_id = items[i].inst.inst_id;
+
+        j = i + 1;
+
+        if (ilp_simd_op(inst_id))
         {
-            int64_t prod = (int64_t)(int32_t)dev->regs[inst.rs1] * (uint64_t)dev->regs[inst.rs2];
-            device_set_reg(dev, inst.rd, (uint32_t)(prod >> 32));
-        }
-        break;
+            while (j < n_items && items[j].inst.inst_id == inst_id)
+            {
+                j++;
+            }
 
-    case INST_SLTU:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] < dev->regs[inst.rs2] ? 1 : 0);
-        break;
+            if (j - i >= ILP_SIMD_MIN_LANES)
+            {
+                ilp_run_lanes(dev, items + i, j - i);
+                continue;
+            }
+        }
 
-    case INST_MULHU:
+        for (uint32_t k = i; k < j; k++)
         {
-            uint64_t prod = (uint64_t)dev->regs[inst.rs1] * (uint64_t)dev->regs[inst.rs2];
-            device_set_reg(dev, inst.rd, (uint32_t)(prod >> 32));
+            res = run_unpacked(dev, items[k].inst, items[k].addr, &dev->pc) && res;
         }
-        break;
+    }
 
-    case INST_ADDI:
-        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] + inst.imm);
-        break;
+    return res;
+}
 
-    case INST_XORI:
-        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] ^ inst.imm);
-        break;
 
-    case INST_ORI:
-        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] | inst.imm);
-        break;
+/* Run n_insts instructions of a slice, given as indices from the ROM
+   origin */
+static bool ilp_run_slice(device_t *dev, const uint32_t *slice, uint32_t n_insts)
+{
+    ilp_thread_data_t *tds = dev->ilp_threads_data;
+    ilp_item_t *items = tds[0].items;
+    uint32_t n_items = 0;
+    bool jalr = false;
+    bool stores = false;
+    bool loads = false;
+
+    /* Decoding happens here, workers only get unpacked copies */
+    for (uint32_t i = 0; i < n_insts; i++)
+    {
+        uint32_t inst_id = slice[i];
+        uint32_t addr = dev->rom.origin + inst_id * 4;
 
-    case INST_ANDI:
-        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] & inst.imm);
-        break;
+        if (dev->uinsts && addr < dev->prog_end)
+        {
+            if (dev->uinsts[inst_id].inst_id == INST_UNDECODED)
+            {
+                decode_slot(dev, inst_id);
+            }
 
-    case INST_SLLI:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] << (inst.imm & 0b11111));
-        break;
+            items[n_items].inst = dev->uinsts[inst_id];
+        }
+        else
+        {
+            uint32_t inst;
 
-    case INST_SRLI:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] >> (inst.imm & 0b11111));
-        break;
+            if (!device_read(dev, addr, (uint8_t*)&inst, sizeof(inst)))
+            {
+                return false;
+            }
 
-    case INST_SRAI:
-        device_set_reg(dev, inst.rd,
-                       ((int32_t)(dev->regs[inst.rs1]) >> (inst.imm & 0b11111)));
-        break;
+            if (!unpack_instruction(inst, &items[n_items].inst))
+            {
+                printf("Error: failed executing instruction: "
+                       "0x%08X at address 0x%08X\n", inst, addr);
+                return false;
+            }
+        }
 
-    case INST_SLTI:
-        device_set_reg(dev, inst.rd, (int32_t)dev->regs[inst.rs1] < inst.imm ? 1 : 0);
-        break;
+        uint32_t id = items[n_items].inst.inst_id;
 
-    case INST_SLTIU:
-        device_set_reg(dev, inst.rd, dev->regs[inst.rs1] < \
-                                ((uint32_t)inst.imm & 0b111111111111) ? 1 : 0);
-        break;
+        jalr = jalr || id == INST_JALR;
+        stores = stores || (id >= INST_SB && id <= INST_SW);
+        loads = loads || (id >= INST_LB && id <= INST_LHU);
+        items[n_items].addr = addr;
+        n_items++;
+    }
 
-    case INST_SB:
-        {
-            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
-            uint8_t bt = dev->regs[inst.rs2] & 0xff;
-            res = device_write(dev, addr, &bt, 1);
-        }
-        break;
+    /* Instruction stats and call tracking are not thread safe, jalr sets
+       the pc instead of adding to it. Stores invalidate decoded code, raise
+       events and fault in checkpointed pages, loads may fault in flat
+       memory or call host MMIO handlers, all of it per device state. Such
+       slices stay on the calling thread */
+    bool eligible = n_items >= ILP_MIN_ITEMS && !jalr && !dev->stats && !dev->track_calls;
+    bool parallel = eligible && !stores && !(loads && (dev->flat || dev->host_mmio));
+    bool calibrating = parallel && dev->ilp_calib_candidate < ILP_MAX_CANDIDATES;
+    uint32_t workers = parallel ? dev->ilp_workers : 0;
+    uint64_t start = calibrating ? ilp_time_ns() : 0;
+    bool res = true;
 
-    case INST_SH:
+    dev->ilp_n_slices++;
+
+    if (!workers)
+    {
+        if (eligible && dev->ilp_simd)
         {
-            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
-            uint16_t hw = dev->regs[inst.rs2] & 0xffff;
-            res = device_write(dev, addr, (uint8_t*)&hw, 2);
+            res = ilp_run_simd(dev, items, n_items);
         }
-        break;
-
-    case INST_SW:
+        else
         {
-            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
-            res = device_write(dev, addr, (uint8_t*)&dev->regs[inst.rs2], 4);
+            tds[0].n_items = n_items;
+            res = ilp_run_items(dev, &tds[0], &dev->pc);
         }
-        break;
+    }
+    else
+    {
+        uint32_t n_own = 0;
+        uint32_t n_busy = 0;
 
-    case INST_LB:
+        for (uint32_t w = 1; w <= workers; w++)
         {
-            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
-            int8_t sb;
-            res = device_read(dev, addr, (uint8_t*)&sb, 1);
-            device_set_reg(dev, inst.rd, (int32_t)sb);
+            tds[w].n_items = 0;
         }
-        break;
 
-    case INST_LH:
+        /* Deal the items round robin, the calling thread takes the first */
+        for (uint32_t i = 0; i < n_items; i++)
         {
-            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
-            int16_t shw;
-            res = device_read(dev, addr, (uint8_t*)&shw, 2);
-            device_set_reg(dev, inst.rd, (int32_t)shw);
+            uint32_t w = i % (workers + 1);
+
+            if (w)
+            {
+                tds[w].items[tds[w].n_items++] = items[i];
+            }
+            else
+            {
+                items[n_own++] = items[i];
+            }
         }
-        break;
 
-    case INST_LW:
+        tds[0].n_items = n_own;
+
+        uint32_t epoch = dev->ilp_sync.epoch + 1;
+
+        for (uint32_t w = 1; w <= workers; w++)
         {
-            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
-            uint32_t w;
-            res = device_read(dev, addr, (uint8_t*)&w, 4);
-            device_set_reg(dev, inst.rd, w);
+            if (tds[w].n_items)
+            {
+                __atomic_store_n(&tds[w].epoch, epoch, __ATOMIC_RELAXED);
+                n_busy++;
+            }
         }
-        break;
 
-    case INST_LBU:
+        __atomic_store_n(&dev->ilp_sync.n_done, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&dev->ilp_sync.epoch, epoch, __ATOMIC_RELEASE);
+
+        res = ilp_run_items(dev, &tds[0], &dev->pc);
+
+        for (uint32_t spins = 0;
+             __atomic_load_n(&dev->ilp_sync.n_done, __ATOMIC_ACQUIRE) != n_busy; spins++)
         {
-            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
-            uint8_t ub;
-            res = device_read(dev, addr, &ub, 1);
-            device_set_reg(dev, inst.rd, ub);
+            if (spins < ILP_SPINS)
+            {
+                ilp_pause();
+            }
+            else
+            {
+                sched_yield();
+            }
         }
-        break;
 
-    case INST_LHU:
+        for (uint32_t w = 1; w <= workers; w++)
         {
-            uint32_t addr = dev->regs[inst.rs1] + inst.imm;
-            uint16_t hw;
-            res = device_read(dev, addr, (uint8_t*)&hw, 2);
-            device_set_reg(dev, inst.rd, hw);
+            if (tds[w].n_items)
+            {
+                res = tds[w].ok && res;
+                dev->pc += tds[w].pc_delta;
+            }
         }
-        break;
 
+        dev->ilp_n_parallel++;
+    }
+
+    if (calibrating)
+    {
+        ilp_calibrate(dev, ilp_time_ns() - start);
+    }
+    else if (parallel && !--dev->ilp_calib_left)
+    {
+        /* Time the candidates again, the guest may have changed phase */
+        dev->ilp_calib_candidate = 0;
+        dev->ilp_workers = 0;
+        dev->ilp_calib_left = ILP_CALIB_SLICES;
+    }
+
+    return res;
+}
+
+
+/* Whether the side exit at instruction index branch leaves the block for
+   index target with the current registers. Nothing in its slice writes
+   what the branch reads, so this may be asked before the slice runs */
+static bool ilp_exit_taken(device_t *dev, uint32_t branch, uint32_t target)
+{
+    uint32_t addr = dev->rom.origin + branch * 4;
+    uinst_t inst;
+    bool taken;
+
+    if (!ilp_fetch(dev, addr, &inst))
+    {
+        return false;
+    }
+
+    uint32_t a = dev->regs[inst.rs1];
+    uint32_t b = dev->regs[inst.rs2];
+
+    switch (inst.inst_id)
+    {
     case INST_BEQ:
-        if ((int32_t)(dev->regs[inst.rs1]) == (int32_t)(dev->regs[inst.rs2]))
-        {
-            dev->pc += inst.imm;
-            pc_updated = true;
-        }
+        taken = a == b;
         break;
 
     case INST_BNE:
-        if ((int32_t)(dev->regs[inst.rs1]) != (int32_t)(dev->regs[inst.rs2]))
-        {
-            dev->pc += inst.imm;
-            pc_updated = true;
-        }
+        taken = a != b;
         break;
 
     case INST_BLT:
-        if ((int32_t)(dev->regs[inst.rs1]) < (int32_t)(dev->regs[inst.rs2]))
-        {
-            dev->pc += inst.imm;
-            pc_updated = true;
-        }
+        taken = (int32_t)a < (int32_t)b;
         break;
 
     case INST_BGE:
-        if ((int32_t)(dev->regs[inst.rs1]) >= (int32_t)(dev->regs[inst.rs2]))
-        {
-            dev->pc += inst.imm;
-            pc_updated = true;
-        }
+        taken = (int32_t)a >= (int32_t)b;
         break;
 
     case INST_BLTU:
-        if (dev->regs[inst.rs1] < dev->regs[inst.rs2])
-        {
-            dev->pc += inst.imm;
-            pc_updated = true;
-        }
+        taken = a < b;
         break;
 
     case INST_BGEU:
-        if (dev->regs[inst.rs1] >= dev->regs[inst.rs2])
-        {
-            dev->pc += inst.imm;
-            pc_updated = true;
-        }
-        break;
-
-    case INST_JAL:
-        device_set_reg(dev, inst.rd, pc_ro + 4);
-        dev->pc += inst.imm;
-        pc_updated = true;
-        break;
-
-    case INST_JALR:
-        device_set_reg(dev, inst.rd, pc_ro + 4);
-        dev->pc = dev->regs[inst.rs1] + inst.imm;
-        pc_updated = true;
-        break;
-
-    case INST_LUI:
-        device_set_reg(dev, inst.rd, inst.imm << 12);
-        break;
-
-    case INST_AUIPC:
-        device_set_reg(dev, inst.rd, pc_ro + (inst.imm << 12));
-        break;
-
-    case INST_ECALL:
-        break;
-
-    case INST_BREAK:
+        taken = a >= b;
         break;
 
-    case INST_INVALID:
     default:
-        res = false;
-        break;
-
-    }
-
-    if (res && !pc_updated)
-    {
-        dev->pc += 4;
-    }
-
-    dev->regs[0] = 0;
-
-
-    if (res)
-    {
-        dev->inst_stats[inst.inst_id]++;
+        return false;
     }
 
-    return res;
+    return (taken ? addr + inst.imm : addr + 4) == dev->rom.origin + target * 4;
 }
 
 
-static const char *str_inst(uint32_t inst_id)
+/* Leave the block after the slice of a taken side exit ran: restore the
+   registers written by instructions that ran ahead of the branch and go
+   on from the exit */
+static void ilp_side_exit(device_t *dev, uint32_t target, uint32_t restore)
 {
-    const char* const STR_INST[] = 
+    for (restore &= ~1u; restore; restore &= restore - 1)
     {
-        "nop",
-        "add",
-        "sub",
-        "mul",
-        "xor",
-        "div",
-        "or",
-        "rem",
-        "and",
-        "remu",
-        "czero_nez",
-        "sll",
-        "mulh",
-        "srl",
-        "sra",
-        "divu",
-        "czero_eqz",
-        "slt",
-        "mulhsu",
-        "sltu",
-        "mulhu",
-        "addi",
-        "xori",
-        "ori",
-        "andi",
-        "slli",
-        "srli",
-        "srai",
-        "slti",
-        "sltiu",
-        "sb",
-        "sh",
-        "sw",
-        "lb",
-        "lh",
-        "lw",
-        "lbu",
-        "lhu",
-        "beq",
-        "bne",
-        "blt",
-        "bge",
-        "bltu",
-        "bgeu",
-        "jal",
-        "jalr",
-        "lui",
-        "auipc",
-        "ecall",
-        "break",
-        "wtf",
-    };
+        uint32_t r = __builtin_ctz(restore);
 
-    if (inst_id < NUM_INSTS)
-    {
-        return STR_INST[inst_id];
+        dev->regs[r] = dev->ilp_saved[r];
     }
 
-    return STR_INST[INST_INVALID];
+    dev->pc = dev->rom.origin + target * 4;
+    dev->ilp_cur_items = 0;
+    dev->ilp_n_exits++;
 }
 
 
-void device_printout_instruction_stats(device_t *dev)
+void device_printout_ilp_stats(device_t *dev)
 {
-    printf("Instruction stats:\n");
-    printf("{");
-
-    for (int i = 0; i < NUM_INSTS; i++)
+    if (!dev->ilp_threads_data)
     {
-        if ((i % 8) == 0)
-        {
-            printf("\n    ");
-        }
+        return;
+    }
 
-        printf("\"%s\": %llu", str_inst(i), dev->inst_stats[i]);
-        
-        if (i < NUM_INSTS - 1)
-        {
-            printf(", ");
-        }
-        else
-        {
-            printf("\n");
-        }
+    if (dev->ilp_lazy)
+    {
+        printf("ILP blocks sliced: %u, %u table words, %.3f ms\n",
+               dev->ilp_n_sliced, dev->ilp_table_len, dev->ilp_slicing_ns / 1e6);
     }
 
-    printf("}\n");
-}
+    printf("ILP slices: %lu, run in parallel: %lu (%.1f%%)\n",
+           dev->ilp_n_slices, dev->ilp_n_parallel,
+           dev->ilp_n_slices ? dev->ilp_n_parallel * 100.0 / dev->ilp_n_slices : 0.0);
+    printf("ILP side exits taken: %lu\n", dev->ilp_n_exits);
 
+    if (dev->ilp_simd)
+    {
+        printf("ILP vector ops: %lu (%s), %.2f lanes per op, %.3f lanes per slice\n",
+               dev->ilp_simd_groups, dev->ilp_simd_avx2 ? "AVX2" : "scalar",
+               dev->ilp_simd_groups ? (double)dev->ilp_simd_lanes / dev->ilp_simd_groups : 0.0,
+               dev->ilp_n_slices ? (double)dev->ilp_simd_lanes / dev->ilp_n_slices : 0.0);
+    }
 
-static void *ilp_thread_proc(void *arg)
-{
-    device_t *dev = (struct device_t*)((ilp_thread_data_t*)arg)->dev;
-    uint32_t id = ((ilp_thread_data_t*)arg)->thread_id;
-    uint32_t addr;
-    uint32_t inst;
+    if (!dev->ilp_slice_n[0])
+    {
+        return;
+    }
 
-    // for (;;)
-    // {
-    //     pthread_barrier_wait(&dev->ilp_barrier1);
+    /* Timings of the last calibration round against running serially */
+    double serial_ns = (double)dev->ilp_slice_ns[0] / dev->ilp_slice_n[0];
 
-    //     pthread_barrier_wait(&dev->ilp_barrier2);
-    // }
+    for (uint32_t i = 0; i < ILP_MAX_CANDIDATES && dev->ilp_slice_n[i]; i++)
+    {
+        double ns = (double)dev->ilp_slice_ns[i] / dev->ilp_slice_n[i];
+        uint32_t workers = ilp_candidate_workers(dev, i);
 
-    return NULL;
+        printf("  %u workers: %.1f ns per slice, speedup %.2fx%s\n",
+               workers, ns, serial_ns / ns,
+               workers == dev->ilp_workers ? " (used)" : "");
+    }
 }
 
 
-#define SINGLE_THREADED 1
-
-bool device_run_cycle(device_t *dev)
+/* Run a cycle of at most max_insts instructions and count them in n_insts:
+   one instruction, or with an ILP table the next slice of the current
+   block. A slice cut short goes on from where it stopped next time */
+static bool run_cycle(device_t *dev, uint64_t max_insts, uint32_t *n_insts)
 {
-    uint32_t addr, inst;
+    uint32_t inst;
     bool res = true;
 
+    *n_insts = 1;
+
     if (dev->ilp_cur_items == 0 && dev->ilp_map != NULL)
     {
         uint32_t b_id = (dev->pc - dev->rom.origin) >> 2;
         
         if (b_id < dev->ilp_n_blocks)
         {
-            dev->ilp_cur_id = dev->ilp_map[b_id].offset >> 2;
-            dev->ilp_cur_items = dev->ilp_map[b_id].size >> 2;
-        }
+            if (dev->ilp_lazy && !dev->ilp_map[b_id].size && !ilp_slice_block(dev, b_id))
+            {
+                return false;
+            }
 
+            dev->ilp_cur_id = dev->ilp_map[b_id].offset;
+            dev->ilp_cur_items = dev->ilp_map[b_id].size;
+        }
     }
 
-    bool slice_end = false;
-
     if (dev->ilp_cur_items)
     {
-        for (int i = 0; i < dev->ilp_n_threads; i++)
+        uint32_t slice_id = dev->ilp_cur_id;
+        uint32_t slice_items = dev->ilp_cur_items;
+        uint32_t n_slice = 0;
+        uint32_t exit_branch = 0;
+        uint32_t exit_target = 0;
+        uint32_t exit_restore = 0;
+        bool side_exit = false;
+
+        /* Tables are checked when loaded, slices fit in ilp_slice */
+        while (dev->ilp_cur_items)
         {
-            if (!slice_end)
+            const uint32_t *words = &dev->ilp_table[dev->ilp_cur_id];
+            uint32_t inst_id = words[0];
+            uint32_t n_words = inst_id == ILP_SLICE_EXIT ? 4 :
+                               inst_id == ILP_BLOCK_SAVE ? 2 : 1;
+
+            dev->ilp_cur_id += n_words;
+            dev->ilp_cur_items -= n_words;
+
+            if (inst_id == ILP_SLICE_END)
             {
-                addr = dev->ilp_table[dev->ilp_cur_id];
-                dev->ilp_cur_id++;
-                dev->ilp_cur_items--;
-                slice_end = addr == 0x0;
+                break;
             }
 
-            dev->ilp_slice[i] = addr;
+            if (inst_id == ILP_BLOCK_SAVE)
+            {
+                for (uint32_t m = words[1] & ~1u; m; m &= m - 1)
+                {
+                    uint32_t r = __builtin_ctz(m);
+
+                    dev->ilp_saved[r] = dev->regs[r];
+                }
+
+                slice_id = dev->ilp_cur_id;
+                slice_items = dev->ilp_cur_items;
+            }
+            else if (inst_id == ILP_SLICE_EXIT)
+            {
+                exit_branch = words[1];
+                exit_target = words[2];
+                exit_restore = words[3];
+                side_exit = true;
+            }
+            else
+            {
+                dev->ilp_slice[n_slice++] = inst_id;
+            }
         }
 
-        if (!slice_end && dev->ilp_cur_items)
+        /* The rest of a slice doesn't depend on the part that already ran,
+           nor does its side exit */
+        uint32_t first = dev->ilp_cur_done;
+        uint32_t n_run = n_slice - first;
+
+        if (n_run > max_insts)
         {
-            dev->ilp_cur_id++;
-            dev->ilp_cur_items--;
+            n_run = max_insts;
         }
 
-#ifdef SINGLE_THREADED
-        
-        for (int i = 0; i < dev->ilp_n_threads; i++)
+        side_exit = side_exit && ilp_exit_taken(dev, exit_branch, exit_target);
+        res = ilp_run_slice(dev, dev->ilp_slice + first, n_run);
+        *n_insts = n_run;
+
+        if (first + n_run < n_slice)
+        {
+            dev->ilp_cur_id = slice_id;
+            dev->ilp_cur_items = slice_items;
+            dev->ilp_cur_done = first + n_run;
+        }
+        else
         {
-            addr = dev->ilp_slice[i];
+            dev->ilp_cur_done = 0;
 
-            if (addr)
+            if (res && side_exit)
             {
-                if (dev->uinsts && (addr <= dev->prog_end))
-                {
-                    uint32_t inst_id = (addr - dev->rom.origin) / 4;
-                    res = res && device_run_unpacked_instruction(dev, dev->uinsts[inst_id], addr);
-                }
-                else
-                {
-                    if (!device_read(dev, addr, (uint8_t*)&inst, sizeof(inst)))
-                    {
-                        return false;
-                    }
-
-                    res = res && device_run_instruction(dev, inst, addr);
-                }
+                ilp_side_exit(dev, exit_target, exit_restore);
             }
         }
-#else
-
-        // pthread_barrier_wait(&dev->ilp_barrier1);
-        // pthread_barrier_wait(&dev->ilp_barrier2);
-
-#endif
     }
     else
     {
-        if (dev->uinsts && (dev->pc <= dev->prog_end))
+        if (dev->uhandlers)
+        {
+            res = device_run_threaded(dev, 1, NULL) != RUN_FAULT;
+        }
+        else if (dev->uinsts && (dev->pc <= dev->prog_end))
         {
             uint32_t inst_id = (dev->pc - dev->rom.origin) / 4;
+
+            if (dev->uinsts[inst_id].inst_id == INST_UNDECODED)
+            {
+                decode_slot(dev, inst_id);
+            }
+
             res = device_run_unpacked_instruction(dev, dev->uinsts[inst_id], dev->pc);
         }
         else
@@ -1359,3 +7012,95 @@ bool device_run_cycle(device_t *dev)
 
     return res;
 }
+
+
+bool device_run_cycle(device_t *dev)
+{
+    uint32_t n_insts;
+
+    return run_cycle(dev, UINT64_MAX, &n_insts);
+}
+
+
+static uint64_t run_budget(device_t *dev, uint64_t budget, run_reason_t *reason)
+{
+    uint64_t n_done = 0;
+
+    if (dev->uhandlers && !dev->ilp_map)
+    {
+        *reason = device_run_threaded(dev, budget, &n_done);
+        return n_done;
+    }
+
+    /* No threaded code to run, step through the program cycle by cycle */
+    *reason = RUN_BUDGET_EXHAUSTED;
+    dev->watch_written = false;
+
+    while (n_done < budget)
+    {
+        /* In the middle of an ILP block the pc only sums up increments */
+        if (dev->pc == dev->exit_addr && !dev->ilp_cur_items)
+        {
+            *reason = RUN_EXIT_REACHED;
+            break;
+        }
+
+        uint32_t n_insts;
+
+        if (!run_cycle(dev, budget - n_done, &n_insts))
+        {
+            *reason = RUN_FAULT;
+            break;
+        }
+
+        n_done += n_insts;
+
+        if (dev->watch_written)
+        {
+            dev->watch_written = false;
+
+            if (dev->events)
+            {
+                *reason = RUN_MMIO_WRITTEN;
+                break;
+            }
+        }
+    }
+
+    return n_done;
+}
+
+
+uint64_t device_run(device_t *dev, uint64_t budget, run_reason_t *reason)
+{
+    if (!dev->prof_interval)
+    {
+        return run_budget(dev, budget, reason);
+    }
+
+    /* Run up to the next profiler sample at a time */
+    uint64_t n_done = 0;
+
+    do
+    {
+        uint64_t chunk = budget - n_done;
+
+        if (chunk > dev->prof_countdown)
+        {
+            chunk = dev->prof_countdown;
+        }
+
+        uint64_t n = run_budget(dev, chunk, reason);
+
+        n_done += n;
+        dev->prof_countdown -= n;
+
+        if (!dev->prof_countdown)
+        {
+            prof_sample(dev);
+        }
+    }
+    while (*reason == RUN_BUDGET_EXHAUSTED && n_done < budget);
+
+    return n_done;
+}
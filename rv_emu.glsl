@@ -25,68 +25,66 @@ struct cpu_t
     uint periph[16];
 };
 
-struct uinst_t
+/* Packed instruction, see cinst_t in rv_emu.h */
+struct cinst_t
 {
-    uint inst_id;
-    uint rd;
-    uint rs1;
-    uint rs2;
+    uint op;
     int  imm;
 };
 
 
-#define INST_NOP           0
-#define INST_ADD           1
-#define INST_SUB           2
-#define INST_MUL           3
-#define INST_XOR           4
-#define INST_DIV           5
-#define INST_OR            6
-#define INST_REM           7
-#define INST_AND           8
-#define INST_REMU          9
-#define INST_CZERO_NEZ     10
-#define INST_SLL           11
-#define INST_MULH          12
-#define INST_SRL           13
-#define INST_SRA           14
-#define INST_DIVU          15
-#define INST_CZERO_EQZ     16
-#define INST_SLT           17
-#define INST_MULHSU        18
-#define INST_SLTU          19
-#define INST_MULHU         20
-#define INST_ADDI          21
-#define INST_XORI          22
-#define INST_ORI           23
-#define INST_ANDI          24
-#define INST_SLLI          25
-#define INST_SRLI          26
-#define INST_SRAI          27
-#define INST_SLTI          28
-#define INST_SLTIU         29
-#define INST_SB            30
-#define INST_SH            31
-#define INST_SW            32
-#define INST_LB            33
-#define INST_LH            34
-#define INST_LW            35
-#define INST_LBU           36
-#define INST_LHU           37
-#define INST_BEQ           38
-#define INST_BNE           39
-#define INST_BLT           40
-#define INST_BGE           41
-#define INST_BLTU          42
-#define INST_BGEU          43
-#define INST_JAL           44
-#define INST_JALR          45
-#define INST_LUI           46
-#define INST_AUIPC         47
-#define INST_ECALL         48
-#define INST_BREAK         49
-#define INST_INVALID       50
-#define NUM_INSTS          51
+#define INST_NOP           1
+#define INST_ADD           2
+#define INST_SUB           3
+#define INST_MUL           4
+#define INST_XOR           5
+#define INST_DIV           6
+#define INST_OR            7
+#define INST_REM           8
+#define INST_AND           9
+#define INST_REMU          10
+#define INST_CZERO_NEZ     11
+#define INST_SLL           12
+#define INST_MULH          13
+#define INST_SRL           14
+#define INST_SRA           15
+#define INST_DIVU          16
+#define INST_CZERO_EQZ     17
+#define INST_SLT           18
+#define INST_MULHSU        19
+#define INST_SLTU          20
+#define INST_MULHU         21
+#define INST_ADDI          22
+#define INST_XORI          23
+#define INST_ORI           24
+#define INST_ANDI          25
+#define INST_SLLI          26
+#define INST_SRLI          27
+#define INST_SRAI          28
+#define INST_SLTI          29
+#define INST_SLTIU         30
+#define INST_SB            31
+#define INST_SH            32
+#define INST_SW            33
+#define INST_LB            34
+#define INST_LH            35
+#define INST_LW            36
+#define INST_LBU           37
+#define INST_LHU           38
+#define INST_BEQ           39
+#define INST_BNE           40
+#define INST_BLT           41
+#define INST_BGE           42
+#define INST_BLTU          43
+#define INST_BGEU          44
+#define INST_JAL           45
+#define INST_JALR          46
+#define INST_LUI           47
+#define INST_AUIPC         48
+#define INST_ECALL         49
+#define INST_BREAK         50
+#define INST_INVALID       51
+#define NUM_INSTS          52
 
 
 layout (std430, binding = 1) buffer rv_cpus_layout
@@ -104,9 +102,9 @@ layout (std430, binding = 3) buffer rv_ram_layout
     uint ram[];
 };
 
-layout (std430, binding = 4) readonly buffer rv_uinsts_layout
+layout (std430, binding = 4) readonly buffer rv_cinsts_layout
 {
-    uinst_t uinsts[];
+    cinst_t cinsts[];
 };
 
 uniform uint n_cycles;
@@ -922,14 +920,15 @@ bool run_unpacked_instruction(in uint dev_id)
 
     uint inst_idx = (cpus[dev_id].pc - 0x08000000) >> 2;
 
-    uint rd = uinsts[inst_idx].rd;
-    uint rs1val = cpus[dev_id].regs[uinsts[inst_idx].rs1];
-    uint rs2val = cpus[dev_id].regs[uinsts[inst_idx].rs2];
-    int  imm = uinsts[inst_idx].imm;
+    uint op = cinsts[inst_idx].op;
+    uint rd = (op >> 8) & 0x1f;
+    uint rs1val = cpus[dev_id].regs[(op >> 16) & 0x1f];
+    uint rs2val = cpus[dev_id].regs[(op >> 24) & 0x1f];
+    int  imm = cinsts[inst_idx].imm;
     uint addr = rs1val + imm;
     uint data;
 
-    switch (uinsts[inst_idx].inst_id)
+    switch (op & 0xff)
     {
     case INST_LW:
         res = device_read_word(dev_id, addr, data);
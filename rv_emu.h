@@ -11,6 +11,10 @@
 
 enum
 {
+    /* Pre-unpacked slot decoded on its first execution. Zero, so slots of
+       freshly mapped memory are undecoded without being written */
+    INST_UNDECODED,
+
     INST_NOP,
 
     INST_ADD,
@@ -65,10 +69,28 @@ enum
 
     INST_INVALID,
 
+    /* Fused pairs, only dispatched by the threaded interpreter */
+    INST_LUI_ADDI,
+    INST_AUIPC_JALR,
+    INST_SLLI_ADD,
+    INST_ADDI_BNEZ,
+    INST_LW_ADDI,
+    INST_SW_ADDI,
+
     NUM_INSTS,
 };
 
 
+typedef enum
+{
+    RUN_BUDGET_EXHAUSTED,   /* Executed the requested number of instructions */
+    RUN_EXIT_REACHED,       /* The program is about to execute _exit */
+    RUN_MMIO_WRITTEN,       /* A watched peripheral register raised events */
+    RUN_FAULT,              /* Invalid instruction or memory access */
+
+} run_reason_t;
+
+
 typedef struct
 {
     uint32_t origin;
@@ -78,9 +100,83 @@ typedef struct
 } mem_t;
 
 
+/* Guest range whose stores raise host event bits */
+#define DEV_MAX_WATCHES 8
+
+typedef struct
+{
+    uint32_t origin;
+    uint32_t size;
+    uint32_t events;
+
+} watch_t;
+
+
+/* Guest memory is looked up through a table of 4KB pages */
+#define DEV_PAGE_SHIFT 12
+#define DEV_PAGE_SIZE  (1u << DEV_PAGE_SHIFT)
+#define DEV_NUM_PAGES  (1u << (32 - DEV_PAGE_SHIFT))
+#define DEV_MAX_MMIO   64
+
+/* MMIO callbacks get the offset from the origin the handler was mapped at */
+typedef bool (*mmio_read_t)(void *ctx, uint32_t offset, uint8_t *data, uint32_t size);
+typedef bool (*mmio_write_t)(void *ctx, uint32_t offset, const uint8_t *data, uint32_t size);
+
+typedef struct mmio_t
+{
+    uint32_t origin;        /* Part of the page covered by this handler */
+    uint32_t size;
+    uint32_t base;          /* Origin the handler was mapped at */
+    mmio_read_t read;
+    mmio_write_t write;
+    void *ctx;
+    struct mmio_t *next;    /* Next handler sharing the page */
+
+} mmio_t;
+
+
+typedef struct
+{
+    uint8_t *data;          /* Host memory backing the whole page or NULL */
+    mmio_t *mmio;           /* Handlers of a page that isn't plain memory */
+
+} page_t;
+
+
+/* Distinct call chain recorded by the profiler */
+typedef struct
+{
+    uint32_t hash;
+    uint32_t depth;
+    uint32_t frames;        /* First function address in stack_frames */
+    uint64_t count;
+
+} stack_sample_t;
+
+
+/* Function symbol of the loaded program */
 typedef struct
 {
     uint32_t addr;
+    uint32_t size;
+    const char *name;
+
+} symbol_t;
+
+
+/* Slices of the ILP block starting at an instruction, as a range of
+   ilp_table entries. Slices list instruction indices from the ROM origin
+   and end with ILP_SLICE_END. Blocks are superblocks: a branch inside one
+   is a side exit, its slice starts with ILP_SLICE_EXIT followed by the
+   branch, the index the block is left for when it goes that way and the
+   mask of registers to restore. These are kept at the block entry as
+   given by ILP_BLOCK_SAVE and a mask, the first words of the block */
+#define ILP_SLICE_END  0xFFFFFFFFu
+#define ILP_SLICE_EXIT 0xFFFFFFFEu
+#define ILP_BLOCK_SAVE 0xFFFFFFFDu
+
+typedef struct
+{
     uint32_t offset;
     uint32_t size;
 
@@ -89,10 +185,10 @@ typedef struct
 
 typedef struct
 {
-    struct device_t *dev;
-    uint32_t thread_id;
+    uint32_t site;
+    uint32_t next;
 
-} ilp_thread_data_t;
+} jit_patch_t;
 
 
 typedef struct
@@ -106,6 +202,55 @@ typedef struct
 } uinst_t;
 
 
+/* Packed form of uinst_t used by the threaded interpreter and the GPU:
+   op holds inst_id[7:0], rd[15:8], rs1[23:16] and rs2[31:24] */
+typedef struct
+{
+    uint32_t op;
+    int32_t imm;
+
+} cinst_t;
+
+#define CINST_ID(c)  ((c)->op & 0xff)
+#define CINST_RD(c)  (((c)->op >> 8) & 0xff)
+#define CINST_RS1(c) (((c)->op >> 16) & 0xff)
+#define CINST_RS2(c) ((c)->op >> 24)
+
+
+/* Instruction of an ILP slice handed to a worker */
+typedef struct
+{
+    uinst_t  inst;
+    uint32_t addr;
+
+} ilp_item_t;
+
+
+/* Share of a slice run by one thread, on cache lines of its own */
+typedef struct
+{
+    struct device_t *dev;
+    uint32_t thread_id;
+    ilp_item_t *items;
+    uint32_t n_items;
+    uint32_t epoch;         /* Epoch the items were handed out for */
+    uint32_t pc_delta;      /* Sum of the pc increments of the items */
+    bool     ok;
+
+} __attribute__((aligned(64))) ilp_thread_data_t;
+
+
+/* Workers wait for 'epoch' to change, run their share and count themselves
+   in 'n_done'. Both counters are padded to separate cache lines */
+typedef struct
+{
+    volatile uint32_t epoch __attribute__((aligned(64)));
+    volatile uint32_t n_done __attribute__((aligned(64)));
+    volatile bool     quit __attribute__((aligned(64)));
+
+} ilp_sync_t;
+
+
 typedef struct
 {
     uint32_t regs[32];
@@ -116,23 +261,168 @@ typedef struct
     mem_t ram;
     mem_t periph;
 
+    page_t   *pages;
+    mmio_t   mmio[DEV_MAX_MMIO];
+    uint32_t n_mmio;
+    bool     host_mmio;     /* Set by device_map_mmio() */
+
+    /* Stores to the watched ranges set their bits in 'events', which the
+       host checks and clears whenever device_run() stops on them */
+    uint32_t watch_origin;
+    uint32_t watch_size;
+    bool     watch_written;
+    uint32_t events;
+    watch_t  watches[DEV_MAX_WATCHES];
+    uint32_t n_watches;
+
+    /* 4GB host reservation with rom, ram and periph mapped at their guest
+       origins, see device_use_flat_memory() */
+    uint8_t       *flat;
+    volatile bool flat_fault;
+    uint32_t      flat_n_fault_pages;
+    uint8_t       *flat_fault_pages[2];
+
+    /* Memory and registers saved by device_checkpoint(), along with where
+       it stopped in an ILP block. ckpt_dirty lists the guest pages written
+       since, caught by write protection */
+    uint8_t           *ckpt_data[3];
+    uint32_t          ckpt_regs[32];
+    uint32_t          ckpt_pc;
+    uint32_t          ckpt_ilp_id;
+    uint32_t          ckpt_ilp_items;
+    uint32_t          ckpt_ilp_done;
+    uint32_t          ckpt_ilp_saved[32];
+    uint32_t          *ckpt_dirty;
+    volatile uint32_t ckpt_n_dirty;
+    uint32_t          ckpt_max_dirty;
+
+    /* Huge pages for the RAM and the decoded program, see
+       device_use_huge_pages() */
+    bool     huge_pages;
+
+    /* Function symbols from the ELF .symtab, sorted by address and by name */
+    symbol_t *symbols;
+    symbol_t *sym_by_name;
+    uint32_t n_symbols;
+    char     *sym_names;
+
+    /* Guest pc sampled every prof_interval instructions on average,
+       see device_start_profiler() */
+    uint32_t prof_interval;
+    uint32_t prof_countdown;
+    uint32_t prof_seed;
+    uint64_t *prof_samples;     /* One counter per instruction up to prog_end */
+    uint64_t prof_other;        /* Samples outside of the program */
+
+    /* Shadow call stack, see device_track_calls(). Profiler samples count
+       the call chains in a hash table of stack_samples */
+    bool     track_calls;
+    uint32_t *call_stack;       /* Callee addresses */
+    uint32_t call_depth;
+    uint32_t call_root;
+    stack_sample_t *stack_samples;
+    uint32_t n_stack_samples;
+    uint32_t stack_samples_size;
+    uint32_t *stack_frames;
+    uint32_t n_stack_frames;
+    uint32_t stack_frames_size;
+
     uint32_t prog_end;
+    uint64_t elf_hash;      /* Identifies the loaded image, hashed on first
+                               use from the ELF file still mapped at
+                               elf_image */
+    uint8_t  *elf_image;
+    size_t   elf_image_size;
     uinst_t *uinsts;
+    cinst_t *cinsts;
+    uint8_t  *decode_cache; /* Mapping uinsts and cinsts live in when loaded
+                               by device_load_decode_cache() */
+    size_t   decode_cache_size;
+    const void **uhandlers;
+    const void *handlers[NUM_INSTS + 1];    /* Dispatch table incl. _exit */
+    bool     fuse;          /* Fuse pairs as slots get decoded */
+
+    /* Decoded code outside of the pre-unpacked range, one entry per page
+       filled on first execution. code_pages flags every page that holds
+       decoded instructions, stores to them invalidate the entries */
+    uint8_t  *code_pages;
+    void     **dcache;
 
     uint32_t          ilp_n_blocks;
     uint32_t          ilp_n_threads;
     uint32_t          ilp_cur_id;
     uint32_t          ilp_cur_items;
+    uint32_t          ilp_cur_done;     /* Instructions of the slice at
+                                           ilp_cur_id run before a budget
+                                           ran out in the middle of it */
 
     ilp_entry_t       *ilp_map;
     uint32_t          *ilp_table;
 
+    /* Registers at the entry of the current block, restored by a side
+       exit for the instructions that ran ahead of it */
+    uint32_t          ilp_saved[32];
+    uint64_t          ilp_n_exits;
+
+    /* Mapped ILP file holding ilp_map and ilp_table, if loaded from one */
+    uint8_t           *ilp_file;
+    size_t            ilp_file_size;
+
+    /* Set by device_slice_ilp(): blocks with an empty ilp_map entry are
+       sliced on their first execution and appended to ilp_table */
+    bool              ilp_lazy;
+    uint32_t          ilp_table_len;
+    uint32_t          ilp_table_cap;
+    uint32_t          ilp_n_sliced;
+    uint64_t          ilp_slicing_ns;
+
+    /* Slices with enough instructions are spread over ilp_workers of the
+       ilp_n_workers threads, plus the calling one. ilp_workers is picked
+       by timing slices with every candidate count now and then, 0 runs
+       them serially. ilp_threads_data[0] is the calling thread's share */
     pthread_t         *ilp_threads;
     ilp_thread_data_t *ilp_threads_data;
     uint32_t          *ilp_slice;
-    pthread_barrier_t ilp_barrier1;
-    pthread_barrier_t ilp_barrier2;
-
+    uint32_t          ilp_n_workers;
+    uint32_t          ilp_workers;
+    ilp_sync_t        ilp_sync;
+
+    uint32_t          ilp_calib_candidate;
+    uint32_t          ilp_calib_left;
+    uint64_t          ilp_calib_ns;
+    uint64_t          ilp_slice_ns[8];  /* Per candidate, last calibration */
+    uint32_t          ilp_slice_n[8];
+    uint64_t          ilp_n_slices;
+    uint64_t          ilp_n_parallel;
+
+    /* Set by device_use_ilp_simd() */
+    bool              ilp_simd;
+    bool              ilp_simd_avx2;
+    uint64_t          ilp_simd_groups;
+    uint64_t          ilp_simd_lanes;
+
+    /* x86-64 translation of hot basic blocks, enabled by setting 'jit'
+       before device_run(). Translated code does not update inst_stats. */
+    bool              jit;
+    uint8_t           *jit_code;
+    uint32_t          jit_code_size;
+    uint32_t          jit_code_used;
+    uint32_t          jit_code_start;
+    void              **jit_blocks;
+    uint16_t          *jit_counts;
+    int64_t           jit_budget;
+
+    uint32_t          *jit_patch_heads;
+    jit_patch_t       *jit_patches;
+    uint32_t          jit_n_patches;
+    uint32_t          jit_max_patches;
+
+    /* Executed instruction counts, only updated while device_set_inst_stats()
+       has them enabled. -DRV_NO_INST_STATS compiles the counting out.
+       The threaded interpreter counts entries to the pre-unpacked code in
+       block_counts, they are added to inst_stats when reported */
+    bool     stats;
+    uint64_t *block_counts;
     uint64_t inst_stats[NUM_INSTS];
 
 } device_t;
@@ -186,6 +476,20 @@ typedef struct
 } sec_hdr_t;
 
 
+typedef struct
+{
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+
+} prog_hdr_t;
+
+
 typedef struct
 {
     uint32_t name;
@@ -204,14 +508,41 @@ void device_init(device_t *dev,
                  uint32_t periph_size, uint32_t periph_origin);
 bool device_load_from_elf(device_t *dev, const char *elf_file_name);
 bool device_load_ilp_table(device_t *dev, const char *ilp_file_name);
+bool device_slice_ilp(device_t *dev, uint32_t max_slice_len);
+void device_printout_ilp_stats(device_t *dev);
+bool device_use_ilp_simd(device_t *dev, bool enable);
+void device_ilp_forked(device_t *dev);
 void device_uninit(device_t *dev);
+bool device_map_memory(device_t *dev, uint32_t origin, uint32_t size, uint8_t *data);
+bool device_map_mmio(device_t *dev, uint32_t origin, uint32_t size,
+                     mmio_read_t read, mmio_write_t write, void *ctx);
 bool device_write(device_t *dev, uint32_t addr, const uint8_t *data, uint32_t size);
 bool device_read(device_t *dev, uint32_t addr, uint8_t *data, uint32_t size);
+bool device_save_snapshot(device_t *dev, const char *file_name);
+bool device_load_snapshot(device_t *dev, const char *file_name);
+bool device_checkpoint(device_t *dev);
+bool device_reset_to_checkpoint(device_t *dev);
 void device_set_reg(device_t *dev, int rd, uint32_t val);
 bool device_run_instruction(device_t *dev, uint32_t inst, uint32_t pc_ro);
 bool device_run_cycle(device_t *dev);
+uint64_t device_run(device_t *dev, uint64_t budget, run_reason_t *reason);
+bool device_watch_mmio(device_t *dev, uint32_t origin, uint32_t size, uint32_t events);
+bool device_use_flat_memory(device_t *dev);
+bool device_use_huge_pages(device_t *dev);
 bool device_pre_unpack_instructions(device_t *dev);
+bool device_lazy_unpack_instructions(device_t *dev);
+bool device_load_decode_cache(device_t *dev, const char *file_name);
+bool device_save_decode_cache(device_t *dev, const char *file_name);
+uint32_t device_fuse_instructions(device_t *dev);
+bool device_set_stop_addr(device_t *dev, uint32_t addr);
+bool device_set_inst_stats(device_t *dev, bool enable);
 void device_printout_instruction_stats(device_t *dev);
+const symbol_t *device_find_symbol(device_t *dev, uint32_t addr);
+const symbol_t *device_find_symbol_by_name(device_t *dev, const char *name);
+bool device_start_profiler(device_t *dev, uint32_t interval);
+void device_printout_profile(device_t *dev);
+bool device_track_calls(device_t *dev, bool enable);
+bool device_save_folded_stacks(device_t *dev, const char *file_name);
 
 
 #endif
\ No newline at end of file
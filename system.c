@@ -10,6 +10,8 @@ static char *current_break = NULL;
 
 #define TX_DATA ((char*)SERIAL_TX_DATA_ADDR)
 #define TX_FLAG ((char*)SERIAL_TX_FLAG_ADDR)
+#define RX_DATA ((volatile char*)SERIAL_RX_DATA_ADDR)
+#define RX_FLAG ((volatile char*)SERIAL_RX_FLAG_ADDR)
 
 void *_sbrk_r(void *reent_ptr, int nbytes)
 {
@@ -32,6 +34,21 @@ void _putchar(char c)
 }
 
 
+/* Next byte of the serial input, -1 once there is none */
+int _getchar(void)
+{
+    if (!RX_FLAG[0])
+    {
+        return -1;
+    }
+
+    char c = RX_DATA[0];
+    RX_FLAG[0] = 0;
+
+    return (unsigned char)c;
+}
+
+
 int puts(const char *str)
 {
     int idx = 0;
@@ -23,6 +23,7 @@
 #define DISP_FLUSH() (((volatile char*)(DISP_VSYNC_FLAG_ADDR))[0] = 1)
 
 void _putchar(char c);
+int _getchar(void);
 int puts(const char* str);
 
 
@@ -1,5 +1,5 @@
 
-from struct import unpack, pack
+from struct import unpack, pack, calcsize
 from dataclasses import dataclass
 import sys
 
@@ -44,6 +44,25 @@ class SecHdr:
 ELF_HDR_SIZE = 52
 SEC_HDR_SIZE = 40
 
+# ILP file, see ilp_file_hdr_t in rv_emu.c
+ILP_MAGIC = 0x4C495652      # "RVIL"
+ILP_VERSION = 3
+ILP_HDR_FMT = '<IIIIQIIIIII'
+ILP_SLICE_END = 0xFFFFFFFF
+ILP_SLICE_EXIT = 0xFFFFFFFE
+ILP_BLOCK_SAVE = 0xFFFFFFFD
+
+def fnv1a(data, bits):
+    if bits == 64:
+        h, prime = 14695981039346656037, 1099511628211
+    else:
+        h, prime = 2166136261, 16777619
+    mask = (1 << bits) - 1
+    for b in data:
+        h = ((h ^ b) * prime) & mask
+    return h
+
+
 def twocomp(val, n_bits):
     if val & (1 << (n_bits - 1)):
         return val - (1 << n_bits)
@@ -51,25 +70,28 @@ def twocomp(val, n_bits):
 
 
 class MLoc:
+    '''
+    Memory byte at an offset from a base register. Equal only to the same
+    byte through the same base, see Program.conflict() for other bases.
+    '''
 
     def __init__(self, reg, offset):
         self.val = (reg, offset)
 
 
     def __hash__(self):
-        return 42
+        return hash(self.val[0])
 
 
     def __eq__(self, other):
         if not isinstance(other, MLoc):
-            return False 
-        if self.val[0] == other.val[0]:
-            return self.val[1] == other.val[1]
-        else:
-            return True
+            return False
+        return self.val == other.val
 
 
-PC_REG = 32
+def mem_bases(locs):
+    return {loc.val[0] for loc in locs if isinstance(loc, MLoc)}
+
 
 class Program:
 
@@ -77,33 +99,62 @@ class Program:
     rom_size = 1024 * 1024 * 10
     prog_end = 0x08000000
     max_slice_len = 8
+    max_trace_len = 256
+    max_side_exits = 8
 
     def __init__(self, elf_file_name):
         self.rom = bytearray(self.rom_size)
-        self.basic_blocks = {}
+        self.entry = self.rom_start
+        self.functions = set()
+        self.exit_addr = None
 
         self.load_from_elf(elf_file_name)
-        self.find_all_basic_blocks()
-        self.slice_all_basic_blocks()
+        self.find_all_superblocks()
+        self.slice_all_superblocks()
 
 
     def load_from_elf(self, elf_file_name):
+        with open(elf_file_name, 'rb') as elf:
+            self.elf_hash = fnv1a(elf.read(), 64)
+
         elf = open(elf_file_name, 'rb')
         hdr_bytes = elf.read(ELF_HDR_SIZE)
         hdr = ElfHdr(*unpack('4sBBBBB7sHHIIIIIHHHHHH', hdr_bytes))
 
+        self.entry = hdr.entry
         elf.seek(hdr.shoff)
+        sections = []
         sectable = []
 
         for ns in range(hdr.shnum):
             sec_hdr_bytes = elf.read(SEC_HDR_SIZE)
             sec_hdr = SecHdr(*unpack('IIIIIIIIII', sec_hdr_bytes))
+            sections.append(sec_hdr)
                 
             # if PROGBITS
             if sec_hdr.type_ == 1 and \
                     (0 <= (sec_hdr.addr - self.rom_start) <= self.rom_size):
                 sectable.append(sec_hdr)
 
+        # Functions may be reached through jalr, and _exit ends traces as
+        # it ends runs
+        for sec_hdr in sections:
+            if sec_hdr.type_ == 2 and sec_hdr.link < len(sections): # SYMTAB
+                strtab = sections[sec_hdr.link]
+                elf.seek(strtab.offset)
+                names = elf.read(strtab.size)
+                elf.seek(sec_hdr.offset)
+                symbols = elf.read(sec_hdr.size)
+
+                for off in range(0, len(symbols) - 15, 16):
+                    name, value, _, info, _, _ = unpack('<IIIBBH', symbols[off:off + 16])
+                    if info & 0x0f != 2: # STT_FUNC
+                        continue
+                    self.functions.add(value)
+                    if names[name:names.find(b'\0', name)] == b'_exit':
+                        self.exit_addr = value
+                break
+
         for sec_hdr in sectable:
             if sec_hdr.flags & 0x04: # if executable
                 sec_end = sec_hdr.addr + sec_hdr.size
@@ -117,70 +168,172 @@ class Program:
         elf.close()
 
 
-    def find_basic_block(self, pc):
+    def find_superblock(self, pc):
         '''
-        Determine a block of consequent instructions starting from pc with 
-        no branching ops, i.e. a basic block. JAL is not considered a branching
-        operation, while JALR is.
-
-        Return: a list of instructions and its dependencies of a basic block,
-                and a set of starting locations of adjacent blocks.
+        Determine a superblock starting from pc: a trace of instructions
+        following JAL and the expected direction of conditional branches,
+        i.e. backward branches taken and forward ones falling through.
+        A conditional branch inside the trace is a side exit. The trace
+        ends at JALR, at a jump back into it, before _exit, after
+        max_side_exits side exits or max_trace_len instructions.
+
+        Return: a list of instructions with their dependencies and the
+                address the trace is left for when their side exit is
+                taken, None for instructions that are not side exits,
+                and the address the trace goes on at.
         '''
-        start = pc
-        bblock = []
-        heads = set()
+        trace = []
         locs = set()
+        n_exits = 0
 
         while True:
             reads, writes, branch, next_pc = self.decode_inst(pc)
-            if next_pc in locs:
-                break
-            bblock.append((pc, reads, writes))
+            opcode = self.get_inst(pc) & 0b1111111
+            exit_pc = None
+
+            if opcode == 0b1100011:
+                if next_pc > pc:
+                    exit_pc, next_pc = next_pc, pc + 4
+                else:
+                    exit_pc = pc + 4
+
+            trace.append((pc, reads, writes, exit_pc))
             locs.add(pc)
-            
-            if ((next_pc - pc) != 4) or branch:
-                heads.add(pc + 4)
-                heads.add(next_pc)
-            if branch:
+
+            if opcode == 0b1100111 or next_pc in locs or \
+                    next_pc == self.exit_addr or \
+                    not (self.rom_start <= next_pc < self.prog_end) or \
+                    len(trace) == self.max_trace_len:
                 break
+
+            if exit_pc is not None:
+                if n_exits == self.max_side_exits or \
+                        not (self.rom_start <= exit_pc < self.prog_end):
+                    break
+                n_exits += 1
+
             pc = next_pc
 
-        heads_ = set([h for h in heads if h < self.prog_end])
+        # The last instruction runs alone and may branch either way
+        pc, reads, writes, _ = trace[-1]
+        trace[-1] = (pc, reads, writes, None)
+
+        return trace, next_pc
+
 
-        return bblock, heads_
+    def find_heads(self):
+        '''
+        Addresses control reaches other than by falling through: the entry
+        point, functions, targets of jumps and branches, and the
+        instructions after them, where branches fall through and calls
+        return to.
+        '''
+        heads = {self.entry} | self.functions
+
+        for pc in range(self.rom_start, self.prog_end, 4):
+            opcode = self.get_inst(pc) & 0b1111111
+
+            if opcode in (0b1100011, 0b1101111): # branches, jal
+                heads.add(self.decode_inst(pc)[3])
+                heads.add(pc + 4)
+            elif opcode == 0b1100111: # jalr
+                heads.add(pc + 4)
+
+        return heads
 
 
-    def find_all_basic_blocks(self):
+    def find_all_superblocks(self):
         '''
-        Find all basic blocks and store them into the basic_blocks dict.
+        Find the superblocks starting at the heads and at the addresses
+        traces go on at, and store them into the superblocks dict. Other
+        instructions get no block, the executor runs them one at a time
+        until it reaches one.
         '''
-        for pc in range(self.rom_start,  self.prog_end, 4):
-            if not (pc in self.basic_blocks):
-                bb, hd = self.find_basic_block(pc)
-                self.basic_blocks[bb[0][0]] = bb
+        self.superblocks = {}
+        todo = list(self.find_heads())
+
+        while todo:
+            pc = todo.pop()
+
+            if pc in self.superblocks or \
+                    not (self.rom_start <= pc < self.prog_end):
+                continue
+
+            self.superblocks[pc], next_pc = self.find_superblock(pc)
+            todo.append(next_pc)
 
 
-    def slice_basic_block(self, bb_id):
+    def speculative(self, pc, written):
         '''
-        Determine which instructions in the basic block at address bb_id
-        could be executed in parallel, i.e. slice the block.
+        Whether the instruction at pc may run before a side exit it follows:
+        an ALU op that can't trap and writes a register not written earlier
+        in the trace, so it can be restored from its value at the entry.
+        '''
+        inst = self.get_inst(pc)
+        opcode = inst & 0b1111111
+        rd = (inst >> 7) & 0b11111
+
+        if rd in written:
+            return False
+        if opcode == 0b0110011:
+            # Division traps on the host
+            return not (inst >> 25 == 1 and (inst >> 12) & 0b111 >= 4)
+        return opcode in (0b0010011, 0b0110111, 0b0010111)
+
+
+    @staticmethod
+    def conflict(reads_a, writes_a, reads_b, writes_b):
+        '''
+        Whether two groups of instructions depend on each other. Accesses
+        through the same base register only meet on the same bytes,
+        different bases may point anywhere.
+        '''
+        def meet(x, y):
+            if not x.isdisjoint(y):
+                return True
+            bases_x = mem_bases(x)
+            bases_y = mem_bases(y)
+            return bool(bases_x) and bool(bases_y) and \
+                   len(bases_x | bases_y) > 1
+
+        return meet(writes_a, reads_b) or meet(reads_a, writes_b) or \
+               meet(writes_a, writes_b)
+
+
+    def slice_superblock(self, sb_id):
+        '''
+        Determine which instructions in the superblock at address sb_id
+        could be executed in parallel, i.e. slice the block. Instructions
+        before a side exit are not moved past it, those after it are only
+        moved up to its slice if speculative() allows.
         Return: a list of tuples, where each tuple contains addresses of
-        instructions that could be safely executed in parallel together.
+        instructions that could be safely executed in parallel together,
+        and a list with the side exit of every slice: None or a tuple of
+        the branch address, the exit address and the mask of registers to
+        restore when it is taken.
         '''
-        bb = self.basic_blocks[bb_id]
+        sb = self.superblocks[sb_id]
 
         slices = []
+        placed = []
+        written = set()
+        exit_floor = 0
 
-        for inst, rd, wd in bb[:-1]:
+        for inst, rd, wd, exit_pc in sb[:-1]:
             slice_id = len(slices)
-            
+            rd = set(rd)
+            wd = set(wd)
+
             for sinsts, srd, swd in slices[::-1]:
-                if set(wd).intersection(srd) or \
-                   set(rd).intersection(swd) or \
-                   set(wd).intersection(swd):
+                if self.conflict(rd, wd, srd, swd):
                     break
                 slice_id -= 1
 
+            if exit_pc is not None:
+                slice_id = max([slice_id, exit_floor] + placed)
+            elif not self.speculative(inst, written):
+                slice_id = max(slice_id, exit_floor)
+
             if (slice_id + 1) > len(slices):
                 slices.append(([], set(), set()))
 
@@ -191,36 +344,56 @@ class Program:
                     slice_id = i
                     free_space = True
                     break
-            
+
             if not free_space:
                 slices.append(([], set(), set()))
                 slice_id = len(slices) - 1
-            
+
             slices[slice_id][0].append(inst)
             slices[slice_id][1].update(rd)
             slices[slice_id][2].update(wd)
+            placed.append(slice_id)
+            written.update(wd)
+
+            if exit_pc is not None:
+                exit_floor = slice_id + 1
 
         res = []
+        exits = [None] * (len(slices) + 1)
+
         for sl in slices:
-            res.append(tuple(sl[0]))
+            # Same operations next to each other run as one vector op
+            res.append(tuple(sorted(sl[0], key=self.op_key)))
+
+        # Registers written above a side exit by instructions after it
+        for n, (inst, rd, wd, exit_pc) in enumerate(sb[:-1]):
+            if exit_pc is not None:
+                mask = 0
+                for (_, _, w, _), s in zip(sb[n + 1:-1], placed[n + 1:]):
+                    if s <= placed[n]:
+                        for r in w:
+                            mask |= 1 << r
+                exits[placed[n]] = (inst, exit_pc, mask)
 
-        res.append((bb[-1][0],))
+        res.append((sb[-1][0],))
 
-        return res
+        return res, exits
 
 
-    def slice_all_basic_blocks(self):
+    def slice_all_superblocks(self):
         '''
-        Slice all the basic blocks and store the result in the
-        sliced_blocks dict. Also print some stats.
+        Slice all the superblocks and store the result in the
+        sliced_blocks and side_exits dicts. Also print some stats.
         '''
         self.sliced_blocks = {}
+        self.side_exits = {}
         stat_max_slice_len = 0
         stat_total_slice_len = 0
         stat_num_slices = 0
+        stat_num_exits = 0
 
-        for bb in self.basic_blocks:
-            sliced = self.slice_basic_block(bb)
+        for sb in self.superblocks:
+            sliced, exits = self.slice_superblock(sb)
 
             if sliced:
                 for sl in sliced:
@@ -229,13 +402,16 @@ class Program:
                     stat_num_slices += 1
                     stat_total_slice_len += len(sl)
 
-                self.sliced_blocks[bb] = sliced
+                stat_num_exits += len([e for e in exits if e])
+                self.sliced_blocks[sb] = sliced
+                self.side_exits[sb] = exits
 
         self.stat_max_slice_len = stat_max_slice_len
         avg_len = stat_total_slice_len / stat_num_slices
         print(f'Max slice length:        {stat_max_slice_len}')
         print(f'Avg slice length:        {avg_len:.02f}')
         print(f'Number of sliced blocks: {len(self.sliced_blocks)}')
+        print(f'Number of side exits:    {stat_num_exits}')
 
         num_cycles = 0
         num_idle_cycles = 0
@@ -260,10 +436,27 @@ class Program:
         return inst
 
 
+    def op_key(self, pc):
+        '''
+        Operation of the instruction at address pc: opcode and funct3, plus
+        funct7 where it selects the operation.
+        '''
+        inst = self.get_inst(pc)
+        opcode = inst & 0b1111111
+        funct3 = (inst >> 12) & 0b111
+        funct7 = inst >> 25
+
+        if opcode == 0b0110011 or (opcode == 0b0010011 and funct3 in (1, 5)):
+            return (opcode, funct3, funct7)
+        return (opcode, funct3, 0)
+
+
     def decode_inst(self, pc):
         '''
         Decode a single instruction at address pc and determine its
         dependencies and whether it is a branching instruction or not.
+        The executor sums up the pc increments of a slice, so the pc is
+        not a dependency.
         Return: a tuple of read registers/memmory,
                 a tuple of written registers/memory,
                 True/False if branching,
@@ -352,7 +545,6 @@ class Program:
 
                 branch = True
                 pc_updated = True
-                writes = (PC_REG,)
                 reads = (rs1, rs2)
                 pc += imm
 
@@ -365,8 +557,7 @@ class Program:
                 imm = twocomp(imm, 21)
 
                 pc_updated = True
-                reads = (PC_REG,)
-                writes = (PC_REG, rd)
+                writes = (rd,)
                 pc += imm
 
             case 0b1100111: # jalr
@@ -376,8 +567,8 @@ class Program:
 
                 pc_updated = True
                 branch = True
-                reads = (PC_REG, rs1)
-                writes = (PC_REG, rd)
+                reads = (rs1,)
+                writes = (rd,)
 
             case 0b0110111: # lui
                 rd = (inst >> 7) & 0b11111
@@ -385,7 +576,6 @@ class Program:
 
             case 0b0010111: # auipc
                 rd = (inst >> 7) & 0b11111
-                reads = (PC_REG,)
                 writes = (rd,)
 
             case 0b1110011: # Env call & breakpoint
@@ -415,14 +605,17 @@ class Program:
 
         for pc in ids:
             sb = self.sliced_blocks[pc]
-            file.write(f'0x{sb[0][0]:08X}:\n')
+            file.write(f'0x{pc:08X}:\n')
 
-            for sl in sb:
+            for sl, ex in zip(sb, self.side_exits[pc]):
                 if idle_cycles:
                     sl = sl + (0,) * (self.stat_max_slice_len - len(sl))
                 file.write('    ')
                 for addr in sl:
                     file.write(f'0x{addr:08X} ')
+                if ex:
+                    file.write(f'exit 0x{ex[0]:08X} -> 0x{ex[1]:08X} '
+                               f'restore 0x{ex[2]:08X}')
                 file.write('\n')
             file.write('\n')
 
@@ -430,29 +623,52 @@ class Program:
 
 
     def dump_to_ilp(self, file_name):
-        file = open(file_name, 'wb')
-
-        file.write(pack('4s', bytes('ILP', 'utf-8')))
-        file.write(pack('I', len(self.sliced_blocks)))
-        file.write(pack('I', self.stat_max_slice_len))
-        ids = list(self.sliced_blocks.keys())
-        ids.sort()
+        '''
+        Write the sliced blocks for device_load_ilp_table(): a header, an
+        index with the table range of the block at every instruction word
+        and the slices as instruction indices, each ended by ILP_SLICE_END.
+        A block with side exits starts with ILP_BLOCK_SAVE and the mask of
+        registers to keep at its entry, a slice with one starts with
+        ILP_SLICE_EXIT, the branch, the exit and the registers to restore.
+        '''
+        n_blocks = (self.prog_end - self.rom_start) // 4
+        index = [(0, 0)] * n_blocks
+        table = []
+
+        for pc in sorted(self.sliced_blocks):
+            offset = len(table)
+            exits = self.side_exits[pc]
+            save = 0
+            for ex in exits:
+                if ex:
+                    save |= ex[2]
+            if save:
+                table.extend((ILP_BLOCK_SAVE, save))
+            for sl, ex in zip(self.sliced_blocks[pc], exits):
+                if ex:
+                    table.extend((ILP_SLICE_EXIT, (ex[0] - self.rom_start) // 4,
+                                  (ex[1] - self.rom_start) // 4, ex[2]))
+                table.extend((addr - self.rom_start) // 4 for addr in sl)
+                table.append(ILP_SLICE_END)
+            index[(pc - self.rom_start) // 4] = (offset, len(table) - offset)
+
+        hdr_size = calcsize(ILP_HDR_FMT)
+        index_offset = hdr_size
+        table_offset = index_offset + n_blocks * 8
+
+        def header(checksum):
+            return pack(ILP_HDR_FMT, ILP_MAGIC, ILP_VERSION, hdr_size, checksum,
+                        self.elf_hash, self.rom_start, n_blocks,
+                        self.stat_max_slice_len, len(table),
+                        index_offset, table_offset)
 
-        offset = 0
-        for pc in ids:
-            sb = self.sliced_blocks[pc]
-            size = 0
-            for sl in sb:
-                size += (len(sl) + 1) * 4
-            file.write(pack('III', pc, offset, size))
-            offset += size
+        file = open(file_name, 'wb')
+        file.write(header(fnv1a(header(0), 32)))
 
-        for pc in ids:
-            sb = self.sliced_blocks[pc]
-            for sl in sb:
-                sl = sl + (0,)
-                file.write(pack('I' * len(sl), *sl))
+        for offset, size in index:
+            file.write(pack('<II', offset, size))
 
+        file.write(pack(f'<{len(table)}I', *table))
         file.close()
 
 